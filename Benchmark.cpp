@@ -0,0 +1,183 @@
+// Benchmark.cpp
+// Contains implementations of functions declared in Benchmark.h
+
+// Include the header file
+#include "Benchmark.h"
+
+#ifdef BENCHMARK
+
+// BenchProfile
+// A named set of simulator parameters
+typedef struct
+{
+  const char* name;
+  SimProfile model;
+} BenchProfile;
+
+// Powder profiles swept by the benchmark
+static const BenchProfile profiles[] =
+{
+  {"varget", {0.021, 0.15, 62.0, 0.03, 0, 0, BENCH_SCALE_MODEL, BENCH_SETTLE_TAU}},
+  {"varget_bulk_variance", {0.021, 0.15, 62.0, 0.10, 0, 0, BENCH_SCALE_MODEL, BENCH_SETTLE_TAU}},
+  {"varget_scale_noise", {0.021, 0.15, 62.0, 0.03, 0, 1, BENCH_SCALE_MODEL, BENCH_SETTLE_TAU}},
+  {"varget_drift", {0.021, 0.15, 62.0, 0.03, 0.05, 0, BENCH_SCALE_MODEL, BENCH_SETTLE_TAU}},
+  {"retumbo", {0.045, 0.12, 58.0, 0.03, 0, 0, BENCH_SCALE_MODEL, BENCH_SETTLE_TAU}}
+};
+#define BENCH_PROFILE_COUNT (sizeof(profiles) / sizeof(profiles[0]))
+
+// Target weights swept for each profile
+static const float targets[] = {5.0, 32.0, 100.0, 250.0};
+#define BENCH_TARGET_COUNT (sizeof(targets) / sizeof(targets[0]))
+
+// Sweep position
+static bool started = false;
+static byte configIndex = 0; // profile * BENCH_TARGET_COUNT + target
+static byte chargeCount = 0;
+
+// Results of the current configuration
+static unsigned int throwTimes[BENCH_CHARGES];
+static float bulkHistory[BENCH_CHARGES];
+static float kernelHistory[BENCH_CHARGES];
+static byte overthrows = 0;
+
+static void startConfig();
+static void finishConfig();
+static unsigned int percentile(byte percent);
+static byte convergence();
+
+// BenchmarkTarget()
+// Returns the target weight of the configuration being run, starting the sweep on the first call
+float BenchmarkTarget()
+{
+  if(!started)
+  {
+    started = true;
+    randomSeed(BENCH_SEED);
+    startConfig();
+  }
+
+  byte index = (configIndex < BENCH_PROFILE_COUNT * BENCH_TARGET_COUNT) ? configIndex : (BENCH_PROFILE_COUNT * BENCH_TARGET_COUNT) - 1;
+
+  return targets[index % BENCH_TARGET_COUNT];
+}
+
+// BenchmarkCharge()
+// Records a completed charge, moving on to the next configuration once BENCH_CHARGES have been thrown
+void BenchmarkCharge(float weight, float target, long throwTime, float bulkCalibration, float kernelWeight)
+{
+  // Ignore charges thrown before the sweep started or after it finished
+  if(!started || configIndex >= BENCH_PROFILE_COUNT * BENCH_TARGET_COUNT)
+  {
+    return;
+  }
+
+  throwTimes[chargeCount] = constrain(throwTime, 0, 65535);
+  bulkHistory[chargeCount] = bulkCalibration;
+  kernelHistory[chargeCount] = kernelWeight;
+
+  // More than one division over the target is an overthrow
+  if(weight > target + SCALE_DIVISION + 0.001)
+  {
+    overthrows++;
+  }
+
+  chargeCount++;
+  if(chargeCount < BENCH_CHARGES)
+  {
+    return;
+  }
+
+  finishConfig();
+
+  configIndex++;
+  if(configIndex < BENCH_PROFILE_COUNT * BENCH_TARGET_COUNT)
+  {
+    startConfig();
+  }
+  else
+  {
+    Serial.println("BENCH done");
+  }
+}
+
+// startConfig()
+// Loads the simulator profile for the current configuration and clears its results
+static void startConfig()
+{
+  SimSetProfile(&profiles[configIndex / BENCH_TARGET_COUNT].model);
+  chargeCount = 0;
+  overthrows = 0;
+}
+
+// finishConfig()
+// Reports the results of the current configuration as a JSON object
+static void finishConfig()
+{
+  // Sort throw times for the percentiles
+  for(byte i = 1; i < BENCH_CHARGES; i++)
+  {
+    unsigned int time = throwTimes[i];
+    byte j = i;
+    while(j > 0 && throwTimes[j - 1] > time)
+    {
+      throwTimes[j] = throwTimes[j - 1];
+      j--;
+    }
+    throwTimes[j] = time;
+  }
+
+  BenchSummary summary;
+  summary.p50 = percentile(50);
+  summary.p95 = percentile(95);
+  summary.p99 = percentile(99);
+  summary.overthrows = overthrows;
+  summary.converge = convergence();
+
+  Serial.print("BENCH {\"profile\": \"");
+  Serial.print(profiles[configIndex / BENCH_TARGET_COUNT].name);
+  Serial.print("\", \"target\": ");
+  Serial.print(targets[configIndex % BENCH_TARGET_COUNT], 2);
+  Serial.print(", \"charges\": ");
+  Serial.print(BENCH_CHARGES);
+  Serial.print(", \"p50_ms\": ");
+  Serial.print(summary.p50);
+  Serial.print(", \"p95_ms\": ");
+  Serial.print(summary.p95);
+  Serial.print(", \"p99_ms\": ");
+  Serial.print(summary.p99);
+  Serial.print(", \"overthrows\": ");
+  Serial.print(summary.overthrows);
+  Serial.print(", \"converge_charges\": ");
+  Serial.print(summary.converge);
+  Serial.println("}");
+}
+
+// percentile()
+// Nearest rank percentile of the sorted throw times
+static unsigned int percentile(byte percent)
+{
+  int rank = ((percent * BENCH_CHARGES) + 99) / 100;
+
+  return throwTimes[(rank > 0) ? rank - 1 : 0];
+}
+
+// convergence()
+// Returns the number of charges thrown before both calibration values settled within their band around the final value
+static byte convergence()
+{
+  float finalBulk = bulkHistory[BENCH_CHARGES - 1];
+  float finalKernel = kernelHistory[BENCH_CHARGES - 1];
+
+  byte converge = 0;
+  for(byte i = 0; i < BENCH_CHARGES; i++)
+  {
+    if(fabs(bulkHistory[i] - finalBulk) > BENCH_CONVERGE_BULK || fabs(kernelHistory[i] - finalKernel) > (finalKernel * BENCH_CONVERGE_KERNEL))
+    {
+      converge = i + 1;
+    }
+  }
+
+  return converge;
+}
+
+#endif // BENCHMARK
@@ -0,0 +1,43 @@
+// Benchmark.h
+// Monte-Carlo throw time and accuracy benchmark, run against the powder simulator
+// Sweeps a table of powder profiles and target weights, running BENCH_CHARGES charges through the Dispense and Evaluate states for each
+// Results are reported over serial as one JSON object per line after "BENCH ", the host build in host/ runs the sweep and saves them to a results file for each build, and compares two files
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+// External libraries
+#include <Arduino.h> // Standard Arduino libraries
+
+// Internal libraries
+#include "Scale.h" // Scale divisions
+#include "Simulator.h" // Powder and scale simulation
+
+// Uncomment to run the benchmark sweep (requires SIMULATE_POWDER)
+//#define BENCHMARK
+
+// Benchmark configuration
+#define BENCH_CHARGES 16 // Charges thrown for each profile and target weight
+#define BENCH_SEED 1234 // Random seed so every build sees the same powder
+#define BENCH_SCALE_MODEL SIM_SCALE_FIRST_ORDER // Scale response every profile is run with, change it to check the dispense against other scales (the baselines only fit one)
+#define BENCH_SETTLE_TAU SIM_SETTLE_TAU // Time constant in ms of that response
+#define BENCH_CONVERGE_BULK 0.02 // secondBulkCalibration is converged once it stays within this of its final value
+#define BENCH_CONVERGE_KERNEL 0.02 // kernelWeight is converged once it stays within this fraction of its final value
+
+// BenchSummary
+// Result of one profile and target weight
+typedef struct
+{
+  unsigned int p50; // Throw time percentiles in ms
+  unsigned int p95;
+  unsigned int p99;
+  byte overthrows; // Charges more than one division over the target
+  byte converge; // Charges until the adaptive calibration stopped drifting
+} BenchSummary;
+
+#ifdef BENCHMARK
+float BenchmarkTarget();
+void BenchmarkCharge(float weight, float target, long throwTime, float bulkCalibration, float kernelWeight);
+#endif // BENCHMARK
+
+#endif // BENCHMARK_H
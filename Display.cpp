@@ -166,6 +166,32 @@ void CalibrationScreen()
   lcd.print(" Calibrating Powder ");
 }
 
+// VerifyProfileScreen()
+// Displayed during Calibration state while a saved powder profile is checked with a verification throw
+void VerifyProfileScreen(int powder)
+{
+  // Print display lines 1 and 2
+  clearLine(0);
+  lcd.setCursor(0,0);
+  lcd.print(LINE1);
+  
+  clearLine(1);
+  lcd.setCursor(0,1);
+  lcd.print(LINE2);
+  lcd.print(VERSION_MAJOR);
+  lcd.print(".");
+  lcd.print(VERSION_MINOR);
+
+  // Print display line 3
+  clearLine(2);
+
+  // Print display line 4
+  clearLine(3);
+  lcd.setCursor(0,3);
+  lcd.print("  Checking Powder ");
+  lcd.print(powder);
+}
+
 void StageOneBulk(float measured, float assigned)
 {
   // Print display lines 1 and 2
@@ -243,7 +269,7 @@ void CalibrationComplete(float bulk, float kernel)
 
 // IdleScreen()
 // Displayed during the idle state
-void IdleScreen(float targetWeight, float errorMargin)
+void IdleScreen(float targetWeight, float errorMargin, int powder)
 {
   // Print display lines 1 and 2
   clearLine(0);
@@ -259,7 +285,8 @@ void IdleScreen(float targetWeight, float errorMargin)
   // Print display line 4
   clearLine(3);
   lcd.setCursor(0,3);
-  lcd.print("  Waiting to Start  ");
+  lcd.print("  Waiting  Powder ");
+  lcd.print(powder);
 }
 
 // ReadyScreen()
@@ -423,6 +450,38 @@ void LowChargeScreen(float targetWeight, float finalWeight, int duration, float
   lcd.print("Push ^ To Add Kernel");
 }
 
+// ErrorScreen()
+// Displayed during the error states, with the error tracker value and what the user has to do to clear it
+void ErrorScreen(int error, bool recoverable)
+{
+  // Print display lines 1 and 2
+  clearLine(0);
+  lcd.setCursor(0,0);
+  lcd.print(LINE1);
+
+  clearLine(1);
+  lcd.setCursor(0,1);
+  lcd.print("   Error Detected   ");
+
+  // Print display line 3
+  clearLine(2);
+  lcd.setCursor(0,2);
+  lcd.print("   Error Code = ");
+  lcd.print(error);
+
+  // Print display line 4
+  clearLine(3);
+  lcd.setCursor(0,3);
+  if(recoverable)
+  {
+    lcd.print(" Disable to Proceed ");
+  }
+  else
+  {
+    lcd.print(" Power Cycle Needed ");
+  }
+}
+
 // noErrorTopLines()
 // Prints the top two lines for no-error screens (Brand + version info)
 void noErrorTopLines(float errorMargin)
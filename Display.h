@@ -31,11 +31,12 @@ void WaitingToCalibrate(int motorDirection);
 void MotorDirectionSetup();
 void MotorDirectionStored(int direction);
 void CalibrationScreen();
+void VerifyProfileScreen(int powder);
 void StageOneBulk(float measured, float assigned);
 void Trickle(float measured, float assigned);
 void CalibrationComplete(float bulk, float kernel);
 
-void IdleScreen(float targetWeight, float errorMargin);
+void IdleScreen(float targetWeight, float errorMargin, int powder);
 void ReadyScreen(float targetWeight, float errorMargin);
 
 void BulkScreen(float targetWeight, float errorMargin);
@@ -46,6 +47,8 @@ void OverthrowScreen(float targetWeight, float finalWeight, int duration, float
 void StaleChargeScreen(float targetWeight, float finalWeight, int duration, float errorMargin);
 void LowChargeScreen(float targetWeight, float finalWeight, int duration, float errorMargin);
 
+void ErrorScreen(int error, bool recoverable);
+
 void noErrorTopLines(float errorMargin);
 void eraseTopLines();
 
@@ -0,0 +1,134 @@
+// Estimator.cpp
+// Contains implementations of functions declared in Estimator.h
+
+// Include the header file
+#include "Estimator.h"
+
+// EstimatorReset()
+// Starts an estimator over from a prior value and the variance of that prior
+void EstimatorReset(Estimator* estimator, float value, float variance)
+{
+  estimator->value = value;
+  estimator->variance = variance;
+  estimator->observations = 0;
+}
+
+// EstimatorObserve()
+// Updates the estimate from one observed move that produced output from input, noiseVariance is the variance of the observed output
+// Returns false if the observation could not be used, or if it showed a change and the estimate was restarted around it
+bool EstimatorObserve(Estimator* estimator, float input, float output, float noiseVariance)
+{
+  if(input <= 0 || noiseVariance <= 0)
+  {
+    return false;
+  }
+
+  // Forget part of what is known before the new observation, so the estimate never stops adapting
+  float variance = estimator->variance / ESTIMATOR_FORGETTING;
+
+  // Difference from the predicted output, and its variance from the estimate and from the observation itself
+  float innovation = output - (estimator->value * input);
+  float predictedVariance = (input * input * variance) + noiseVariance;
+
+  // An observation this far out means the estimate is wrong rather than the observation unlucky, widen the uncertainty to cover it so the estimate moves most of the way at once
+  bool changed = (innovation * innovation) > (ESTIMATOR_CHANGE_THRESHOLD * ESTIMATOR_CHANGE_THRESHOLD * predictedVariance);
+  if(changed)
+  {
+    variance = (innovation * innovation) / (input * input);
+    predictedVariance = (input * input * variance) + noiseVariance;
+    estimator->observations = 0;
+  }
+
+  float gain = (variance * input) / predictedVariance;
+  estimator->value += gain * innovation;
+  estimator->variance = (1 - (gain * input)) * variance;
+
+  if(estimator->observations < 65535)
+  {
+    estimator->observations++;
+  }
+
+  return !changed;
+}
+
+// EstimatorStdDev()
+// Returns the standard deviation of the current estimate
+float EstimatorStdDev(const Estimator* estimator)
+{
+  return sqrt(estimator->variance);
+}
+
+// StatsReset()
+// Forgets every observation
+void StatsReset(RunningStats* stats)
+{
+  stats->mean = 0;
+  stats->variance = 0;
+  stats->upperVariance = 0;
+  stats->weight = 0;
+  stats->count = 0;
+}
+
+// StatsObserve()
+// Adds one observation, forgetting is the weight kept by the previous observations (1 keeps them all)
+void StatsObserve(RunningStats* stats, float value, float forgetting)
+{
+  float delta = value - stats->mean;
+
+  // Clip outliers once the spread is known
+  if(StatsReady(stats))
+  {
+    float limit = STATS_CLIP * StatsStdDev(stats);
+    delta = constrain(delta, -limit, limit);
+  }
+
+  // Weighted incremental mean and variance, the newest observation has weight 1
+  stats->weight = (forgetting * stats->weight) + 1;
+  float fraction = 1 / stats->weight;
+  stats->mean += fraction * delta;
+  stats->variance = (1 - fraction) * (stats->variance + (fraction * delta * delta));
+  float above = (delta > 0) ? delta : 0;
+  stats->upperVariance = (1 - fraction) * (stats->upperVariance + (fraction * 2 * above * above));
+
+  if(stats->count < 65535)
+  {
+    stats->count++;
+  }
+}
+
+// StatsStdDev()
+// Returns the standard deviation of the observations
+float StatsStdDev(const RunningStats* stats)
+{
+  return sqrt(stats->variance);
+}
+
+// StatsUpperStdDev()
+// Returns the standard deviation of the observations from the deviations above the mean alone
+float StatsUpperStdDev(const RunningStats* stats)
+{
+  return sqrt(stats->upperVariance);
+}
+
+// StatsReady()
+// Returns true once there have been enough observations to use the variance
+bool StatsReady(const RunningStats* stats)
+{
+  return stats->count >= STATS_MIN_COUNT;
+}
+
+// NormalQuantile()
+// Rational approximation from Abramowitz and Stegun 26.2.23, accurate to 0.0005 standard deviations for 0 < p < 1
+float NormalQuantile(float p)
+{
+  if(p <= 0 || p >= 1)
+  {
+    return 0;
+  }
+
+  float q = (p < 0.5) ? p : (1 - p);
+  float t = sqrt(-2 * log(q));
+  float z = t - ((2.515517 + (0.802853 * t) + (0.010328 * t * t)) / (1 + (1.432788 * t) + (0.189269 * t * t) + (0.001308 * t * t * t)));
+
+  return (p < 0.5) ? -z : z;
+}
\ No newline at end of file
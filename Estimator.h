@@ -0,0 +1,52 @@
+// Estimator.h
+// Scalar recursive least squares estimator (a one state Kalman filter) for the calibration values
+// Each estimator learns the gain of a proportional model, output = value * input, from one observed move at a time
+// A forgetting factor below 1 discounts old observations so the estimate keeps tracking slow drift, such as the powder density changing as the hopper empties
+// RunningStats keeps an exponentially weighted mean and variance of a measured error, so the dispense can be planned from how widely it spreads
+// Its upper variance only counts errors above the mean, an overthrow only depends on that side and underthrows (such as while a latency is still being learned) do not widen it
+
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+// External libraries
+#include <Arduino.h> // Standard Arduino libraries
+
+#define ESTIMATOR_FORGETTING 0.9 // Weight kept by the previous estimate at each observation, about the last 10 observations count
+#define ESTIMATOR_CHANGE_THRESHOLD 4 // Observations further than this many standard deviations from the prediction are taken as a change, such as a different powder
+#define STATS_MIN_COUNT 5 // Observations RunningStats needs before its variance is used, and before outliers are clipped
+#define STATS_CLIP 4 // Observations further than this many standard deviations from the mean are clipped to it, so a single misread weight does not swamp the spread
+
+// Estimator
+// Estimate of one calibration value and its uncertainty
+typedef struct
+{
+  float value; // Current estimate
+  float variance; // Variance of the current estimate
+  unsigned int observations; // Observations used since the last reset
+} Estimator;
+
+void EstimatorReset(Estimator* estimator, float value, float variance);
+bool EstimatorObserve(Estimator* estimator, float input, float output, float noiseVariance);
+float EstimatorStdDev(const Estimator* estimator);
+
+// RunningStats
+// Exponentially weighted mean and variance of an observed value
+typedef struct
+{
+  float mean;
+  float variance;
+  float upperVariance; // Twice the mean square of the deviations above the mean, equal to variance for a symmetric spread
+  float weight; // Sum of the weights of the observations so far, approaches 1 / (1 - forgetting)
+  unsigned int count; // Observations since the last reset
+} RunningStats;
+
+void StatsReset(RunningStats* stats);
+void StatsObserve(RunningStats* stats, float value, float forgetting);
+float StatsStdDev(const RunningStats* stats);
+float StatsUpperStdDev(const RunningStats* stats);
+bool StatsReady(const RunningStats* stats);
+
+// Standard normal quantile, the number of standard deviations below which a fraction p of a normal distribution lies
+float NormalQuantile(float p);
+
+#endif // ESTIMATOR_H
\ No newline at end of file
@@ -16,32 +16,11 @@
 #include "Steppers.h" // Stepper motor controls (triggering/aborting powder dispenses by kernel)
 #include "Display.h" // Display controls
 #include "StateMachine.h" // State machine operations
+#include "Timing.h" // Charge phase timing and USB serial commands
+#include "Storage.h" // EEPROM store for settings and powder profiles
+#include "Tasks.h" // Background tasks run from the main loop and every wait
 
-// State machine tracker (states described as below)
-// 0 = Setup
-// 1 = Calibration
-// 2 = Idle
-// 3 = Ready
-// 4 = Dispense/Run
-// 5 = Evaluate
-// -1 = Error identification
-// -2 = Recoverable Error (waiting for reset)
-// -3 = Unrecoverable Error (waiting for power cycle)
-static int currentState = 0;
-#define SETUP_STATE 0
-#define CALIBRATION_STATE 1
-#define IDLE_STATE 2
-#define READY_STATE 3
-#define DISPENSE_STATE 4
-#define EVALUATE_STATE 5
-#define ERRORID_STATE -1
-#define RECOVERABLE_STATE -2
-#define UNRECOVERABLE_STATE -3
-// The errors below are declared and stored within StateMachine.h, NOT here
-// Error tracker
-// 0 = No error
-// 1 = Scale response timed out (recoverable)
-// 2 = Scale response includes out of range characters (unrecoverable, fix scale configuration)
+// The state machine tracker values, state table and error tracker are declared within StateMachine.h
 
 // Pin definitions
 #define ENABLE_BTN 5
@@ -90,43 +69,31 @@ void setup() {
 
   // Initialize the stepper motors
   MotorSetup();
+  EmergencyStopSetup(ENABLE_BTN);
   Serial.println("Stepper motors initialized");
 
+  // Load the saved settings and profiles
+  StorageBegin();
+
   // Advance state machine to the calibration state and move GUI to "Waiting to Calibrate"
-  currentState = 1;
+  StartStateMachine();
 }
 
 void loop() {
+  // Pump the scale driver, motion queues and serial commands, the states run them too while they wait
+  RunTasks();
+
   // Temporary do-nothing loop
   if(!(i % 10000))
   {
     //Serial.print("Top of main loop, #");
     //Serial.print(i);
     //Serial.print(" currentState = ");
-    //Serial.println(currentState);
+    //Serial.println(CurrentState());
   }
 
-  switch(currentState)
-  {
-    case SETUP_STATE:
-      // We should never get here, we don't ever go back to setup state
-      break;
-    case CALIBRATION_STATE:
-      currentState = CalibrationState();
-      break;
-    case IDLE_STATE:
-      currentState = IdleState();
-      break;
-    case READY_STATE:
-      currentState = ReadyState();
-      break;
-    case DISPENSE_STATE:
-      currentState = DispenseState();
-      break;
-    case EVALUATE_STATE:
-      currentState = EvaluateState();
-      break;
-  }
+  // Run the current state, the state table makes any change of state
+  RunStateMachine();
 
   i++;
 }
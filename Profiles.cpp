@@ -0,0 +1,39 @@
+// Profiles.cpp
+// Contains implementations of functions declared in Profiles.h
+
+// Include the header file
+#include "Profiles.h"
+
+// LoadProfile()
+// Reads the profile saved for a powder slot
+// Returns false if the slot is out of range or has never been saved
+bool LoadProfile(byte slot, PowderProfile* profile)
+{
+#ifdef BENCHMARK
+  // Benchmark builds always calibrate from scratch
+  return false;
+#endif
+
+  if(slot >= PROFILE_COUNT)
+  {
+    return false;
+  }
+
+  return StorageRead(PROFILE_KEY + slot, profile, sizeof(PowderProfile));
+}
+
+// SaveProfile()
+// Saves the profile of a powder slot, it reaches the EEPROM once the trickler is idle
+void SaveProfile(byte slot, const PowderProfile* profile)
+{
+#ifdef BENCHMARK
+  return;
+#endif
+
+  if(slot >= PROFILE_COUNT)
+  {
+    return;
+  }
+
+  StorageWrite(PROFILE_KEY + slot, profile, sizeof(PowderProfile));
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+// Profiles.h
+// Calibration profiles for up to PROFILE_COUNT powders, kept in the EEPROM store
+// A profile holds what calibration and the adaptive dispense have learned about one powder, so switching back to a known powder skips the full calibration
+
+#ifndef PROFILES_H
+#define PROFILES_H
+
+// External libraries
+#include <Arduino.h> // Standard Arduino libraries
+
+// Internal libraries
+#include "Storage.h" // EEPROM store
+#include "Benchmark.h" // Benchmark builds do not use profiles
+
+#define PROFILE_COUNT 4 // Number of powder slots
+#define PROFILE_KEY 2 // Storage key of the first powder slot's profile, the other slots follow it
+
+// PowderProfile
+// Calibration values learned for one powder
+typedef struct
+{
+  float grainsPerRev; // grainsPerRev estimate and its standard deviation
+  float bulkUncertainty;
+  float kernelWeight; // kernelWeight estimate and its standard deviation
+  float kernelUncertainty;
+  float secondBulkCalibration;
+  uint16_t bulkLatency; // Learned bulk fall latency in ms
+  byte startup; // Settings startup count when saved, wrapping around
+  byte errorMargin; // Error margin in hundredths of a grain
+} PowderProfile;
+
+bool LoadProfile(byte slot, PowderProfile* profile);
+void SaveProfile(byte slot, const PowderProfile* profile);
+
+#endif // PROFILES_H
\ No newline at end of file
@@ -4,10 +4,75 @@
 // Include the header file
 #include "Scale.h"
 #include "Display.h"
+#include "Simulator.h"
+#include "Steppers.h"
+#include "Tasks.h"
+
+// The simulator stands in for the scale's serial port when SIMULATE_POWDER is defined
+#ifdef SIMULATE_POWDER
+#define ScaleSerial SimScale
+#else
+#define ScaleSerial Serial1
+#endif
 
 // Persistent weight variables
 float latestWeight;
 
+// A single weight sample received from the scale
+typedef struct
+{
+  ScaleReading reading;
+  unsigned long time; // millis() when the weight was requested (or received, in stream mode)
+} ScaleSample;
+
+// Sample ring buffer, filled by ScaleUpdate()
+static ScaleSample samples[SCALE_SAMPLE_COUNT];
+static byte sampleHead = 0; // Index of the most recent sample
+static unsigned long sampleCount = 0; // Total samples received
+static unsigned long consumedCount = 0; // Samples already handed out by ReadScale()
+
+// Incremental frame parser state
+static char frame[SCALE_FRAME_LEN];
+static byte frameLen = 0;
+static bool frameError = false; // Set when a received frame contained out of range characters
+
+// Pipelined PRT request state
+static bool requestPending = false;
+static unsigned long requestTime = 0;
+static unsigned long discardBefore = 0; // Samples requested before this time are discarded (set by zeroScale())
+
+// Streaming driver statistics
+static unsigned long droppedFrames = 0;
+static unsigned long timeouts = 0;
+static unsigned long badFrames = 0; // Frames that failed to parse
+static unsigned long partialFrames = 0; // Frames discarded before their line ending arrived
+static unsigned long flushedBytes = 0; // Bytes discarded by flushSerial()
+static unsigned int latencyHistogram[SCALE_LATENCY_BUCKETS]; // PRT request to complete frame latency
+static unsigned int maxLatency = 0;
+static int samplesPerSecond = 0;
+static int samplesThisSecond = 0;
+static unsigned long secondStart = 0;
+
+// Stability engine state
+static float noiseEstimate = 0; // Live noise estimate in scale divisions
+static byte toleranceFloor = 0; // Least window tolerance in divisions, raised by windows that did not stabilise until the noise estimate covers it
+static bool motorsStill = true; // Neither motor was moving when the current StableWeight() call started, so its window can teach the noise estimate
+static byte stableStatus = STABLE_OK;
+static float stableConfidence = 1;
+static unsigned long stableSince = 0; // Time of the first sample the last StableWeight() result was taken from
+
+// Settle time accounting
+static unsigned long settleMillis = 0;
+static int settleCount = 0;
+
+static int readSample(ScaleSample* sample);
+static Weight stableWindow(int durationMillis, unsigned long deadline);
+static Weight stableHeader(int durationMillis, unsigned long deadline);
+static Weight robustResult(unsigned long since, byte status);
+static bool extrapolate(long a, long b, long c, long* result);
+static void completeFrame();
+static void recordLatency(unsigned long latency);
+
 // SetupScale()
 // Begins serial communications with the scale
 // Waits until serial number is received from the scale before returning
@@ -15,24 +80,24 @@ float latestWeight;
 void SetupScale()
 {
   // Begin serial comms with scale at selected baudrate
-  Serial1.begin(19200);
+  ScaleSerial.begin(19200);
 
   // Try to request the serial number of scale until it eventually responds, flushing old or partial commands from its memory
   do
   {
-    Serial1.write("?ID\r");
+    ScaleSerial.write("?ID\r");
 
     delay(50);
-  } while(!Serial1.available());
+  } while(!ScaleSerial.available());
 
   char response[20] = "                    ";
   char newChar;
   int i = 0;
 
   Serial.print("Scale serial number is '");
-  while(Serial1.available())
+  while(ScaleSerial.available())
   {
-    newChar = Serial1.read();
+    newChar = ScaleSerial.read();
     Serial.print(newChar);
 
     response[i] = newChar;
@@ -40,171 +105,889 @@ void SetupScale()
     LcdSetup(response);
   }
   Serial.println("'");
+
+  // Start the streaming driver with an empty frame buffer
+  frameLen = 0;
+  secondStart = millis();
 }
 
-// StableWeight(int millis)
-// Waits until the weight has been stable across the given timespan and then returns the stabilized weight value in float format
+// StableWeight(int millis, byte mode)
+// Waits until the weight is stable and then returns the stabilized weight value in float format, for the calibration
+// The dispense compares its weights in centigrains and uses StableCentigrains() directly
 // Error values:
-float StableWeight(int durationMillis)
+// -5000 = Scale response timeout
+// -6000 = Scale response error (out of range characters, likely a formatting issue)
+float StableWeight(int durationMillis, byte mode)
 {
-  bool success = false;
-  float tempWeight;
-  long tempTime;
+  return WeightToGrains(StableCentigrains(durationMillis, mode));
+}
 
-  float retVal = ReadScale();
-  long lastTime = millis();
+// StableCentigrains(int millis, byte mode)
+// Waits until the weight is stable and then returns the stabilized weight in centigrains
+// STABLE_WINDOW requires the weight to stay within the noise tolerance across the given timespan (lengthened automatically on a noisy scale)
+// STABLE_HEADER returns once the scale itself reports a stable (ST) weight, using the timespan only as a fallback for frames without a header
+// Never waits longer than durationMillis + STABLE_BUDGET, if the budget expires the median of the recent samples is returned and StableStatus() reports STABLE_UNSTABLE
+// The noise estimate only learns from calls made with both motors still, a loop watching the weight while a motor runs uses LatestWeight()
+// Error values (StableWeight()'s in centigrains):
+// -500000 = Scale response timeout
+// -600000 = Scale response error (out of range characters, likely a formatting issue)
+Weight StableCentigrains(int durationMillis, byte mode)
+{
+  unsigned long startTime = millis();
+  unsigned long deadline = startTime + durationMillis + STABLE_BUDGET;
+  Weight result;
 
-  float newVal = retVal;
-  long newTime = lastTime;
+  stableStatus = STABLE_OK;
+  stableConfidence = 1;
+  stableSince = startTime;
+  motorsStill = !IsTrickling() && !IsBulking();
 
+  if(mode == STABLE_HEADER)
+  {
+    result = stableHeader(durationMillis, deadline);
+  }
+  else
+  {
+    result = stableWindow(durationMillis, deadline);
+  }
 
-  // While loop to sit in until weight reading stabilizes
-  while(!success)
+  if(stableStatus == STABLE_UNSTABLE)
   {
-    // Capture current weight into tempWeight and current time into tempTime
-    tempWeight = ReadScale();
-    tempTime = millis();
+    Serial.print("Weight did not stabilize within the latency budget, median = ");
+    Serial.print(WeightToGrains(result), 2);
+    Serial.print(", confidence = ");
+    Serial.println(stableConfidence, 3);
+  }
 
-    // Scale response timed out
-    if(tempWeight == -5000)
+  return result;
+}
+
+// stableHeader()
+// Waits until the scale reports a stable (ST) weight that is unchanged for STABLE_CONFIRM
+// Only samples requested after this function was called are considered
+static Weight stableHeader(int durationMillis, unsigned long deadline)
+{
+  ScaleSample temp;
+  unsigned long startTime = millis();
+  long stableVal = 0;
+  unsigned long stableTime = 0;
+  bool haveStable = false;
+
+  while(true)
+  {
+    int result = readSample(&temp);
+
+    // Scale response timed out or contains out of range characters
+    if(result)
     {
-      return tempWeight;
+      return (Weight)result * CENTIGRAINS_PER_GRAIN;
     }
-    // Scale response contains out of range characters
-    if(tempWeight == -6000)
+
+    // Latency budget expired, return the best estimate we have
+    if((long)(millis() - deadline) >= 0)
     {
-      return tempWeight;
+      return robustResult(startTime, STABLE_UNSTABLE);
     }
 
-    // Compare tempWeight to retVal to see if it's changed
-    if(tempWeight != retVal)
+    // Skip samples requested before we were called
+    if((long)(temp.time - startTime) < 0)
     {
-      // Weight has changed, check if it's the same as newVal
-      if(tempWeight != newVal)
-      {
-        // Weight is an entirely new value, rotate newVal/newTime into retVal/lastTime and shift tempWeight/tempTime into newVal/newTime
-        retVal =  newVal;
-        lastTime = newTime;
+      continue;
+    }
 
-        newVal = tempWeight;
-        newTime = tempTime;
-      }
-      else
+    // NU format frames carry no header, fall back to the software window
+    if(temp.reading.header == SCALE_HEADER_NONE)
+    {
+      return stableWindow(durationMillis, deadline);
+    }
+
+    if(temp.reading.header != SCALE_HEADER_ST)
+    {
+      // Scale reports unstable weight, restart the confirmation window
+      haveStable = false;
+      continue;
+    }
+
+    if(!haveStable || temp.reading.divisions != stableVal)
+    {
+      haveStable = true;
+      stableVal = temp.reading.divisions;
+      stableTime = temp.time;
+    }
+
+    if((long)(temp.time - stableTime) >= STABLE_CONFIRM)
+    {
+      stableSince = stableTime;
+      return DivisionsToWeight(stableVal);
+    }
+  }
+}
+
+// stableWindow()
+// Waits until every sample stays within the noise tolerance of the first sample of the window for the window length
+// On a quiet scale the tolerance is zero and the window is durationMillis, both grow with the live noise estimate
+// The median of the samples in the window is returned
+static Weight stableWindow(int durationMillis, unsigned long deadline)
+{
+  ScaleSample temp;
+
+  int result = readSample(&temp);
+  if(result)
+  {
+    return (Weight)result * CENTIGRAINS_PER_GRAIN;
+  }
+
+  long refVal = temp.reading.divisions;
+  unsigned long refTime = temp.time;
+
+  // Window length and tolerance follow the live noise estimate, which only changes once the window has been taken
+  long tolerance = (long)((2 * noiseEstimate) + 0.5);
+  if(tolerance < toleranceFloor)
+  {
+    tolerance = toleranceFloor;
+  }
+  if(tolerance > STABLE_MAX_TOLERANCE)
+  {
+    tolerance = STABLE_MAX_TOLERANCE;
+  }
+  long window = durationMillis + (long)(noiseEstimate * STABLE_NOISE_WINDOW);
+
+  // While loop to sit in until weight reading stabilizes or the latency budget expires
+  while(true)
+  {
+    // Capture the next sample into temp
+    result = readSample(&temp);
+
+    // Scale response timed out or contains out of range characters
+    if(result)
+    {
+      return (Weight)result * CENTIGRAINS_PER_GRAIN;
+    }
+
+    if(labs(temp.reading.divisions - refVal) > tolerance)
+    {
+      // Weight has moved outside the tolerance, restart the window from this sample
+      refVal = temp.reading.divisions;
+      refTime = temp.time;
+    }
+    else if((long)(temp.time - refTime) > window)
+    {
+      // Duration has elapsed, return the median of the window
+      Weight stable = robustResult(refTime, STABLE_OK);
+      if((long)((2 * noiseEstimate) + 0.5) >= toleranceFloor)
       {
-        // Weight is same as newVal, check if duration has elapsed (comparing temp to new)
-        if((tempTime - newTime) > durationMillis)
-        {
-          // Duration has elapsed, newVal is the stabilized weight to be returned
-          return newVal;
-        }
+        toleranceFloor = 0;
       }
+      return stable;
     }
-    else
+
+    // Latency budget expired, return the best estimate we have
+    // The noise estimate only learns from stable windows, so widen the next window by a division in case noise is what kept this one from stabilising
+    if((long)(millis() - deadline) >= 0)
     {
-      // Weight is the same as retVal, check if duration has elapsed (comparing temp to last)
-      if((tempTime - lastTime) > durationMillis)
+      if(toleranceFloor < STABLE_MAX_TOLERANCE)
       {
-        // Duration has elapsed, retVal is the stabilized weight to be returned
-        return retVal;
+        toleranceFloor++;
       }
+      return robustResult(refTime, STABLE_UNSTABLE);
     }
-  } // This while loop never ends
+  }
+}
+
+// robustResult()
+// Returns the median of the ring buffer samples received since the given time (or of the whole ring buffer if too few)
+// Updates the live noise estimate from the mean absolute deviation of those samples if they were a stable window, and sets the status and confidence of the result
+static Weight robustResult(unsigned long since, byte status)
+{
+  long weights[SCALE_SAMPLE_COUNT];
+  byte count = 0;
+  byte available = (sampleCount < SCALE_SAMPLE_COUNT) ? sampleCount : SCALE_SAMPLE_COUNT;
+
+  for(byte k = 0; k < available; k++)
+  {
+    ScaleSample* sample = &samples[(sampleHead + SCALE_SAMPLE_COUNT - k) % SCALE_SAMPLE_COUNT];
+    if((long)(sample->time - since) >= 0)
+    {
+      weights[count] = sample->reading.divisions;
+      count++;
+    }
+  }
+  // Too few samples in the window, use the most recent ones regardless
+  bool windowed = (count >= 3);
+  if(!windowed)
+  {
+    count = available;
+    for(byte k = 0; k < count; k++)
+    {
+      weights[k] = samples[(sampleHead + SCALE_SAMPLE_COUNT - k) % SCALE_SAMPLE_COUNT].reading.divisions;
+    }
+  }
+
+  // Insertion sort, there are only a handful of samples
+  for(byte i = 1; i < count; i++)
+  {
+    long value = weights[i];
+    byte j = i;
+    while(j > 0 && weights[j - 1] > value)
+    {
+      weights[j] = weights[j - 1];
+      j--;
+    }
+    weights[j] = value;
+  }
+  long median = weights[count / 2];
+
+  // Spread of the samples around the median
+  long deviation = 0;
+  long tolerance = (long)((2 * noiseEstimate) + 0.5);
+  byte inside = 0;
+  for(byte i = 0; i < count; i++)
+  {
+    long distance = labs(weights[i] - median);
+    deviation += distance;
+    if(distance <= tolerance)
+    {
+      inside++;
+    }
+  }
+
+  // Exponentially weighted noise estimate in divisions
+  // Only a stable window taken with the motors still is pure noise, the fallback samples, an expired budget and powder still dropping include the weight moving
+  if(windowed && status == STABLE_OK && motorsStill && !IsTrickling() && !IsBulking())
+  {
+    noiseEstimate = (0.8 * noiseEstimate) + (0.2 * deviation / count);
+  }
+
+  stableStatus = status;
+  stableConfidence = (status == STABLE_OK) ? 1.0 : ((float)inside / count);
+  stableSince = since;
+
+  return DivisionsToWeight(median);
+}
+
+// StableStatus()
+// Returns the status of the last StableWeight() result, STABLE_OK or STABLE_UNSTABLE
+byte StableStatus()
+{
+  return stableStatus;
+}
+
+// StableConfidence()
+// Returns the confidence (0-1) of the last StableWeight() result, the fraction of recent samples within the noise tolerance of the returned median
+float StableConfidence()
+{
+  return stableConfidence;
+}
+
+// StableSince()
+// Returns the time of the first sample the last StableWeight() result was taken from, when the weight settled if it was stable
+unsigned long StableSince()
+{
+  return stableSince;
+}
+
+// ScaleNoise()
+// Returns the live noise estimate in scale divisions
+float ScaleNoise()
+{
+  return noiseEstimate;
 }
 
 // readScale()
-// Reads the current weight from the scale and returns the weight value in float format
+// Returns the next weight sample received from the scale in float format
+// The streaming driver keeps a PRT request in flight at all times, so this only waits for the in-flight response instead of flushing and re-requesting
 // Error values:
 // -5000 = Scale response timeout
 // -6000 = Scale response error (out of range characters, likely a formatting issue)
 float ReadScale()
 {
-  String asciiNum;
-  char byteReceived;
-  int i = 0;
-  bool isNegative = false;
+  ScaleSample sample;
 
-  flushSerial();
+  int result = readSample(&sample);
+  if(result)
+  {
+    return result;
+  }
+
+  latestWeight = DivisionsToGrains(sample.reading.divisions);
 
-  // Command the scale to report the current weight WITHOUT blinking the display 
-  Serial1.print("PRT\r");
+  return latestWeight;
+}
 
-  int startTime = millis();
-  int curTime = startTime;
+// ReadScaleFrame()
+// Waits for the next decoded frame from the scale, including its stability header and unit
+// Returns 0 on success, or the same error values as ReadScale()
+int ReadScaleFrame(ScaleReading* reading)
+{
+  ScaleSample sample;
 
-  // Loop until we have received the full scale response
-  while(i < 10 && (curTime - startTime) < 500)
+  int result = readSample(&sample);
+  if(!result)
   {
-    i = Serial1.available();
-    curTime = millis();
+    *reading = sample.reading;
   }
 
-  // Handle timeout of scale response
-  if((curTime - startTime) >= 500)
+  return result;
+}
+
+// readSample()
+// Waits for a fresh sample that has not yet been handed out and copies it into sample
+// Samples that sat in the buffer for longer than SCALE_MAX_AGE (such as while the main loop was blocked) are skipped
+// Returns 0 on success, or the same error values as ReadScale()
+static int readSample(ScaleSample* sample)
+{
+  unsigned long startTime = millis();
+
+  // Loop until a fresh sample has been received, running the other tasks while waiting
+  while(true)
   {
-    Serial.println("Scale response timed out during readScale()");
-    return -5000;
+    RunTasks();
+
+    // Report out of range characters once for each bad frame
+    if(frameError)
+    {
+      frameError = false;
+      return -6000;
+    }
+
+    if(consumedCount != sampleCount)
+    {
+      consumedCount = sampleCount;
+
+      if((millis() - samples[sampleHead].time) <= SCALE_MAX_AGE)
+      {
+        *sample = samples[sampleHead];
+
+        return 0;
+      }
+      // Sample is stale, keep waiting for the next one
+    }
+
+    // Handle timeout of scale response
+    if((millis() - startTime) >= SCALE_TIMEOUT)
+    {
+      Serial.println("Scale response timed out during readScale()");
+      return -5000;
+    }
   }
-  
-  // Collect the available response from the scale
-  for(int j = 0; j < i; j++)
+}
+
+// ScaleUpdate()
+// Pumps the streaming scale driver without blocking
+// Feeds received bytes into the frame parser, and in polled mode sends the next PRT request as soon as the previous response completes
+void ScaleUpdate()
+{
+  // Feed every available byte into the frame buffer, frames are terminated by CR/LF
+  while(ScaleSerial.available())
   {
-    byteReceived = Serial1.read();
-    //Serial.print(byteReceived);
-    //Serial.print(" -- ");
-    //Serial.print(byte(byteReceived));
-    //Serial.print("\n");
+    char byteReceived = ScaleSerial.read();
 
-    // Test first received character to see if number is negative
-    if(j == 0)
+    if(byteReceived == '\r' || byteReceived == '\n')
     {
-      byte test = byte(byteReceived);
-      if(test == 45)
+      if(frameLen > 0)
       {
-        isNegative = true;
+        completeFrame();
       }
+      frameLen = 0;
     }
-    // Store the portion that is the number into a char array
-    if(j > 0 && j < 9)
+    else if(frameLen < SCALE_FRAME_LEN)
     {
-      asciiNum += byteReceived;
+      frame[frameLen] = byteReceived;
+      frameLen++;
+    }
+    else
+    {
+      // Frame is too long to be a weight response, discard it and resynchronise on the next line ending
+      droppedFrames++;
+      partialFrames++;
+      frameLen = 0;
+    }
+  }
+
+  unsigned long now = millis();
 
-      // Verify that each of these are a number or decimal point, return false early if they aren't
-      byte test = byte(byteReceived);
-      if(test < 46 || test > 57)
+  if(!SCALE_STREAM_MODE)
+  {
+    // Handle timeout of the in-flight request
+    if(requestPending && (now - requestTime) >= SCALE_TIMEOUT)
+    {
+      timeouts++;
+      droppedFrames++;
+      if(frameLen > 0)
       {
-        Serial.println("Error receiving weight from scale, response includes out of range characters");
-        return -6000;
+        partialFrames++;
       }
+      requestPending = false;
+      frameLen = 0;
+    }
+
+    // Command the scale to report the current weight WITHOUT blinking the display
+    if(!requestPending)
+    {
+      ScaleSerial.print("PRT\r");
+      requestPending = true;
+      requestTime = now;
     }
   }
 
-  latestWeight = asciiNum.toFloat();
+  // Update the samples per second statistic
+  if((now - secondStart) >= 1000)
+  {
+    samplesPerSecond = samplesThisSecond;
+    samplesThisSecond = 0;
+    secondStart = now;
+  }
+}
+
+// completeFrame()
+// Decodes a complete frame from the frame buffer and pushes the reading into the sample ring buffer
+static void completeFrame()
+{
+  ScaleReading reading;
+  unsigned long sampleTime = SCALE_STREAM_MODE ? millis() : requestTime;
 
-  if(isNegative)
+  if(requestPending)
   {
-    latestWeight = latestWeight * -1;
+    recordLatency(millis() - requestTime);
   }
+  requestPending = false;
 
-  return latestWeight;
+  if(!ParseScaleFrame(frame, frameLen, &reading))
+  {
+    if(reading.unit == SCALE_UNIT_G || reading.unit == SCALE_UNIT_OTHER)
+    {
+      Serial.println("Error receiving weight from scale, the scale is not set to grains (GN)");
+    }
+    else
+    {
+      Serial.println("Error receiving weight from scale, response includes out of range characters");
+    }
+    badFrames++;
+    droppedFrames++;
+    frameError = true;
+    return;
+  }
+
+  // Discard samples that were requested before the scale was last zeroed
+  if((long)(sampleTime - discardBefore) < 0)
+  {
+    return;
+  }
+
+  // Push the sample into the ring buffer
+  sampleHead = (sampleHead + 1) % SCALE_SAMPLE_COUNT;
+  samples[sampleHead].reading = reading;
+  samples[sampleHead].time = sampleTime;
+  sampleCount++;
+  samplesThisSecond++;
+}
+
+// ParseScaleFrame()
+// Decodes a frame (without its CR/LF terminator) directly into a ScaleReading without any heap allocation
+// Accepts both the NU format ("+00032.04") and the A&D standard format ("ST,+00032.04  GN")
+// Returns false if the frame is not a valid weight, or reports a unit other than grains (reading->unit is left set to the unit it reported)
+bool ParseScaleFrame(const char* frame, byte len, ScaleReading* reading)
+{
+  byte pos = 0;
+
+  reading->header = SCALE_HEADER_NONE;
+  reading->unit = SCALE_UNIT_NONE;
+
+  // A&D standard format starts with a two character header and a comma
+  if(len > 3 && frame[2] == ',')
+  {
+    if(frame[0] == 'S' && frame[1] == 'T')
+    {
+      reading->header = SCALE_HEADER_ST;
+    }
+    else if(frame[0] == 'U' && frame[1] == 'S')
+    {
+      reading->header = SCALE_HEADER_US;
+    }
+    else if(frame[0] == 'O' && frame[1] == 'L')
+    {
+      reading->header = SCALE_HEADER_OL;
+    }
+    else if(frame[0] == 'Q' && frame[1] == 'T')
+    {
+      reading->header = SCALE_HEADER_QT;
+    }
+    else
+    {
+      return false;
+    }
+    pos = 3;
+  }
+
+  // Sign character followed by 8 characters of digits and decimal point
+  if(len < pos + 9)
+  {
+    return false;
+  }
+
+  bool isNegative = (frame[pos] == '-');
+  long value = 0;
+  char decimals = -1;
+
+  for(byte j = pos + 1; j < pos + 9; j++)
+  {
+    char c = frame[j];
+
+    if(c >= '0' && c <= '9')
+    {
+      value = (value * 10) + (c - '0');
+      if(decimals >= 0)
+      {
+        decimals++;
+      }
+    }
+    else if(c == '.' && decimals < 0)
+    {
+      decimals = 0;
+    }
+    // Leading spaces are sent in place of zeros by some configurations
+    else if(c != ' ')
+    {
+      return false;
+    }
+  }
+
+  // Scale the value to hundredths of a unit, the fx-120i sends 2 decimals in grains
+  if(decimals < 0)
+  {
+    decimals = 0;
+  }
+  while(decimals < 2)
+  {
+    value = value * 10;
+    decimals++;
+  }
+  while(decimals > 2)
+  {
+    value = value / 10;
+    decimals--;
+  }
+
+  // Convert hundredths to a count of 0.02 divisions, rounding to the nearest division
+  value = (value + 1) / 2;
+  reading->divisions = isNegative ? -value : value;
+
+  // Optional unit following the weight
+  pos = pos + 9;
+  while(pos < len && frame[pos] == ' ')
+  {
+    pos++;
+  }
+  if(pos < len)
+  {
+    if(frame[pos] == 'G' && (pos + 1) < len && frame[pos + 1] == 'N')
+    {
+      reading->unit = SCALE_UNIT_GN;
+    }
+    else if(frame[pos] == 'g')
+    {
+      reading->unit = SCALE_UNIT_G;
+    }
+    else
+    {
+      reading->unit = SCALE_UNIT_OTHER;
+    }
+  }
+
+  // Divisions are counted in grains, a weight in any other unit cannot be used
+  return reading->unit == SCALE_UNIT_NONE || reading->unit == SCALE_UNIT_GN;
+}
+
+// DivisionsToGrains()
+// Converts a count of scale divisions into grains
+float DivisionsToGrains(long divisions)
+{
+  return (divisions * 2) / 100.0;
+}
+
+// DivisionsToWeight()
+// Converts a count of scale divisions into centigrains, exactly and without floating point
+Weight DivisionsToWeight(long divisions)
+{
+  return divisions * CENTIGRAINS_PER_DIVISION;
+}
+
+// GrainsToWeight()
+// Converts a weight in grains to the nearest centigrain, readings from the scale convert exactly
+Weight GrainsToWeight(float grains)
+{
+  return (grains * CENTIGRAINS_PER_GRAIN) + ((grains < 0) ? -0.5 : 0.5);
+}
+
+// WeightToGrains()
+// Converts a weight in centigrains to grains, for the calibration estimators and printing
+float WeightToGrains(Weight weight)
+{
+  return weight / (float)CENTIGRAINS_PER_GRAIN;
+}
+
+// LatestWeight()
+// Non-blocking query of the most recent sample received from the scale, in centigrains
+// Returns false if no sample has been received yet
+bool LatestWeight(Weight* weight, unsigned long* timestamp)
+{
+  ScaleReading reading;
+
+  if(!LatestReading(&reading, timestamp))
+  {
+    return false;
+  }
+
+  *weight = DivisionsToWeight(reading.divisions);
+
+  return true;
+}
+
+// LatestReading()
+// Non-blocking query of the most recent decoded frame received from the scale
+// Returns false if no sample has been received yet
+bool LatestReading(ScaleReading* reading, unsigned long* timestamp)
+{
+  ScaleUpdate();
+
+  if(sampleCount == 0)
+  {
+    return false;
+  }
+
+  *reading = samples[sampleHead].reading;
+  *timestamp = samples[sampleHead].time;
+
+  return true;
+}
+
+// ScaleSamplesPerSecond()
+// Returns the number of samples received from the scale during the last full second
+int ScaleSamplesPerSecond()
+{
+  return samplesPerSecond;
+}
+
+// ScaleDroppedFrames()
+// Returns the number of frames lost to timeouts, out of range characters, or buffer overruns
+unsigned long ScaleDroppedFrames()
+{
+  return droppedFrames;
+}
+
+// PredictWeight()
+// Non-blocking estimate of the final settled weight from the samples received since the given time
+// Fits a first order (exponential) settling curve to each run of 3 consecutive samples and extrapolates it to its asymptote
+// Confidence is a percentage, 0 while the curve is not decaying (powder still landing), 100 when the last two fits agree and 50 when they are a division apart
+// Returns false until at least 4 samples have been received since the given time
+bool PredictWeight(unsigned long since, Weight* predicted, byte* confidence)
+{
+  long weights[SCALE_SAMPLE_COUNT];
+  byte count = 0;
+
+  ScaleUpdate();
+
+  // Collect the samples received since the given time, oldest first
+  byte available = (sampleCount < SCALE_SAMPLE_COUNT) ? sampleCount : SCALE_SAMPLE_COUNT;
+  for(int k = available - 1; k >= 0; k--)
+  {
+    ScaleSample* sample = &samples[(sampleHead + SCALE_SAMPLE_COUNT - k) % SCALE_SAMPLE_COUNT];
+    if((long)(sample->time - since) >= 0)
+    {
+      weights[count] = sample->reading.divisions;
+      count++;
+    }
+  }
+
+  if(count < 4)
+  {
+    return false;
+  }
+
+  long previousFit;
+  long latestFit;
+  bool previousValid = extrapolate(weights[count - 4], weights[count - 3], weights[count - 2], &previousFit);
+  bool latestValid = extrapolate(weights[count - 3], weights[count - 2], weights[count - 1], &latestFit);
+
+  *predicted = DivisionsToWeight(latestFit);
+
+  if(previousValid && latestValid)
+  {
+    *confidence = 100 / (1 + labs(latestFit - previousFit));
+  }
+  else
+  {
+    *confidence = 0;
+  }
+
+  return true;
+}
+
+// extrapolate()
+// Extrapolates 3 equally spaced samples of a first order settling curve to its final value (Aitken's delta-squared)
+// Returns false if the samples are not a decaying curve, in which case the latest sample is returned
+static bool extrapolate(long a, long b, long c, long* result)
+{
+  long d1 = b - a;
+  long d2 = c - b;
+
+  *result = c;
+
+  // Flat, already settled
+  if(d2 == 0)
+  {
+    return true;
+  }
+  // Weight started moving again, or is oscillating or accelerating
+  if(d1 == 0 || (d1 > 0) != (d2 > 0) || labs(d2) >= labs(d1))
+  {
+    return false;
+  }
+
+  // Remaining rise of a geometric series with ratio d2 / d1, rounded to the nearest division
+  long denominator = labs(d1 - d2);
+  long remaining = (2 * d2 * d2 + denominator) / (2 * denominator);
+  *result = (d2 > 0) ? (c + remaining) : (c - remaining);
+
+  return true;
+}
+
+// ResetSettleTime()
+// Resets the settle time accounting, called at the start of each charge
+void ResetSettleTime()
+{
+  settleMillis = 0;
+  settleCount = 0;
+}
+
+// AddSettleTime()
+// Adds the time in ms of one settle wait to the accounting
+void AddSettleTime(unsigned long duration)
+{
+  settleMillis += duration;
+  settleCount++;
+}
+
+// GetSettleTime()
+// Returns the total time in ms of the settle waits added since the last ResetSettleTime()
+unsigned long GetSettleTime()
+{
+  return settleMillis;
+}
+
+// GetSettleCount()
+// Returns the number of settle waits added since the last ResetSettleTime()
+int GetSettleCount()
+{
+  return settleCount;
+}
+
+// PrintScaleStats()
+// Prints the streaming driver statistics to the serial monitor
+void PrintScaleStats()
+{
+  Serial.print("Scale samples/sec = ");
+  Serial.print(samplesPerSecond);
+  Serial.print(", dropped frames = ");
+  Serial.print(droppedFrames);
+  Serial.print(" (timeouts = ");
+  Serial.print(timeouts);
+  Serial.print(", bad frames = ");
+  Serial.print(badFrames);
+  Serial.print(", partial frames = ");
+  Serial.print(partialFrames);
+  Serial.print("), flushed bytes = ");
+  Serial.println(flushedBytes);
+}
+
+// PrintScaleLatency()
+// Prints the PRT request to complete frame latency histogram to the serial monitor (empty in SCALE_STREAM_MODE)
+void PrintScaleLatency()
+{
+  Serial.print("Scale latency histogram, max = ");
+  Serial.print(maxLatency);
+  Serial.println("ms");
+
+  for(byte i = 0; i < SCALE_LATENCY_BUCKETS; i++)
+  {
+    Serial.print("  ");
+    Serial.print(i ? (1 << i) : 0);
+    if(i < SCALE_LATENCY_BUCKETS - 1)
+    {
+      Serial.print("-");
+      Serial.print((2 << i) - 1);
+      Serial.print("ms: ");
+    }
+    else
+    {
+      Serial.print("+ms: ");
+    }
+    Serial.println(latencyHistogram[i]);
+  }
+}
+
+// ResetScaleStats()
+// Clears the streaming driver statistics and latency histogram at the start of a session
+void ResetScaleStats()
+{
+  droppedFrames = 0;
+  timeouts = 0;
+  badFrames = 0;
+  partialFrames = 0;
+  flushedBytes = 0;
+  maxLatency = 0;
+  memset(latencyHistogram, 0, sizeof(latencyHistogram));
+}
+
+// recordLatency()
+// Adds a PRT request to complete frame latency (in ms) to the histogram
+static void recordLatency(unsigned long latency)
+{
+  byte bucket = 0;
+  unsigned long remaining = latency;
+  while(remaining > 1 && bucket < SCALE_LATENCY_BUCKETS - 1)
+  {
+    remaining = remaining >> 1;
+    bucket++;
+  }
+
+  if(latencyHistogram[bucket] < 65535)
+  {
+    latencyHistogram[bucket]++;
+  }
+  if(latency > maxLatency)
+  {
+    maxLatency = (latency > 65535) ? 65535 : latency;
+  }
 }
 
 // flushSerial()
 // Reads from the RX buffer for the scale until nothing is left in the buffer
+// Any partially received frame is discarded along with it
 void flushSerial()
 {
-  while(Serial1.available())
+  while(ScaleSerial.available())
   {
-    Serial.print(Serial1.available());
-    Serial1.read();
+    ScaleSerial.read();
+    flushedBytes++;
   }
+  if(frameLen > 0)
+  {
+    partialFrames++;
+  }
+  frameLen = 0;
+  requestPending = false;
   return;
 }
 
 // zeroScale()
 // Commands the scale to re-zero
+// Samples requested before the re-zero completes are discarded
 void zeroScale()
 {
-  Serial1.print("R\r");
+  ScaleSerial.print("R\r");
+
+  WaitMillis(50);
 
-  delay(50);
+  discardBefore = millis();
 }
\ No newline at end of file
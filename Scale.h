@@ -11,10 +11,99 @@
 #define TX_PIN 11
 #define RX_PIN 12
 
+// Streaming driver configuration
+#define SCALE_STREAM_MODE false // Set to true if the scale is configured for continuous output (dout-Prt = 3), false to pipeline PRT requests
+#define SCALE_TIMEOUT 500 // Max time in ms to wait for a complete frame before the request is considered lost
+#define SCALE_MAX_AGE 250 // Samples older than this (in ms) are considered stale by ReadScale()
+#define SCALE_FRAME_LEN 20 // Longest frame the parser will buffer before discarding it
+#define SCALE_SAMPLE_COUNT 8 // Number of recent samples kept in the sample ring buffer
+#define SCALE_LATENCY_BUCKETS 10 // Buckets in the PRT to frame latency histogram, bucket n counts latencies of 2^n to 2^(n+1)-1 ms (the last bucket is open ended)
+
+// Scale frame status headers (only sent in A&D standard format, NU format frames report SCALE_HEADER_NONE)
+#define SCALE_HEADER_NONE 0
+#define SCALE_HEADER_ST 1 // Stable weight
+#define SCALE_HEADER_US 2 // Unstable weight
+#define SCALE_HEADER_OL 3 // Out of range
+#define SCALE_HEADER_QT 4 // Counting mode
+
+// Scale frame units
+#define SCALE_UNIT_NONE 0
+#define SCALE_UNIT_GN 1
+#define SCALE_UNIT_G 2
+#define SCALE_UNIT_OTHER 3
+
+#define SCALE_DIVISION 0.02 // Weight of one scale division in grains
+#define CENTIGRAINS_PER_DIVISION 2 // Weight of one scale division in centigrains, readings convert to a Weight exactly
+
+// Weights the state machine compares are held in centigrains (hundredths of a grain), so targets, readings, margins and thresholds compare exactly in integer arithmetic
+// Calibration factors and the estimators built on them stay in floating point grains, weights are converted at that boundary
+typedef long Weight;
+#define CENTIGRAINS_PER_GRAIN 100
+#define GRAINS(grains) ((Weight)(((grains) * CENTIGRAINS_PER_GRAIN) + (((grains) < 0) ? -0.5 : 0.5))) // Weight of a constant number of grains, folded to an integer by the compiler
+
+// StableWeight() stability modes
+#define STABLE_WINDOW 0 // Weight must repeat for the full duration window
+#define STABLE_HEADER 1 // Trust the scale's ST header, confirmed for STABLE_CONFIRM (falls back to STABLE_WINDOW for NU format frames)
+#define STABLE_CONFIRM 150 // Software confirmation window in ms for STABLE_HEADER, 0 returns on the first ST frame
+#define STABLE_BUDGET 2500 // Max time in ms StableWeight() may wait beyond the requested duration before giving up
+#define STABLE_NOISE_WINDOW 400 // Stability window is lengthened by this many ms per division of measured noise
+#define STABLE_MAX_TOLERANCE 3 // Largest deviation (in divisions) from the window's first sample still treated as stable
+
+// StableWeight() result status
+#define STABLE_OK 0 // Weight was stable
+#define STABLE_UNSTABLE 1 // Latency budget expired, result is the median of the recent samples
+
+// ScaleReading
+// A decoded weight frame, the weight is held as a signed count of scale divisions
+typedef struct
+{
+  long divisions; // Signed weight in scale divisions
+  byte header; // SCALE_HEADER_*
+  byte unit; // SCALE_UNIT_*
+} ScaleReading;
+
 void SetupScale();
-float StableWeight(int durationMillis);
+float StableWeight(int durationMillis, byte mode = STABLE_WINDOW);
+Weight StableCentigrains(int durationMillis, byte mode = STABLE_WINDOW);
+
+// Stability engine status
+byte StableStatus();
+float StableConfidence();
+unsigned long StableSince();
+float ScaleNoise();
+
+// Predictive settle estimator
+bool PredictWeight(unsigned long since, Weight* predicted, byte* confidence);
+
+// Settle time accounting, the caller adds the time of each settle wait so other StableWeight() calls are not counted
+void ResetSettleTime();
+void AddSettleTime(unsigned long duration);
+unsigned long GetSettleTime();
+int GetSettleCount();
 float ReadScale();
 
+// Streaming driver, ScaleUpdate() must be called frequently (every loop and within any wait loops)
+void ScaleUpdate();
+bool LatestWeight(Weight* weight, unsigned long* timestamp);
+bool LatestReading(ScaleReading* reading, unsigned long* timestamp);
+int ReadScaleFrame(ScaleReading* reading);
+
+// Frame decoding
+bool ParseScaleFrame(const char* frame, byte len, ScaleReading* reading);
+float DivisionsToGrains(long divisions);
+Weight DivisionsToWeight(long divisions);
+
+// Weight conversions
+Weight GrainsToWeight(float grains);
+float WeightToGrains(Weight weight);
+
+// Streaming driver statistics
+int ScaleSamplesPerSecond();
+unsigned long ScaleDroppedFrames();
+void PrintScaleStats();
+void PrintScaleLatency();
+void ResetScaleStats();
+
 void flushSerial();
 void zeroScale();
 #endif // SCALE_H
\ No newline at end of file
@@ -0,0 +1,289 @@
+// Simulator.cpp
+// Contains implementations of functions declared in Simulator.h
+
+// Include the header file
+#include "Simulator.h"
+
+#ifdef SIMULATE_POWDER
+
+#include "Steppers.h" // Motor positions drive the powder model
+
+SimulatedScale SimScale;
+
+// A drop of powder that is falling towards the cup
+typedef struct
+{
+  unsigned long time; // millis() when it lands
+  float weight;
+} SimDrop;
+
+// Powder model state
+static SimProfile profile = {SIM_KERNEL_WEIGHT, SIM_KERNEL_SPREAD, SIM_BULK_WEIGHT, SIM_BULK_SPREAD, SIM_BULK_DRIFT, SIM_SCALE_NOISE, SIM_SCALE_MODEL, SIM_SETTLE_TAU};
+static SimDrop pending[SIM_PENDING_COUNT];
+static byte pendingCount = 0;
+static float cupWeight = 0; // Powder that has landed in the cup
+static long bulkHigh = 0; // Furthest bulk position reached, powder only drops when the disk passes it
+static float bulkDispensed = 0; // Powder dropped by the bulk disk since the profile was set, drives the density drift
+static long trickleSlot = 0; // Trickler position of the last slot that dropped
+
+// Scale model state
+static float displayWeight = 0; // Weight the scale reads
+static float filterWeight = 0; // Settling weight behind the reading
+static unsigned long displayTime = 0; // millis() the reading of SIM_SCALE_STEPPED last updated
+static float zeroOffset = 0;
+static bool cupOnScale = true;
+static unsigned long lastUpdate = 0;
+static bool swapPending = false;
+static unsigned long swapTime = 0; // millis() when the cup is lifted, or when it is put back once lifted
+
+// Response being sent back to the scale driver
+static char response[24];
+static byte responseLen = 0;
+static byte responsePos = 0;
+static bool responsePending = false;
+static unsigned long responseTime = 0;
+
+static void simUpdate();
+static void dropPowder(unsigned long now, float weight);
+static void buildResponse();
+static float spread(float relative);
+
+// begin()
+// Resets the simulation, the baud rate is ignored
+void SimulatedScale::begin(unsigned long baud)
+{
+  SimReset();
+}
+
+// available()
+// Advances the simulation and returns the number of response bytes ready to be read
+int SimulatedScale::available()
+{
+  simUpdate();
+
+  if(responsePending && (long)(millis() - responseTime) >= 0)
+  {
+    buildResponse();
+    responsePending = false;
+  }
+
+  return responseLen - responsePos;
+}
+
+// read()
+// Returns the next response byte, or -1 if none are available
+int SimulatedScale::read()
+{
+  if(responsePos >= responseLen)
+  {
+    return -1;
+  }
+
+  char next = response[responsePos];
+  responsePos++;
+
+  return next;
+}
+
+// write()
+// Accepts a complete command from the scale driver
+size_t SimulatedScale::write(const char* command)
+{
+  simUpdate();
+
+  if(!strcmp(command, "PRT\r"))
+  {
+    responsePending = true;
+    responseTime = millis() + SIM_RESPONSE_DELAY;
+  }
+  else if(!strcmp(command, "R\r"))
+  {
+    zeroOffset = displayWeight;
+  }
+  else if(!strcmp(command, "?ID\r"))
+  {
+    strcpy(response, "ID,SIMULATED\r\n");
+    responseLen = strlen(response);
+    responsePos = 0;
+  }
+
+  return strlen(command);
+}
+
+// print()
+// Same as write()
+size_t SimulatedScale::print(const char* command)
+{
+  return write(command);
+}
+
+// SimReset()
+// Empties the cup and scale
+void SimReset()
+{
+  pendingCount = 0;
+  cupWeight = 0;
+  displayWeight = 0;
+  filterWeight = 0;
+  zeroOffset = 0;
+  cupOnScale = true;
+  swapPending = false;
+  bulkHigh = GetBulkPosition() + SIM_BULK_GAP;
+  trickleSlot = GetTricklePosition();
+  lastUpdate = millis();
+}
+
+// SimSetProfile()
+// Replaces the powder and scale model parameters, powder already dispensed keeps its weight
+void SimSetProfile(const SimProfile* newProfile)
+{
+  profile = *newProfile;
+  bulkDispensed = 0;
+}
+
+// SimChargeComplete()
+// Called once a charge has been evaluated, the cup is swapped for an empty one after SIM_CUP_SWAP_DELAY
+void SimChargeComplete()
+{
+  swapPending = true;
+  swapTime = millis() + SIM_CUP_SWAP_DELAY;
+}
+
+// SimCupWeight()
+// Returns the true weight of powder that has landed in the cup
+float SimCupWeight()
+{
+  return cupWeight;
+}
+
+// simUpdate()
+// Drops powder for any motor movement since the last update, lands falling powder and settles the scale
+static void simUpdate()
+{
+  unsigned long now = millis();
+
+  // Bulk disk drops powder in proportion to the distance it travels past its furthest position
+  long position = GetBulkPosition();
+  if(position > bulkHigh)
+  {
+    float density = 1 + (profile.bulkDrift * bulkDispensed / 1000);
+    float weight = (position - bulkHigh) * (profile.bulkWeight * density / STEPS_PER_REV) * spread(profile.bulkSpread);
+    dropPowder(now, weight);
+    bulkDispensed += weight;
+    bulkHigh = position;
+  }
+
+  // Trickler disk drops one slot each time a slot passes the drop hole
+  position = GetTricklePosition();
+  while(position >= trickleSlot + (STEPS_PER_REV / KERNELS_PER_REV))
+  {
+    trickleSlot += STEPS_PER_REV / KERNELS_PER_REV;
+
+    long fill = random(100);
+    int kernels = (fill < SIM_EMPTY_SLOT) ? 0 : ((fill < SIM_EMPTY_SLOT + SIM_DOUBLE_SLOT) ? 2 : 1);
+    for(int i = 0; i < kernels; i++)
+    {
+      dropPowder(now, profile.kernelWeight * spread(profile.kernelSpread));
+    }
+  }
+  if(position < trickleSlot)
+  {
+    trickleSlot = position;
+  }
+
+  // Land any powder that has finished falling
+  byte i = 0;
+  while(i < pendingCount)
+  {
+    if((long)(now - pending[i].time) >= 0)
+    {
+      cupWeight += pending[i].weight;
+      pendingCount--;
+      pending[i] = pending[pendingCount];
+    }
+    else
+    {
+      i++;
+    }
+  }
+
+  // Swap a finished charge for an empty cup so charges run unattended
+  if(swapPending && (long)(now - swapTime) >= 0)
+  {
+    if(cupOnScale)
+    {
+      cupOnScale = false;
+      swapTime = now + SIM_CUP_AWAY;
+    }
+    else
+    {
+      cupOnScale = true;
+      cupWeight = 0;
+      swapPending = false;
+    }
+  }
+
+  // Settling of the scale towards the load on it, through the selected response
+  float load = cupOnScale ? cupWeight : -SIM_CUP_WEIGHT;
+  unsigned long elapsed = now - lastUpdate;
+  if(profile.scaleModel == SIM_SCALE_SECOND_ORDER)
+  {
+    float tau = profile.settleTau / 2.0;
+    filterWeight += (load - filterWeight) * elapsed / (tau + elapsed);
+    displayWeight += (filterWeight - displayWeight) * elapsed / (tau + elapsed);
+  }
+  else
+  {
+    filterWeight += (load - filterWeight) * elapsed / (profile.settleTau + elapsed);
+    if((profile.scaleModel != SIM_SCALE_STEPPED) || ((now - displayTime) >= SIM_DISPLAY_PERIOD))
+    {
+      displayWeight = filterWeight;
+      displayTime = now;
+    }
+  }
+  lastUpdate = now;
+}
+
+// dropPowder()
+// Starts a drop of powder falling towards the cup
+static void dropPowder(unsigned long now, float weight)
+{
+  // Merge into the latest drop if too many are already falling
+  if(pendingCount >= SIM_PENDING_COUNT)
+  {
+    pending[pendingCount - 1].weight += weight;
+    return;
+  }
+
+  pending[pendingCount].time = now + SIM_FALL_LATENCY;
+  pending[pendingCount].weight = weight;
+  pendingCount++;
+}
+
+// buildResponse()
+// Formats the current reading in A&D standard format, quantized to scale divisions with optional noise
+static void buildResponse()
+{
+  float reading = displayWeight - zeroOffset;
+  long divisions = (long)((reading / 0.02) + ((reading < 0) ? -0.5 : 0.5));
+  divisions += random(-profile.scaleNoise, profile.scaleNoise + 1);
+
+  float load = cupOnScale ? cupWeight : -SIM_CUP_WEIGHT;
+  bool stable = (pendingCount == 0) && (fabs(load - displayWeight) < 0.01);
+
+  long hundredths = labs(divisions) * 2;
+  snprintf(response, sizeof(response), "%s,%c%05ld.%02ld  GN\r\n", stable ? "ST" : "US", (divisions < 0) ? '-' : '+', hundredths / 100, hundredths % 100);
+  responseLen = strlen(response);
+  responsePos = 0;
+}
+
+// spread()
+// Returns a random multiplier around 1 with the given relative standard deviation (sum of 3 uniform values)
+static float spread(float relative)
+{
+  long sum = random(-1000, 1001) + random(-1000, 1001) + random(-1000, 1001);
+
+  return 1.0 + (relative * sum / 1000.0);
+}
+
+#endif // SIMULATE_POWDER
\ No newline at end of file
@@ -0,0 +1,76 @@
+// Simulator.h
+// Simulated fx-120i and powder physics for exercising the state machine without throwing powder
+// When SIMULATE_POWDER is defined the scale serial port is replaced by SimScale, which weighs the powder the motors would have dispensed
+// The host build in host/ runs it on a virtual clock, on the trickler itself the motors still turn in real time, so run with empty hoppers (or the motors unplugged)
+
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+// External libraries
+#include <Arduino.h> // Standard Arduino libraries
+
+// Uncomment to build the simulator into the trickler instead of talking to a real scale, the host build defines it
+//#define SIMULATE_POWDER
+
+// Powder model
+#define SIM_KERNEL_WEIGHT 0.020 // Mean weight of a single kernel in grains
+#define SIM_KERNEL_SPREAD 0.15 // Relative spread of single kernel weights
+#define SIM_EMPTY_SLOT 3 // Percent chance a trickler slot drops nothing
+#define SIM_DOUBLE_SLOT 5 // Percent chance a trickler slot drops two kernels
+#define SIM_BULK_WEIGHT 62.0 // Grains dropped by one revolution of the bulk disk
+#define SIM_BULK_SPREAD 0.03 // Relative spread of the bulk density
+#define SIM_BULK_DRIFT 0 // Relative change in bulk density per 1000gr dispensed, as the hopper empties
+#define SIM_BULK_GAP 200 // Steps the bulk disk turns at startup before it drops powder, the retraction that ended the previous session leaves it short of its furthest position
+#define SIM_FALL_LATENCY 180 // Time in ms for powder to fall from the disks into the cup
+
+// Scale model
+#define SIM_SCALE_FIRST_ORDER 0 // Reading settles exponentially towards the load
+#define SIM_SCALE_SECOND_ORDER 1 // Two first order stages of half the time constant in series, slow to start moving and then settling
+#define SIM_SCALE_STEPPED 2 // First order settling, but the reading only updates every SIM_DISPLAY_PERIOD like a filtered display
+#define SIM_SCALE_MODEL SIM_SCALE_FIRST_ORDER // Settling response of the scale
+#define SIM_SETTLE_TAU 150 // Time constant in ms of the scale's settling response
+#define SIM_DISPLAY_PERIOD 100 // Time in ms between reading updates of SIM_SCALE_STEPPED
+#define SIM_SCALE_NOISE 0 // Max random noise in divisions added to each reading
+#define SIM_RESPONSE_DELAY 40 // Time in ms for the scale to answer a PRT request
+#define SIM_PENDING_COUNT 8 // Number of powder drops that can be falling at once
+
+// Cup handling, the cup is swapped automatically once a charge has been evaluated so charges run unattended
+#define SIM_CUP_WEIGHT 300.0 // Weight of the cup in grains, removed from the scale during a swap
+#define SIM_CUP_SWAP_DELAY 3000 // Time in ms after SimChargeComplete() before the full cup is swapped for an empty one
+#define SIM_CUP_AWAY 5000 // Time in ms the cup is off the scale during a swap
+
+// SimProfile
+// Runtime powder and scale model parameters, starts out as the defaults above
+typedef struct
+{
+  float kernelWeight; // Mean kernel weight in grains
+  float kernelSpread; // Relative spread of single kernel weights
+  float bulkWeight; // Grains per revolution of the bulk disk
+  float bulkSpread; // Relative spread of the bulk density
+  float bulkDrift; // Relative change in bulk density per 1000gr dispensed
+  byte scaleNoise; // Max random noise in divisions
+  byte scaleModel; // SIM_SCALE_*
+  int settleTau; // Time constant in ms of the settling response
+} SimProfile;
+
+// SimulatedScale
+// Stands in for Serial1, answering ?ID, PRT and R commands in A&D standard format
+class SimulatedScale
+{
+  public:
+    void begin(unsigned long baud);
+    int available();
+    int read();
+    size_t write(const char* command);
+    size_t print(const char* command);
+};
+
+extern SimulatedScale SimScale;
+
+// Simulator controls
+void SimReset();
+void SimSetProfile(const SimProfile* newProfile);
+void SimChargeComplete();
+float SimCupWeight();
+
+#endif // SIMULATOR_H
\ No newline at end of file
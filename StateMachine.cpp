@@ -1,34 +1,10 @@
 // StateMachine.cpp
 // Contains implementations of functions declared in StateMachine.cpp
-//
-// State machine tracker values
-// 0 = Setup
-// 1 = Calibration
-// 2 = Idle
-// 3 = Ready
-// 4 = Dispense/Run
-// 5 = Evaluate
-// -1 = Error identification
-// -2 = Recoverable Error (waiting for reset)
-// -3 = Unrecoverable Error (waiting for power cycle)
-#define SETUP_STATE 0
-#define CALIBRATION_STATE 1
-#define IDLE_STATE 2
-#define READY_STATE 3
-#define DISPENSE_STATE 4
-#define EVALUATE_STATE 5
-#define ERRORID_STATE -1
-#define RECOVERABLE_STATE -2
-#define UNRECOVERABLE_STATE -3
 
 // Include the header file
 #include "StateMachine.h"
 
-// Error tracker
-// 0 = No error
-// 1 = Scale response timed out (recoverable)
-// 2 = Scale response includes out of range characters (unrecoverable, fix scale configuration)
-// 3 = Scale response < -0.5 after bulk is completed
+// Error tracker, its values are listed in StateMachine.h
 int error = 0;
 
 // Calibration variables (in Steppers.cpp)
@@ -37,226 +13,390 @@ int error = 0;
 
 // Calibrate state variables
 bool recalibrateFlag = false;
+byte powderSlot = 0; // Powder profile selected from the Idle state
+byte loadedPowder = PROFILE_COUNT; // Powder the calibration in use belongs to, PROFILE_COUNT before the first calibration
 float versionNumber = (VERSION_MAJOR * 1) + (VERSION_MINOR * 0.1);
 int motorDirection = 1;
+Settings settings; // Last saved settings
+bool calibrationWaiting = false; // Setup is done, waiting for the enable toggle
+unsigned long enableStart = 0; // millis() the enable toggle was last seen off while waiting
 
 // Idle state variables
-int recalibrateStart = 0;
-int curTime = 0;
 bool firstIdleUpdate = true;
 int btnIncrements = 0;
+byte heldButtons = 0; // Buttons held as of the last pass (UP_HELD and DOWN_HELD)
+unsigned long buttonsStart = 0; // millis() heldButtons last changed, or last repeated a single button
+bool releaseWait = false; // Buttons are ignored until both are released, after a powder was selected
 
 // Ready state variables
 bool firstReadyUpdate = true;
 
 // Dispense state variables
-double dispenseWeight = 0;
-double targetWeight = 32; // Default target weight of -2gr
+Weight dispenseWeight = 0;
+Weight targetWeight = GRAINS(32); // Default target weight of 32gr
 long startTime = 0;
 long endTime = 0;
 float secondBulkCalibration = STAGE_TWO_DEFAULT;
-double errorMargin = 0.02;
+Weight errorMargin = GRAINS(0.02);
 
 // Evaluate state variables
-double evaluateWeight = 0;
+Weight evaluateWeight = 0;
 bool firstEvaluate = true;
 bool evaluateUpdate = false;
 long elapsedTime = 0;
+int snapshotCharges = 0; // Charges since the profile in use was last saved
+
+// Settle prediction error tracking
+int predictionCount = 0;
+Weight predictionErrorTotal = 0;
+
+// Closed loop bulk state
+float bulkLatency = BULK_FALL_LATENCY;
+Weight bulkCutoffPrediction = 0; // Weight the closed loop predicted the last pulse would settle at
+bool bulkCutoffValid = false;
+long bulkThrowSteps = 0; // Dispense steps of the last bulk throw, counted the way BulkSteps() plans them
+
+// Bulk planner state
+RunningStats cutoffStats; // Weight each closed loop first pulse settled at, less the weight it was cut off for
+RunningStats excessStats[SECOND_PULSE_KINDS]; // Weight each kind of second pulse delivered, less the weight it was planned for
+float lastPlanned[SECOND_PULSE_KINDS]; // Weight the last second pulse of each kind was planned for
+byte cutoffWarmup = 0; // Closed loop pulses still to go before cutoffStats learns from them
+float bulkPulseTime[SECOND_PULSE_KINDS] = {BULK_PULSE_TIME, BULK_PULSE_TIME};
+float trickleRate = TRICKLE_RATE;
+unsigned long trickleStart = 0; // millis() the trickle of the current charge started
+Weight trickleStartWeight = 0;
+bool trickleTimed = false; // The current charge has been trickled since trickleStart
+
+// Post-trickle wait state
+RunningStats arrivalStats; // Time in ms from the end of a fine trickle burst to the scale registering it
+RunningStats settleStats; // Time in ms from the end of a trickle to the scale reaching the weight it settled at
+
+// State machine variables
+static int currentState = SETUP_STATE;
+static unsigned long stateStart = 0; // millis() the current state was entered, or the statistics were reset
+static unsigned long stateTime[STATE_COUNT]; // Time in ms spent in each state since the statistics were reset, not counting the current visit
+static unsigned int stateVisits[STATE_COUNT];
+static unsigned long stateStatsStart = 0;
+
+// StateTraceEntry
+// One change of state in the trace buffer
+typedef struct
+{
+  int8_t state;
+  unsigned long time; // millis() the state was entered
+} StateTraceEntry;
+
+static StateTraceEntry stateTrace[STATE_TRACE_LENGTH];
+static byte traceHead = 0; // Entry the next change of state is written to
+static byte traceCount = 0;
+
+static void changeState(int nextState);
+static void traceState(int state, unsigned long time);
+static const StateHandlers* handlersOf(int state);
+
+static void enterCalibration();
+static void enterIdle();
+static void enterReady();
+static void enterEvaluate();
+static void exitEvaluate();
+static void enterRecoverable();
+static void exitRecoverable();
+static void enterUnrecoverable();
+
+// State table
+// A tick returning a state its row does not list as an exit is an error, Setup has no tick since setup() runs it before the state machine starts
+// EEPROM writes stall the CPU for several ms, so they are only allowed while idle or while a finished charge waits on the scale
+static constexpr StateHandlers stateTable[STATE_COUNT] =
+{
+  {UNRECOVERABLE_STATE, "Unrecoverable Error", enterUnrecoverable, UnrecoverableErrorState, NULL, 0, false},
+  {RECOVERABLE_STATE, "Recoverable Error", enterRecoverable, RecoverableErrorState, exitRecoverable, STATE_BIT(IDLE_STATE), false},
+  {ERRORID_STATE, "Error ID", NULL, ErrorIdState, NULL, STATE_BIT(RECOVERABLE_STATE) | STATE_BIT(UNRECOVERABLE_STATE), false},
+  {SETUP_STATE, "Setup", NULL, NULL, NULL, STATE_BIT(CALIBRATION_STATE), false},
+  {CALIBRATION_STATE, "Calibration", enterCalibration, CalibrationState, NULL, STATE_BIT(IDLE_STATE), false},
+  {IDLE_STATE, "Idle", enterIdle, IdleState, NULL, STATE_BIT(READY_STATE) | STATE_BIT(CALIBRATION_STATE), true},
+  {READY_STATE, "Ready", enterReady, ReadyState, NULL, STATE_BIT(IDLE_STATE) | STATE_BIT(DISPENSE_STATE) | STATE_BIT(ERRORID_STATE), false},
+  {DISPENSE_STATE, "Dispense", NULL, DispenseState, NULL, STATE_BIT(IDLE_STATE) | STATE_BIT(READY_STATE) | STATE_BIT(EVALUATE_STATE), false},
+  {EVALUATE_STATE, "Evaluate", enterEvaluate, EvaluateState, exitEvaluate, STATE_BIT(IDLE_STATE) | STATE_BIT(READY_STATE), true}
+};
+
+// tableInOrder()
+// Checks at compile time that each row of the state table is at the index of its tracker value
+static constexpr bool tableInOrder(int row)
+{
+  return (row >= STATE_COUNT) || ((stateTable[row].state == (FIRST_STATE + row)) && tableInOrder(row + 1));
+}
+static_assert(tableInOrder(0), "State table rows must be in tracker value order");
 
-// CalibrationState()
-// During this state the system will calibrate the trickler kernel weight
-// isEnabled() must be true at all times to continue
-//
-// Entered from:
-// - Setup state (when setup ends succesfully)
-// - Idle state (when user requests re-calibration)
-// Exits to:
-// - Idle state (when calibration is successful or skipped by the user)
-// - Error ID state (when calibration fails)
-int CalibrationState()
+// StartStateMachine()
+// Called at the end of setup(), records the Setup state and advances to the Calibration state
+void StartStateMachine()
 {
-  // Reset LEDs
-  digitalWrite(GREEN_LED, LOW);
-  digitalWrite(YELLOW_LED, LOW);
-  digitalWrite(RED_LED, LOW);
+  // Setup has run since power on
+  traceState(SETUP_STATE, 0);
+  stateVisits[SETUP_STATE - FIRST_STATE] = 1;
 
-  // Create loop flag for first time calibration
-  bool loopFlag = true;
+  changeState(CALIBRATION_STATE);
+}
+
+// RunStateMachine()
+// Runs one tick of the current state, called once per pass of the main loop
+void RunStateMachine()
+{
+  const StateHandlers* handlers = handlersOf(currentState);
+  if(!handlers->tick)
+  {
+    return;
+  }
 
-  // Read stored version number and motor direction from EEPROM to compare to current version
-  int storedDirection;
-  EEPROM.get(DIRECTION_MEMORY_ADDR, storedDirection);
+  int nextState = handlers->tick();
+  if(nextState != currentState)
+  {
+    changeState(nextState);
+  }
+}
 
-  double storedTarget;
-  EEPROM.get(TARGET_MEMORY_ADDR, storedTarget);
+// CurrentState()
+// Returns the state machine tracker value
+int CurrentState()
+{
+  return currentState;
+}
 
-  // First time setup, we need to calibrate motor direction in this instance (or manually commanded first-time setup which is 0xFFFFFF or -
-  if (isnan(storedTarget) || storedTarget <= 0 || storedTarget > 275)
+// changeState()
+// Leaves the current state for the next one through the state table, running their exit and enter hooks
+// A change the table does not allow advances to the Error ID state instead
+static void changeState(int nextState)
+{
+  const StateHandlers* handlers = handlersOf(currentState);
+
+  if((nextState < FIRST_STATE) || (nextState >= (FIRST_STATE + STATE_COUNT)) || !(handlers->exits & STATE_BIT(nextState)))
   {
-    Serial.println("Starting first time setup");
-    // Display the First Time Setup screen and set motor direction
-    MotorDirectionSetup();
-    SetMotorDirection(motorDirection);
+    Serial.print(handlers->name);
+    Serial.print(" state cannot exit to state ");
+    Serial.print(nextState);
+    Serial.println(", advancing to ErrorID state");
+    error = 4;
+    nextState = ERRORID_STATE;
+  }
 
-    // Start looping until the up or the down button has been pressed
-    while(loopFlag)
-    {
-      Serial.println("No button pressed, doing a half turn of bulk motor");
-      // Make bulk motor do a 1/2 turn
-      if(!bulkThrow(0.5 * GetBulkWeight(), true))
-      {
-        Serial.println("First time setup failed somehow, things are seriously wrong");
-        // Reset flags and return to idle state
-        firstIdleUpdate = true;
-        recalibrateFlag = false;
-        return IDLE_STATE;
-      }
-      delay(500);
+  if(handlers->exit)
+  {
+    handlers->exit();
+  }
 
-      // Check if either button has been pressed
-      if(upPressed() || downPressed())
-      {
-        // Wait for debounce and verify
-        delay(250);
+  unsigned long now = millis();
+  stateTime[currentState - FIRST_STATE] += now - stateStart;
+  stateStart = now;
+  currentState = nextState;
+  stateVisits[currentState - FIRST_STATE]++;
+  traceState(currentState, now);
 
-        // Motor is rotating clockwise, backwards, so need to reverse the motor direction before storing it to EEPROM
-        if(upPressed() && !downPressed())
-        {
-          Serial.println("Up button detected, reversing motor direction");
-          motorDirection = -motorDirection;
-          EEPROM.put(DIRECTION_MEMORY_ADDR, motorDirection);
-          SetMotorDirection(motorDirection);
+  handlers = handlersOf(currentState);
+  SetStorageWrites(handlers->storageWrites);
+  if(handlers->enter)
+  {
+    handlers->enter();
+  }
+}
 
-          loopFlag = false;
-        }
+// traceState()
+// Writes a change of state to the trace buffer, overwriting the oldest once it is full
+static void traceState(int state, unsigned long time)
+{
+  stateTrace[traceHead].state = state;
+  stateTrace[traceHead].time = time;
+  traceHead = (traceHead + 1) % STATE_TRACE_LENGTH;
+  if(traceCount < STATE_TRACE_LENGTH)
+  {
+    traceCount++;
+  }
+}
 
-        // Motor is correct, do not change before storing to EEPROM
-        else if(downPressed())
-        {
-          Serial.println("Down button detected, motor direction staying unchanged");
-          EEPROM.put(DIRECTION_MEMORY_ADDR, motorDirection);
+// handlersOf()
+// Returns the state table row of a tracker value
+static const StateHandlers* handlersOf(int state)
+{
+  return &stateTable[state - FIRST_STATE];
+}
 
-          loopFlag = false;
-        }
-      }
-    }
-    bool startingEnabled = isEnabled();
+// PrintStateTrace()
+// Prints the changes of state in the trace buffer, oldest first, with the time spent in each
+void PrintStateTrace()
+{
+  unsigned long now = millis();
 
-    // Check the motor direction before storing version info
-    MotorDirectionStored(motorDirection);
-    if(!bulkThrow(3 * GetBulkWeight(), true))
+  Serial.print("Last ");
+  Serial.print(traceCount);
+  Serial.println(" changes of state:");
+
+  byte entry = (traceHead + STATE_TRACE_LENGTH - traceCount) % STATE_TRACE_LENGTH;
+  for(byte i = 0; i < traceCount; i++)
+  {
+    byte next = (entry + 1) % STATE_TRACE_LENGTH;
+    bool last = (i == (traceCount - 1));
+    unsigned long left = last ? now : stateTrace[next].time;
+
+    Serial.print(stateTrace[entry].time / 1000.0, 2);
+    Serial.print("s ");
+    Serial.print(handlersOf(stateTrace[entry].state)->name);
+    Serial.print(" for ");
+    Serial.print((left - stateTrace[entry].time) / 1000.0, 2);
+    Serial.println(last ? "s so far" : "s");
+
+    entry = next;
+  }
+}
+
+// PrintStateTimes()
+// Prints the visits to and time spent in each state since the statistics were reset
+void PrintStateTimes()
+{
+  unsigned long now = millis();
+  unsigned long elapsed = now - stateStatsStart;
+
+  Serial.print("Time in each state over the last ");
+  Serial.print(elapsed / 1000.0, 1);
+  Serial.println("s:");
+
+  for(byte row = 0; row < STATE_COUNT; row++)
+  {
+    if(!stateVisits[row])
     {
-      Serial.println("First time setup failed somehow, things are seriously wrong");
-      // Reset flags and return to idle state
-      firstIdleUpdate = true;
-      recalibrateFlag = false;
-      return IDLE_STATE;
+      continue;
     }
-    delay(1000);
 
-    if(isEnabled() != startingEnabled)
+    unsigned long spent = stateTime[row];
+    if(stateTable[row].state == currentState)
     {
-      Serial.println("User has confirmed it's wrong, just go straight to idle and force them to restart to fix");
-      firstIdleUpdate = true;
-      recalibrateFlag = false;
-      return IDLE_STATE;
+      spent += now - stateStart;
     }
 
-    // Store the versionNumber to EEPROM and then we're good to go
-    EEPROM.put(VERSION_MEMORY_ADDR, versionNumber);
-    EEPROM.put(TARGET_MEMORY_ADDR, targetWeight);
+    Serial.print(stateTable[row].name);
+    Serial.print(" = ");
+    Serial.print(spent / 1000.0, 1);
+    Serial.print("s (");
+    Serial.print(elapsed ? ((spent * 100.0) / elapsed) : 0, 1);
+    Serial.print("%) over ");
+    Serial.print(stateVisits[row]);
+    Serial.println(" visits");
+  }
+}
 
-    Serial.print("Stored '");
-    Serial.print(versionNumber, 6);
-    Serial.print("' to the version number and '");
-    Serial.print(motorDirection, 2);
-    Serial.println("' to the motorDirection");
+// ResetStateTimes()
+// Clears the time spent in each state, the current visit counts from now
+void ResetStateTimes()
+{
+  for(byte row = 0; row < STATE_COUNT; row++)
+  {
+    stateTime[row] = 0;
+    stateVisits[row] = 0;
   }
-  // First time setup has already been done before
-  else
+
+  stateStatsStart = millis();
+  stateStart = stateStatsStart;
+  stateVisits[currentState - FIRST_STATE] = 1;
+}
+
+// enterCalibration()
+// Calibration starts with setup on its first tick
+static void enterCalibration()
+{
+  calibrationWaiting = false;
+}
+
+// CalibrationState()
+// During this state the system will calibrate the trickler kernel weight
+// isEnabled() must be true at all times to continue
+//
+// Entered from:
+// - Setup state (when setup ends succesfully)
+// - Idle state (when user requests re-calibration)
+// Exits to:
+// - Idle state (when calibration is successful, fails or is skipped by the user)
+int CalibrationState()
+{
+  // Setup runs on the first pass, the passes after it return to the main loop until the enable toggle has been switched on for BUTTON_DEBOUNCE
+  if(!calibrationWaiting)
   {
-    // Set the motor direction to be equal to the one read from EEPROM
-    if(storedDirection > 0)
+    int setupState = calibrationSetup();
+
+    // First time setup disarms the emergency stop, it uses the enable switch to confirm the motor direction
+    ArmEmergencyStop(true);
+
+    if(setupState != CALIBRATION_STATE)
     {
-      motorDirection = 1;
-      SetMotorDirection(motorDirection);
+      return IDLE_STATE;
     }
-    else
+
+    Serial.println("Beginning calibration, waiting for enable toggle");
+    calibrationWaiting = true;
+    enableStart = millis();
+  }
+
+  if(!isEnabled())
+  {
+    enableStart = millis();
+
+    // Nothing is moving, the switch has to be turned on again after an emergency stop
+    if(!digitalRead(ENABLE_BTN))
     {
-      motorDirection = -1;
-      SetMotorDirection(motorDirection);
+      ClearEmergencyStop();
     }
+
+    // Nothing is dispensing, finish writing the first time setup
+    StorageUpdate();
+    return CALIBRATION_STATE;
+  }
+  if((millis() - enableStart) < BUTTON_DEBOUNCE)
+  {
+    return CALIBRATION_STATE;
   }
+  calibrationWaiting = false;
 
   float initialWeight;
   float finalWeight;
 
-  double tempTarget;
+  Serial.println("Beginning calibration, priming trickler and bulk");
+  resetBulkPlanner();
+  // A saved profile for the selected powder only needs a verification throw
+  bool usingProfile = loadProfile();
 
-  // Change display to "Waiting for Calibration" display
-  WaitingToCalibrate(motorDirection);
+  // Until this calibration succeeds the calibration in use belongs to no powder, so it is not saved over a profile
+  loadedPowder = PROFILE_COUNT;
 
-  // Check if we are recalibrating and avoid replacing targetWeight if so
-  if(recalibrateFlag)
+  // Update the display to the calibration state
+  if(usingProfile)
   {
-    Serial.println("Recalibrating, no saved targetWeight read required");
-    recalibrateFlag = false;
+    VerifyProfileScreen(powderSlot + 1);
   }
   else
   {
-    Serial.println("First calibration, reading saved targetWeight from EEPROM");
-
-    EEPROM.get(TARGET_MEMORY_ADDR, tempTarget);
-
-    // Make sure the read value is within range
-    if((0 <= tempTarget) && (tempTarget <= 250))
-    {
-      // Set targetWeight to the read value
-      targetWeight = tempTarget;
-      Serial.print("Read target value is: '");
-      Serial.print(tempTarget, 6);
-      Serial.println("', setting targetWeight to match");
-    }
-    // Read value is out of range
-    else
-    {
-      Serial.print("Read value out of range: '");
-      Serial.print(tempTarget, 6);
-      Serial.println("', leaving targetWeight as default of 32.00gr");
-    }
+    CalibrationScreen();
   }
 
-  Serial.println("Beginning calibration, waiting for enable toggle");
-  
-  // Wait for enable button press before advancing further
-  while(!isEnabled())
+  // The quick calibration checks its first bulk throw against the prime, so the prime is weighed
+  float primeStartWeight = 0;
+  bool primeWeighed = false;
+  if(QUICK_CALIBRATION && !usingProfile)
   {
-    // Do nothing while waiting here
+    primeWeighed = calibrationWeight(LONG, CALIBRATION_STABILITY, &primeStartWeight);
   }
-  delay(250); // Button debouncing time
-
-  Serial.println("Beginning calibration, priming trickler and bulk");
-  // Update the display to the calibration state
-  CalibrationScreen();
 
-  // Prime the trickler with more than 1/2 rotation (more than 32 kernels) to fill disk slots
-  TrickleDispense(40);
+  // Prime the trickler with more than 1/2 rotation (more than 32 kernels) to fill disk slots, while the bulk primes
+  TrickleDispense(PRIME_KERNELS);
 
   // Prime the bulk dispenser with more than 1/2 rotation to fill the bulk disk (dispense more than 50% of GetBulkWeight(), which returns grains per rev)
-  if(!bulkThrow(0.5 * GetBulkWeight()))
+  if(!bulkThrow(GetBulkRevWeight() / 2))
   {
     Serial.println("Calibration failed during bulk prime");
-    // Reset flags and return to idle state
-    firstIdleUpdate = true;
     return IDLE_STATE;
   }
+  long primeSteps = bulkThrowSteps;
 
   // Wait for trickler priming movement to finish
   if(!waitForTrickle())
   {
     Serial.println("Calibration failed during trickle prime");
-    // Reset flags and return to idle state
-    firstIdleUpdate = true;
     return IDLE_STATE;
   }
 
@@ -265,149 +405,358 @@ int CalibrationState()
   digitalWrite(YELLOW_LED, HIGH);
   digitalWrite(RED_LED, LOW);
 
+  // grainsPerRev of the previous throw, which the first quick calibration throw has to agree with
+  float referenceGrainsPerRev = 0;
+
   // ----------------
-  // Stage 1 Bulk Calibration
+  // Profile Verification
   // ----------------
-  Serial.println("Gathering initial weight for stage 1 bulk calibration");
-  // Gather initial stable weight
-  initialWeight = StableWeight(2000);
-
-  Serial.print("Stage 1 Bulk calibration initial weight = '");
-  Serial.print(initialWeight, 6);
-  Serial.println("'");
-
-  for(int i = 0; i < 4; i++)
+  if(usingProfile)
   {
-    Serial.print("Starting #");
-    Serial.print(i+1);
-    Serial.println(" of 4 targetWeight bulk dispenses");
+    Serial.println("Gathering initial weight for the profile verification throw");
+    if(!calibrationWeight(2000, STABLE_WINDOW, &initialWeight))
+    {
+      Serial.println("Calibration failed, no usable weight before the verification throw");
+      return IDLE_STATE;
+    }
 
     if(!bulkThrow(targetWeight))
     {
-      Serial.println("Calibration failed/cancelled during the bulk throws");
-      // Reset flags and return to idle state b/c enable toggle was switched off
-      firstIdleUpdate = true;
+      Serial.println("Calibration failed/cancelled during the verification throw");
+      // Return to idle state b/c enable toggle was switched off
       return IDLE_STATE;
     }
 
-    delay(500);
-  }
-
-  Serial.println("Gathering final weight for stage 1 bulk calibration");
-  // Gather final stable weight
-  finalWeight = StableWeight(2000);
+    if(!calibrationWeight(2000, STABLE_WINDOW, &finalWeight))
+    {
+      Serial.println("Calibration failed, no usable weight after the verification throw");
+      return IDLE_STATE;
+    }
 
-  Serial.print("Ending stage 1 bulk calibration, final weight = '");
-  Serial.print(finalWeight, 6);
-  Serial.println("'");
+    // Compare the throw with the weight the profile predicts for the steps it turned
+    float expectedWeight = bulkThrowSteps * (GetBulkEstimate() / STEPS_PER_REV);
+    float measuredWeight = finalWeight - initialWeight;
 
-  // Calculate the total revs dispensed and total weight dispensed
-  float targetRevs = targetWeight / GetBulkWeight();
-  float totalRevs = targetRevs * 4;
+    Serial.print("Verification throw expected = ");
+    Serial.print(expectedWeight, 6);
+    Serial.print(", measured = ");
+    Serial.println(measuredWeight, 6);
 
-  float totalWeight = finalWeight - initialWeight;
+    if(fabs(measuredWeight - expectedWeight) <= (PROFILE_VERIFY_TOLERANCE * expectedWeight))
+    {
+      Serial.println("Verification throw matches the profile, skipping calibration");
+      ObserveBulk(bulkThrowSteps, measuredWeight);
+      loadedPowder = powderSlot;
 
-  // Calculate the calibrated grainsPerRev based on these totals (and adjust up by 5% to avoid early overthrows)
-  float newGrainsPerRev = (totalWeight / totalRevs) * 1.05;
+      // Indicate calibration success with the LEDs
+      digitalWrite(GREEN_LED, HIGH);
+      digitalWrite(YELLOW_LED, LOW);
+      digitalWrite(RED_LED, LOW);
 
-  Serial.print("totalRevs = ");
-  Serial.println(totalRevs, 6);
-  Serial.print("totalWeight = ");
-  Serial.println(totalWeight, 6);
-  Serial.print("newGrainsPerRev = ");
-  Serial.println(newGrainsPerRev, 6);
+      StageOneBulk(measuredWeight, expectedWeight);
 
-  // Verify calibration value is within range
-  if((20 < newGrainsPerRev) && (newGrainsPerRev < 150))
-  {
-    Serial.println("Stage 1 Bulk calibration value in range, updating grainsPerRev");
-    SetBulkWeight(newGrainsPerRev);
+      WaitMillis(1000);
 
-    // Indicate calibration success with the LEDs
-    digitalWrite(GREEN_LED, HIGH);
-    digitalWrite(YELLOW_LED, LOW);
-    digitalWrite(RED_LED, LOW);
+      return calibrationResults();
+    }
 
-    StageOneBulk(newGrainsPerRev,GetBulkWeight());
+    Serial.println("Verification throw does not match the profile, running a full calibration");
 
-    delay(1000);
-  }
-  // Out of range calibration value
-  else
-  {
-    Serial.println("Bulk calibration out of spec, no parameter update");
+    // What was adapted for the profile's powder does not apply to this one
+    secondBulkCalibration = STAGE_TWO_DEFAULT;
+    bulkLatency = BULK_FALL_LATENCY;
 
-    // Indicate calibration failure with the LEDs
+    // Indicate verification failure with the LEDs
     digitalWrite(GREEN_LED, LOW);
     digitalWrite(YELLOW_LED, LOW);
     digitalWrite(RED_LED, HIGH);
 
-    StageOneBulk(newGrainsPerRev,GetBulkWeight());
+    StageOneBulk(measuredWeight, expectedWeight);
 
-    delay(2000);
+    // The failed verification throw takes the place of the prime as the first throw's reference
+    referenceGrainsPerRev = measuredWeight / ((float)bulkThrowSteps / STEPS_PER_REV);
+
+    WaitMillis(2000);
+
+    CalibrationScreen();
+    digitalWrite(YELLOW_LED, HIGH);
+    digitalWrite(RED_LED, LOW);
   }
 
   // ----------------
-  // Trickler Calibration
+  // Stage 1 Bulk Calibration
   // ----------------
-  // Correct initial stable weight
-  initialWeight = finalWeight;
+  Serial.println("Gathering initial weight for stage 1 bulk calibration");
+  // Gather initial stable weight, a failed verification throw has already been weighed
+  if(usingProfile && QUICK_CALIBRATION)
+  {
+    initialWeight = finalWeight;
+  }
+  else if(!calibrationWeight(QUICK_CALIBRATION ? LONG : 2000, QUICK_CALIBRATION ? CALIBRATION_STABILITY : STABLE_WINDOW, &initialWeight))
+  {
+    Serial.println("Calibration failed, no usable initial weight for stage 1 bulk calibration");
+    return IDLE_STATE;
+  }
+  else if(QUICK_CALIBRATION && primeWeighed)
+  {
+    // grainsPerRev of the prime, less the kernels the trickler primed alongside it
+    referenceGrainsPerRev = (initialWeight - primeStartWeight - (PRIME_KERNELS * GetKernelEstimate())) / ((float)primeSteps / STEPS_PER_REV);
+  }
 
-  Serial.print("Starting calibration trickle of 100 kernels, initial weight = '");
+  Serial.print("Stage 1 Bulk calibration initial weight = '");
   Serial.print(initialWeight, 6);
   Serial.println("'");
 
-  // Indicate calibration start with LEDs
-  digitalWrite(GREEN_LED, LOW);
-  digitalWrite(YELLOW_LED, HIGH);
-  digitalWrite(RED_LED, LOW);
-
-  // Request 200 kernels to be dropped
-  /*
-  for(int i = 0; i < 4; i++)
+  long totalSteps = 0;
+  if(QUICK_CALIBRATION)
   {
-    Serial.print("Starting #");
-    Serial.print(i+1);
-    Serial.println(" of four 25 kernel trickle dispenses");
+    // Each throw is weighed on its own, stopping once one agrees with the throw before it
+    float throwStart = initialWeight;
+    bool throwStartWeighed = true;
+    for(int i = 0; i < QUICK_BULK_MAX_THROWS; i++)
+    {
+      Serial.print("Starting quick calibration targetWeight bulk dispense #");
+      Serial.println(i+1);
+
+      if(!bulkThrow(targetWeight))
+      {
+        Serial.println("Calibration failed/cancelled during the bulk throws");
+        // Return to idle state b/c enable toggle was switched off
+        return IDLE_STATE;
+      }
+      totalSteps += bulkThrowSteps;
+
+      // A throw that could not be weighed is not compared, and neither is the next one as its start is unknown
+      if(!calibrationWeight(LONG, CALIBRATION_STABILITY, &finalWeight))
+      {
+        Serial.println("Throw could not be weighed, skipping its comparison");
+        throwStartWeighed = false;
+        continue;
+      }
+
+      if(throwStartWeighed)
+      {
+        float throwGrainsPerRev = (finalWeight - throwStart) / ((float)bulkThrowSteps / STEPS_PER_REV);
+
+        Serial.print("Throw grainsPerRev = ");
+        Serial.print(throwGrainsPerRev, 4);
+        Serial.print(", previous = ");
+        Serial.println(referenceGrainsPerRev, 4);
+
+        if(fabs(throwGrainsPerRev - referenceGrainsPerRev) <= (QUICK_BULK_AGREEMENT * throwGrainsPerRev))
+        {
+          break;
+        }
+        referenceGrainsPerRev = throwGrainsPerRev;
+      }
+      throwStart = finalWeight;
+      throwStartWeighed = true;
+    }
+
+    // The totals need the weight after the last throw
+    if(!throwStartWeighed && !calibrationWeight(LONG, CALIBRATION_STABILITY, &finalWeight))
+    {
+      Serial.println("Calibration failed, no usable final weight for stage 1 bulk calibration");
+      return IDLE_STATE;
+    }
+  }
+  else
+  {
+    for(int i = 0; i < 4; i++)
+    {
+      Serial.print("Starting #");
+      Serial.print(i+1);
+      Serial.println(" of 4 targetWeight bulk dispenses");
+
+      if(!bulkThrow(targetWeight))
+      {
+        Serial.println("Calibration failed/cancelled during the bulk throws");
+        // Return to idle state b/c enable toggle was switched off
+        return IDLE_STATE;
+      }
+      totalSteps += bulkThrowSteps;
+
+      WaitMillis(500);
+    }
+
+    Serial.println("Gathering final weight for stage 1 bulk calibration");
+    // Gather final stable weight
+    if(!calibrationWeight(2000, STABLE_WINDOW, &finalWeight))
+    {
+      Serial.println("Calibration failed, no usable final weight for stage 1 bulk calibration");
+      return IDLE_STATE;
+    }
+  }
+
+  Serial.print("Ending stage 1 bulk calibration, final weight = '");
+  Serial.print(finalWeight, 6);
+  Serial.println("'");
+
+  // Calculate the total revs dispensed and total weight dispensed
+  float totalRevs = (float)totalSteps / STEPS_PER_REV;
+
+  float totalWeight = finalWeight - initialWeight;
+  bool bulkCalibrated = false;
+
+  // Calculate the calibrated grainsPerRev based on these totals (the uncertainty of the estimate keeps the value in use on the safe side)
+  float newGrainsPerRev = totalWeight / totalRevs;
+
+  Serial.print("totalRevs = ");
+  Serial.println(totalRevs, 6);
+  Serial.print("totalWeight = ");
+  Serial.println(totalWeight, 6);
+  Serial.print("newGrainsPerRev = ");
+  Serial.println(newGrainsPerRev, 6);
+
+  // Verify calibration value is within range
+  if((20 < newGrainsPerRev) && (newGrainsPerRev < 150))
+  {
+    Serial.println("Stage 1 Bulk calibration value in range, updating grainsPerRev");
+    SetBulkWeight(newGrainsPerRev);
+    ObserveBulk(totalSteps, totalWeight);
+    bulkCalibrated = true;
+
+    // Indicate calibration success with the LEDs
+    digitalWrite(GREEN_LED, HIGH);
+    digitalWrite(YELLOW_LED, LOW);
+    digitalWrite(RED_LED, LOW);
+
+    StageOneBulk(newGrainsPerRev,GetBulkWeight());
+
+    WaitMillis(1000);
+  }
+  // Out of range calibration value
+  else
+  {
+    Serial.println("Bulk calibration out of spec, no parameter update");
+
+    // Indicate calibration failure with the LEDs
+    digitalWrite(GREEN_LED, LOW);
+    digitalWrite(YELLOW_LED, LOW);
+    digitalWrite(RED_LED, HIGH);
+
+    StageOneBulk(newGrainsPerRev,GetBulkWeight());
+
+    WaitMillis(2000);
+  }
+
+  // The calibration in use belongs to the selected powder even if part of it fails, only a good calibration is saved
+  loadedPowder = powderSlot;
+
+  // ----------------
+  // Trickler Calibration
+  // ----------------
+  // Correct initial stable weight
+  initialWeight = finalWeight;
+
+  Serial.print("Starting calibration trickle, initial weight = '");
+  Serial.print(initialWeight, 6);
+  Serial.println("'");
+
+  // Indicate calibration start with LEDs
+  digitalWrite(GREEN_LED, LOW);
+  digitalWrite(YELLOW_LED, HIGH);
+  digitalWrite(RED_LED, LOW);
+
+  // Request 200 kernels to be dropped
+  /*
+  for(int i = 0; i < 4; i++)
+  {
+    Serial.print("Starting #");
+    Serial.print(i+1);
+    Serial.println(" of four 25 kernel trickle dispenses");
 
     TrickleDispense(25);
     if(!waitForTrickle())
     {
       Serial.println("Calibration failed/cancelled during the trickle throws");
-      // Reset flags and return to idle state b/c enable toggle was switched off
-      firstIdleUpdate = true;
+      // Return to idle state b/c enable toggle was switched off
       return IDLE_STATE;
     }
 
-    delay(375);
+    WaitMillis(375);
   }
   */
-  TrickleDispense(200);
-  if(!waitForTrickle())
+  int trickledKernels = 0;
+  if(QUICK_CALIBRATION)
   {
-    Serial.println("Calibration failed/cancelled during the trickle throws");
-    // Reset flags and return to idle state b/c enable toggle was switched off
-    firstIdleUpdate = true;
-    return IDLE_STATE;
+    // Trickle in chunks, each weighed on its own, until the kernelWeight estimate is confident enough
+    // A chunk far from the estimate restarts it around the chunk, so a new powder keeps trickling
+    float chunkStart = initialWeight;
+    bool chunkStartWeighed = true;
+    while(trickledKernels < CALIBRATION_KERNELS)
+    {
+      TrickleDispense(QUICK_TRICKLE_KERNELS);
+      if(!waitForTrickle())
+      {
+        Serial.println("Calibration failed/cancelled during the trickle throws");
+        // Return to idle state b/c enable toggle was switched off
+        return IDLE_STATE;
+      }
+      trickledKernels += QUICK_TRICKLE_KERNELS;
+
+      // A chunk that could not be weighed is not observed, and neither is the next one as its start is unknown
+      if(!calibrationWeight(LONG, CALIBRATION_STABILITY, &finalWeight))
+      {
+        Serial.println("Trickle chunk could not be weighed, skipping its observation");
+        chunkStartWeighed = false;
+        continue;
+      }
+
+      if(chunkStartWeighed)
+      {
+        ObserveKernels(QUICK_TRICKLE_KERNELS, finalWeight - chunkStart);
+      }
+      chunkStart = finalWeight;
+      chunkStartWeighed = true;
+
+      if(GetKernelUncertainty() <= (QUICK_KERNEL_SPREAD * GetKernelEstimate()))
+      {
+        break;
+      }
+    }
+
+    // The kernel average needs the weight after the last chunk
+    if(!chunkStartWeighed && !calibrationWeight(LONG, CALIBRATION_STABILITY, &finalWeight))
+    {
+      Serial.println("Calibration failed, no usable final weight for the trickler calibration");
+      return IDLE_STATE;
+    }
+  }
+  else
+  {
+    TrickleDispense(CALIBRATION_KERNELS);
+    if(!waitForTrickle())
+    {
+      Serial.println("Calibration failed/cancelled during the trickle throws");
+      // Return to idle state b/c enable toggle was switched off
+      return IDLE_STATE;
+    }
+    trickledKernels = CALIBRATION_KERNELS;
+
+    Serial.println("Gathering final weight");
+    // Gather final stable weight
+    if(!calibrationWeight(2000, STABLE_WINDOW, &finalWeight))
+    {
+      Serial.println("Calibration failed, no usable final weight for the trickler calibration");
+      return IDLE_STATE;
+    }
   }
-  
-  Serial.println("Gathering final weight");
-  // Gather final stable weight
-  finalWeight = StableWeight(2000);
 
   Serial.print("Ending trickler calibration, final weight = '");
   Serial.print(finalWeight, 6);
   Serial.println("'");
 
-  // Calculate average kernelWeight (and adjust it up by 5% to avoid early overtrickles)
+  // Calculate average kernelWeight (the uncertainty of the estimate keeps the value in use on the safe side)
   float weightDiff = finalWeight - initialWeight;
-  float kernelAverage = (weightDiff / 200) * 1.05;
+  float kernelAverage = weightDiff / trickledKernels;
 
   // Verify kernelAverage is within range
   if((0.01 < kernelAverage) && (0.10 > kernelAverage))
   {
     // If within range, update the kernelWeight and return
     SetKernelWeight(kernelAverage);
+    ObserveKernels(trickledKernels, weightDiff);
     Serial.print("New kernelWeight = '");
     Serial.print(kernelAverage, 6);
     Serial.println("'");
@@ -416,12 +765,16 @@ int CalibrationState()
     if(kernelAverage > 0.035 && kernelAverage <= 0.05)
     {
       Serial.println("Setting errorMargin to 0.04 because of kernelWeight");
-      errorMargin = 0.04;
+      errorMargin = GRAINS(0.04);
     }
     else if(kernelAverage > 0.05)
     {
       Serial.println("Setting errorMargin to 0.06 because of kernelWeight");
-      errorMargin = 0.06;
+      errorMargin = GRAINS(0.06);
+    }
+    else
+    {
+      errorMargin = GRAINS(0.02);
     }
 
     // Indicate calibration success with LEDs
@@ -431,7 +784,13 @@ int CalibrationState()
 
     Trickle(kernelAverage, GetKernelWeight());
 
-    delay(2500);
+    WaitMillis(2500);
+
+    // Save the new calibration as the selected powder's profile
+    if(bulkCalibrated)
+    {
+      saveProfile();
+    }
 
     // DO NOT RETURN TO IDLE (need to display results)
   }
@@ -449,165 +808,377 @@ int CalibrationState()
 
     Trickle(kernelAverage, GetKernelWeight());
 
-    delay(2000);
+    WaitMillis(2000);
 
     // DO NOT RETURN TO IDLE (need to display results)
   }
 
-  // Turn all LEDs off
-  digitalWrite(GREEN_LED, LOW);
-  digitalWrite(YELLOW_LED, LOW);
-  digitalWrite(RED_LED, LOW);
-
-  bool firstScreenUpdate = true;
-  // Infinite loop to display calibration results until enable button is toggled off
-  while(isEnabled())
-  {
-    // Only update the display once
-    if(firstScreenUpdate)
-    {
-      Serial.println("Displaying calibration results and awaiting toggle before advancting to idle state");
-
-      CalibrationComplete(GetBulkWeight(), GetKernelWeight());
-      firstScreenUpdate = false;
-    }
-  }
-
-  // Just in case we haven't yet returned for some reason
-  StopMotors();
-  firstIdleUpdate = true;
-  return IDLE_STATE;
+  return calibrationResults();
 }
 
-// IdleState()
-// During this state the system waits for user input
-// User may depress the enable toggle to move to Ready state (isEnabled() must be false at all times)
-// User may press up/down buttons to adjust target weight
-// User may press and hold both up & down buttons to request re-calibration
-//
-// Entered from:
-// - Calibration state (when successful or skipped by the user)
-// - Ready/Dispense/Evaluate states (when user toggles the enable switch to off)
-// - Recoverable Error state (when enable switch has been toggled on and back off again)
-// Exits to
-// - Ready state (when user toggles enable switch to on)
-// - Calibration state (when user presses and holds both up & down buttons at the same time)
-int IdleState()
+// calibrationSetup()
+// Runs first time setup if nothing has been saved, then restores the saved settings ahead of calibrating
+// Returns CALIBRATION_STATE to wait for the enable toggle, or IDLE_STATE if first time setup fails
+int calibrationSetup()
 {
   // Reset LEDs
   digitalWrite(GREEN_LED, LOW);
   digitalWrite(YELLOW_LED, LOW);
   digitalWrite(RED_LED, LOW);
 
-  // Reset recalibration flag, just in case
-  recalibrateFlag = false;
+  // Create loop flag for first time calibration
+  bool loopFlag = true;
 
-  // Change display to Idle state display
-  if(firstIdleUpdate)
-  {
-    btnIncrements = 0;
-    Serial.println("Entered Idle state for first time, updating display");
-    IdleScreen(targetWeight, errorMargin);
-    firstIdleUpdate = false;
-  }
+  // Read stored version number, motor direction and target from the EEPROM store
+  bool settingsSaved = loadSettings();
 
-  // Advance to ready state if enable is pressed
-  if(isEnabled())
+  // First time setup, we need to calibrate motor direction in this instance (or manually commanded first-time setup which is 0xFFFFFF or -
+  if (!settingsSaved)
   {
-    Serial.println("Enable switch toggled to on in Idle state");
-
-    // Check if the stored targetWeight in EEPROM has changed
-    float tempTarget;
-    EEPROM.get(TARGET_MEMORY_ADDR, tempTarget);
+    Serial.println("Starting first time setup");
+    ArmEmergencyStop(false);
+    // Display the First Time Setup screen and set motor direction
+    MotorDirectionSetup();
+    SetMotorDirection(motorDirection);
 
-    // targetWeight has changed, need to update saved value
-    if(tempTarget != targetWeight)
+    // Start looping until the up or the down button has been pressed
+    while(loopFlag)
     {
-      Serial.println("Writing new targetWeight value to EEPROM");
-      Serial.print("Old value = '");
-      Serial.print(tempTarget, 6);
-      Serial.print("', new value = '");
-      Serial.print(targetWeight, 6);
-      Serial.println("'");
+      Serial.println("No button pressed, doing a half turn of bulk motor");
+      // Make bulk motor do a 1/2 turn
+      if(!bulkThrow(GetBulkRevWeight() / 2, true))
+      {
+        Serial.println("First time setup failed somehow, things are seriously wrong");
+        // Reset flags and return to idle state
+        recalibrateFlag = false;
+        return IDLE_STATE;
+      }
+      WaitMillis(500);
 
-      EEPROM.put(TARGET_MEMORY_ADDR, targetWeight);
-    }
-    // targetWeight has not changed, do not update saved value
-    else
-    {
-      Serial.println("Saved targetWeight value matches current, no update necessary");
-    }
+      // Check if either button has been pressed
+      if(upPressed() || downPressed())
+      {
+        // Wait for debounce and verify
+        WaitMillis(250);
 
-    Serial.println("Advancing to Ready state");
+        // Motor is rotating clockwise, backwards, so need to reverse the motor direction before storing it to EEPROM
+        if(upPressed() && !downPressed())
+        {
+          Serial.println("Up button detected, reversing motor direction");
+          motorDirection = -motorDirection;
+          SetMotorDirection(motorDirection);
 
-    firstIdleUpdate = true;
-    btnIncrements = 0;
-    return READY_STATE;
-  }
+          loopFlag = false;
+        }
 
-  if(upPressed() && downPressed())
-  {
-    Serial.println("Up and Down buttons both pressed for the first time");
-    btnIncrements = 0;
-    // Establish the starting time they were both pressed
-    recalibrateStart = millis();
+        // Motor is correct, do not change before storing to EEPROM
+        else if(downPressed())
+        {
+          Serial.println("Down button detected, motor direction staying unchanged");
 
-    // Check the button states on a loop until the elapsed time reaches 2 seconds
-    for(curTime = millis(); curTime < (recalibrateStart + 2000); curTime = millis())
-    {
-      if(!upPressed() || !downPressed())
-      {
-        Serial.println("A button was released early, returning to Idle state");
-        return IDLE_STATE;
+          loopFlag = false;
+        }
       }
     }
-    // Proceed to recalibration
-    Serial.println("Both buttons held for 2000ms, setting recalibrateFlag and proceeding to Calibrate state");
-    recalibrateFlag = true; 
+    bool startingEnabled = isEnabled();
 
-    return CALIBRATION_STATE;
-  }
-  // Only up btn pressed
-  else if(upPressed() && !downPressed())
-  {
-    Serial.println("Only up pressed");
-    // Delay and re-measure for debounce
-    delay(250);
-    if(!upPressed() || downPressed())
+    // Check the motor direction before storing version info
+    MotorDirectionStored(motorDirection);
+    if(!bulkThrow(3 * GetBulkRevWeight(), true))
     {
-      // No increment if button states change
-      btnIncrements = 0;
+      Serial.println("First time setup failed somehow, things are seriously wrong");
+      // Reset flags and return to idle state
+      recalibrateFlag = false;
       return IDLE_STATE;
     }
+    WaitMillis(1000);
 
-    // Increment the btnIncrements and test to see if we should rollover to bigger value
-    btnIncrements++;
-    int targetHundrethsDigit = (int(targetWeight * 100) % 10);
-    int targetTenthsDigit = (int(targetWeight * 10) % 10);
-
-    // If the hundreths digit is 9 then we need to round up the tenths digit
-    if(targetHundrethsDigit == 9)
+    if(isEnabled() != startingEnabled)
+    {
+      Serial.println("User has confirmed it's wrong, just go straight to idle and force them to restart to fix");
+      recalibrateFlag = false;
+      return IDLE_STATE;
+    }
+
+    // Store the versionNumber, motorDirection and targetWeight and then we're good to go
+    settings.versionNumber = versionNumber;
+    settings.startups = 0;
+    saveSettings();
+
+    Serial.print("Stored '");
+    Serial.print(versionNumber, 6);
+    Serial.print("' to the version number and '");
+    Serial.print(motorDirection, 2);
+    Serial.println("' to the motorDirection");
+  }
+  // First time setup has already been done before
+  else
+  {
+    // Set the motor direction to be equal to the one read from EEPROM
+    if(settings.motorDirection > 0)
+    {
+      motorDirection = 1;
+      SetMotorDirection(motorDirection);
+    }
+    else
+    {
+      motorDirection = -1;
+      SetMotorDirection(motorDirection);
+    }
+  }
+
+  float tempTarget;
+
+  // Change display to "Waiting for Calibration" display
+  WaitingToCalibrate(motorDirection);
+
+  // Check if we are recalibrating and avoid replacing targetWeight if so
+  if(recalibrateFlag)
+  {
+    Serial.println("Recalibrating, no saved targetWeight read required");
+    recalibrateFlag = false;
+  }
+  else
+  {
+    Serial.println("First calibration, reading saved targetWeight from EEPROM");
+
+    tempTarget = settings.targetWeight;
+
+    // Make sure the read value is within range
+    if((0 <= tempTarget) && (tempTarget <= 250))
+    {
+      // Set targetWeight to the read value, saved in grains
+      targetWeight = GrainsToWeight(tempTarget);
+      Serial.print("Read target value is: '");
+      Serial.print(tempTarget, 6);
+      Serial.println("', setting targetWeight to match");
+    }
+    // Read value is out of range
+    else
+    {
+      Serial.print("Read value out of range: '");
+      Serial.print(tempTarget, 6);
+      Serial.println("', leaving targetWeight as default of 32.00gr");
+    }
+
+    powderSlot = (settings.powderSlot < PROFILE_COUNT) ? settings.powderSlot : 0;
+
+    // Count the startup so the age of saved profiles can be told
+    settings.startups++;
+    saveSettings();
+    Serial.print("Selected powder is ");
+    Serial.println(powderSlot + 1);
+  }
+
+  return CALIBRATION_STATE;
+}
+
+// calibrationResults()
+// Displays the calibration results until the enable toggle is switched off, then returns the Idle state
+int calibrationResults()
+{
+  // Turn all LEDs off
+  digitalWrite(GREEN_LED, LOW);
+  digitalWrite(YELLOW_LED, LOW);
+  digitalWrite(RED_LED, LOW);
+
+  bool firstScreenUpdate = true;
+  // Infinite loop to display calibration results until enable button is toggled off
+  while(isEnabled())
+  {
+    RunTasks();
+
+    // Nothing is dispensing, write out the saved profile
+    StorageUpdate();
+
+    // Only update the display once
+    if(firstScreenUpdate)
+    {
+      Serial.println("Displaying calibration results and awaiting toggle before advancting to idle state");
+
+      CalibrationComplete(GetBulkWeight(), GetKernelWeight());
+      firstScreenUpdate = false;
+
+#ifdef SIMULATE_POWDER
+      SimChargeComplete();
+#endif
+    }
+  }
+
+  // Just in case we haven't yet returned for some reason
+  StopMotors();
+  return IDLE_STATE;
+}
+
+// enterIdle()
+// The first tick updates the display and saves what was learned
+static void enterIdle()
+{
+  firstIdleUpdate = true;
+}
+
+// IdleState()
+// During this state the system waits for user input
+// User may depress the enable toggle to move to Ready state (isEnabled() must be false at all times)
+// User may press up/down buttons to adjust target weight
+// User may press and hold both up & down buttons to request re-calibration
+//
+// Entered from:
+// - Calibration state (when successful or skipped by the user)
+// - Ready/Dispense/Evaluate states (when user toggles the enable switch to off)
+// - Recoverable Error state (when enable switch has been toggled on and back off again)
+// Exits to
+// - Ready state (when user toggles enable switch to on)
+// - Calibration state (when user presses and holds both up & down buttons at the same time)
+int IdleState()
+{
+  // Reset LEDs
+  digitalWrite(GREEN_LED, LOW);
+  digitalWrite(YELLOW_LED, LOW);
+  digitalWrite(RED_LED, LOW);
+
+  // Reset recalibration flag, just in case
+  recalibrateFlag = false;
+
+  // At rest with the switch off, an emergency stop is over
+  if(!digitalRead(ENABLE_BTN))
+  {
+    ClearEmergencyStop();
+  }
+
+  // Change display to Idle state display
+  if(firstIdleUpdate)
+  {
+    btnIncrements = 0;
+    Serial.println("Entered Idle state for first time, updating display");
+    IdleScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin), powderSlot + 1);
+    firstIdleUpdate = false;
+
+    // Keep what was adapted while dispensing, the store writes it out while the trickler is idle
+    saveProfile();
+    snapshotCharges = 0;
+
+    // Report how well the background tasks kept up, how quickly any emergency stop took effect, and where the time went, since the trickler was last enabled
+    PrintTaskStats();
+    PrintEmergencyStopStats();
+    PrintStateTimes();
+  }
+
+  // Advance to ready state if enable is pressed
+  if(isEnabled())
+  {
+    Serial.println("Enable switch toggled to on in Idle state");
+
+    // Check if the saved targetWeight has changed, any change was already handed to the store by changeTarget()
+    if(StoragePending())
+    {
+      Serial.println("New targetWeight value is still being written to EEPROM, it finishes on the next return to Idle state");
+    }
+    else
+    {
+      Serial.println("Saved targetWeight value matches current, no update necessary");
+    }
+
+    // A different powder was selected, its profile has to be verified (or the powder calibrated) before dispensing
+    if(powderSlot != loadedPowder)
     {
-      // Roll over to 0 if the current 10ths digit is 9
-      if(targetTenthsDigit == 9)
+      Serial.println("Selected powder is not the calibrated one, proceeding to Calibrate state");
+      recalibrateFlag = true;
+      return CALIBRATION_STATE;
+    }
+
+    Serial.println("Advancing to Ready state");
+
+    // Each time the trickler is enabled starts a new session of scale, task loop, emergency stop and state time statistics
+    ResetScaleStats();
+    ResetTaskStats();
+    ResetEmergencyStopStats();
+    ResetStateTimes();
+
+    btnIncrements = 0;
+    return READY_STATE;
+  }
+
+  // Buttons are debounced across passes of the main loop instead of waiting here, any change restarts the debounce
+  byte buttons = (upPressed() ? UP_HELD : 0) | (downPressed() ? DOWN_HELD : 0);
+  if(buttons != heldButtons)
+  {
+    // Releasing both buttons after POWDER_SELECT_HOLD, but before the recalibration hold, selects the next powder
+    if((heldButtons == (UP_HELD | DOWN_HELD)) && !releaseWait)
+    {
+      if((millis() - buttonsStart) >= POWDER_SELECT_HOLD)
       {
-        targetTenthsDigit = 0;
+        // Keep what has been learned about the current powder before switching away from it
+        saveProfile();
+
+        powderSlot = (powderSlot + 1) % PROFILE_COUNT;
+        saveSettings();
+        IdleScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin), powderSlot + 1);
+
+        Serial.print("Both buttons released after ");
+        Serial.print(millis() - buttonsStart);
+        Serial.print("ms, selected powder ");
+        Serial.println(powderSlot + 1);
+
+        // Ignore the buttons until both are released so the release is not taken as a target change
+        releaseWait = true;
       }
       else
       {
-        targetTenthsDigit++;
+        Serial.println("A button was released early, returning to Idle state");
       }
-      // Roll over 100ths to 0
-      targetHundrethsDigit = 0;
     }
-    // All other floating point rounding errors (which are indicated by an odd numbered 100ths digit) need to increment hundredths by one
-    else if(targetHundrethsDigit % 2)
+    else if(buttons == (UP_HELD | DOWN_HELD))
+    {
+      Serial.println("Up and Down buttons both pressed for the first time");
+    }
+
+    if(!buttons)
+    {
+      releaseWait = false;
+    }
+    heldButtons = buttons;
+    buttonsStart = millis();
+    btnIncrements = 0;
+    return IDLE_STATE;
+  }
+
+  // Both buttons held for RECALIBRATE_HOLD proceeds to recalibration
+  if(heldButtons == (UP_HELD | DOWN_HELD))
+  {
+    if(!releaseWait && (millis() - buttonsStart) >= RECALIBRATE_HOLD)
     {
-      targetHundrethsDigit ++;
+      Serial.println("Both buttons held for 2000ms, setting recalibrateFlag and proceeding to Calibrate state");
+      recalibrateFlag = true;
+
+      // The release after calibration is not a powder selection
+      releaseWait = true;
+      return CALIBRATION_STATE;
     }
 
+    return IDLE_STATE;
+  }
+
+  // Nothing to do until a single button has been held for BUTTON_DEBOUNCE, holding it repeats the change at the same interval
+  if(!heldButtons || releaseWait || (millis() - buttonsStart) < BUTTON_DEBOUNCE)
+  {
+    return IDLE_STATE;
+  }
+  buttonsStart = millis();
+
+  // Only up btn pressed
+  if(heldButtons == UP_HELD)
+  {
+    Serial.println("Only up pressed");
+
+    // Increment the btnIncrements and test to see if we should rollover to bigger value
+    btnIncrements++;
+    // targetWeight is held in centigrains, so its digits are exact
+    int targetHundrethsDigit = targetWeight % 10;
+    int targetTenthsDigit = (targetWeight / 10) % 10;
+
     Serial.print("targetWeight = ");
-    Serial.print(targetWeight, 6);
+    Serial.print(WeightToGrains(targetWeight), 2);
     Serial.print(", tenths = ");
     Serial.print(targetTenthsDigit);
     Serial.print(", hundreths = ");
@@ -615,97 +1186,70 @@ int IdleState()
 
     if(btnIncrements >= 15 && targetTenthsDigit == 0)
     {
-      changeTarget(1);
-      IdleScreen(targetWeight, errorMargin);
+      changeTarget(GRAINS(1));
+      IdleScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin), powderSlot + 1);
       Serial.print("Incrementing target by 1gr, targetWeight = ");
-      Serial.println(targetWeight, 6);
+      Serial.println(WeightToGrains(targetWeight), 2);
     }
     else if(btnIncrements >= 5 && targetHundrethsDigit == 0)
     {
-      changeTarget(0.1);
-      IdleScreen(targetWeight, errorMargin);
+      changeTarget(GRAINS(0.1));
+      IdleScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin), powderSlot + 1);
       Serial.print("Incrementing target by 0.1gr, targetWeight = ");
-      Serial.println(targetWeight, 6);
+      Serial.println(WeightToGrains(targetWeight), 2);
     }
     else
     {
-      changeTarget(0.02);
-      IdleScreen(targetWeight, errorMargin);
+      changeTarget(GRAINS(0.02));
+      IdleScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin), powderSlot + 1);
       Serial.print("Incrementing target by 0.2gr, targetWeight = ");
-      Serial.println(targetWeight, 6);
+      Serial.println(WeightToGrains(targetWeight), 2);
     }
 
     return IDLE_STATE;
   }
   // Only down btn pressed
-  else if(downPressed() && !upPressed())
+  else
   {
     Serial.println("Only down pressed");
-    // Delay and re-measure for debounce
-    delay(250);
-    if(upPressed() || !downPressed())
-    {
-      // No decrement if button states change
-      btnIncrements = 0;
-      return IDLE_STATE;
-    }
 
     // Increment the btnIncrements and test to see if we should rollover to bigger value
     btnIncrements++;
-    int targetHundrethsDigit = (int(targetWeight * 100) % 10);
-    int targetTenthsDigit = (int(targetWeight * 10) % 10);
-
-    // If the hundreths digit is 9 then we need to round up the tenths digit
-    if(targetHundrethsDigit == 9)
-    {
-      // Roll over to 0 if the current 10ths digit is 9
-      if(targetTenthsDigit == 9)
-      {
-        targetTenthsDigit = 0;
-      }
-      else
-      {
-        targetTenthsDigit++;
-      }
-      // Roll over 100ths to 0
-      targetHundrethsDigit = 0;
-    }
-    // All other floating point rounding errors (which are indicated by an odd numbered 100ths digit) need to increment hundredths by one
-    else if(targetHundrethsDigit % 2)
-    {
-      targetHundrethsDigit ++;
-    }
+    // targetWeight is held in centigrains, so its digits are exact
+    int targetHundrethsDigit = targetWeight % 10;
+    int targetTenthsDigit = (targetWeight / 10) % 10;
 
     if(btnIncrements >= 15 && targetTenthsDigit == 0)
     {
-      changeTarget(-1);
-      IdleScreen(targetWeight, errorMargin);
+      changeTarget(GRAINS(-1));
+      IdleScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin), powderSlot + 1);
       Serial.print("Decrementing target by 1gr, targetWeight = ");
-      Serial.println(targetWeight, 6);
+      Serial.println(WeightToGrains(targetWeight), 2);
     }
     else if(btnIncrements >= 5 && targetHundrethsDigit == 0)
     {
-      changeTarget(-0.1);
-      IdleScreen(targetWeight, errorMargin);
+      changeTarget(GRAINS(-0.1));
+      IdleScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin), powderSlot + 1);
       Serial.print("Decrementing target by 0.1gr, targetWeight = ");
-      Serial.println(targetWeight, 6);
+      Serial.println(WeightToGrains(targetWeight), 2);
     }
     else
     {
-      changeTarget(-0.02);
-      IdleScreen(targetWeight, errorMargin);
+      changeTarget(GRAINS(-0.02));
+      IdleScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin), powderSlot + 1);
       Serial.print("Decrementing target by 0.2gr, targetWeight = ");
-      Serial.println(targetWeight, 6);
+      Serial.println(WeightToGrains(targetWeight), 2);
     }
 
     return IDLE_STATE;
   }
-  // No buttons pressed, continue idle state after resetting btnIncrements
-  else
-  {
-    btnIncrements = 0;
-    return IDLE_STATE;
-  }
+}
+
+// enterReady()
+// The first tick updates the display
+static void enterReady()
+{
+  firstReadyUpdate = true;
 }
 
 // ReadyState()
@@ -731,9 +1275,6 @@ int ReadyState()
   if(!isEnabled())
   {
     Serial.println("Enable switch toggled to off in Ready state, returning to Idle state");
-    // Clear flags and return to idle state
-    firstReadyUpdate = true;
-    firstIdleUpdate = true;
     return IDLE_STATE;
   }
 
@@ -741,50 +1282,63 @@ int ReadyState()
   if(firstReadyUpdate)
   {
     Serial.println("Entered Ready state for first time, updating display");
-    ReadyScreen(targetWeight, errorMargin);
+#ifdef BENCHMARK
+    // The benchmark sweep chooses the target weight
+    targetWeight = GrainsToWeight(BenchmarkTarget());
+#endif
+    ReadyScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin));
     firstReadyUpdate = false;
   }
 
   // Measure stable weight from the scale
-  float currentWeight = StableWeight(750);
+  float reading = StableWeight(750, READY_STABILITY);
 
   // Scale response timed out
-  if(currentWeight == -5000)
+  if(reading == -5000)
   {
     Serial.println("Scale response timed out, advancing to ErrorID state");
-    // Clear flags, update error state, and advance to Error ID state
-    firstReadyUpdate = true;
+    // Update error state and advance to Error ID state
     error = 1;
-    return READY_STATE;
+    return ERRORID_STATE;
   }
   // Scale returned characters out of range
-  if(currentWeight == -6000)
+  if(reading == -6000)
   {
     Serial.println("Scale returned out of range weight characters, advancing to ErrorID state");
-    // Clear flags, update error state, and advance to Error ID state
-    firstReadyUpdate = true;
+    // Update error state and advance to Error ID state
     error = 2;
+    return ERRORID_STATE;
+  }
+
+  // Scale did not settle within its latency budget, measure again on the next pass
+  if(!stableEnough())
+  {
     return READY_STATE;
   }
 
   // Check if we should exit to dispense state (either empty cup or a re-trickle operation)
-  if((currentWeight > -0.3) && (currentWeight < (targetWeight + 0.5)))
+  Weight currentWeight = GrainsToWeight(reading);
+  if((currentWeight > GRAINS(-0.3)) && (currentWeight < (targetWeight + GRAINS(0.5))))
   {
     Serial.println("Weight within range of -0.2gr and (targetWeight + 0.5gr), evaluating for advance to dispense state");
-    // Clear flags, re-zero scale, and advance to Dispense state
-    firstReadyUpdate = true;
-    firstIdleUpdate = true;
+    // Re-zero scale and advance to Dispense state
     
     // Verify we don't have static drift with a longer measurement compared against our previous one before re-zeroing to start a dispense operation
-    if((currentWeight > -0.3) && (currentWeight < 0.3))
+    if((currentWeight > GRAINS(-0.3)) && (currentWeight < GRAINS(0.3)))
     {
-      float newWeight = StableWeight(1000);
+      Weight newWeight = StableCentigrains(1000);
       
       // Wait for truly stable weight measurement before proceeding to zero the scale
       while(newWeight != currentWeight)
       {
+        // Give up on this pass if the scale cannot settle, the Ready state will try again
+        if(!stableEnough())
+        {
+          return READY_STATE;
+        }
+
         currentWeight = newWeight;
-        newWeight = StableWeight(1000);
+        newWeight = StableCentigrains(1000);
       }
 
       zeroScale();
@@ -821,18 +1375,27 @@ int DispenseState()
   if(!isEnabled())
   {
     Serial.println("Enable switch toggled to off in Dispense state, returning to Idle state");
-    // Clear flags/variables and return to idle state
-    firstIdleUpdate = true;
-
     return IDLE_STATE;
   }
 
   // Gather the current weight and calculate our weight difference stuff
-  dispenseWeight = StableWeight(LONG);
-  float weightDiff = targetWeight - dispenseWeight;
-  float startingWeightDiff = weightDiff;
+  dispenseWeight = measureCharge(LONG);
+  Weight weightDiff = targetWeight - dispenseWeight;
+  Weight startingWeightDiff = weightDiff;
+  float secondFraction = 0; // Fraction of weightDiff the second bulk pulse is planned for
+
+  // Do not start a charge from a weight the scale could not settle on
+  if(!stableEnough())
+  {
+    Serial.println("Weight did not stabilize before dispensing, returning to Ready state");
+    return READY_STATE;
+  }
 
   startTime = millis();
+  endTime = startTime; // Charges that exit before dispensing report no throw time rather than the previous charge's
+  trickleTimed = false;
+  ResetSettleTime();
+  TimingStart(WeightToGrains(targetWeight));
 
   // First skip straight to evaluate if weightDiff is negative
   if(weightDiff <= 0)
@@ -841,53 +1404,78 @@ int DispenseState()
   }
 
   // If the weightDiff is greater than 250gr, skip straight to evaluate because something is wrong
-  if(weightDiff > 250)
+  if(weightDiff > GRAINS(250))
   {
     return EVALUATE_STATE;
   }
 
   // Do first stage bulk dispense if we need 10+ grains
-  if(weightDiff > 10)
+  if(weightDiff > GRAINS(10))
   {
-    BulkScreen(targetWeight, errorMargin);
+    BulkScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin));
     
-    // Dispense 92% of the required amount and wait for bulk to finish while monitoring enable button
-    if(!bulkThrow(weightDiff * 0.92))
+    // Dispense 92% of the required amount and wait for bulk to finish while monitoring enable button, trickling part of the remaining 8% alongside it
+    // In closed loop mode the pulse is cut off from the streaming weight, close enough to the target to leave only a trickle
+    // The planner's residual and allowance come from its floating point statistics, and are converted to centigrains once for the pulse
+    Weight firstBulk = BULK_CLOSED_LOOP ? (weightDiff - GrainsToWeight(firstBulkResidual())) : ((23 * weightDiff) / 25);
+    Weight cutoffWeight = BULK_CLOSED_LOOP ? (dispenseWeight + firstBulk) : 0;
+    // The closed loop pulse can overthrow by its measured cutoff error, a fixed fraction of the pulse would leave no room for the kernels the planner reserved
+    // Kernels pipelined behind a large first pulse are still landing as the scale settles, on a noisy scale that costs more time than they save
+    Weight firstAllowance = GrainsToWeight(BULK_CLOSED_LOOP ? firstBulkAllowance() : (PIPELINE_BULK_ERROR * WeightToGrains(firstBulk)));
+    int pipelined = (ScaleNoise() < PIPELINE_MAX_NOISE) ? pipelineKernels(weightDiff - firstBulk, firstAllowance) : 0;
+    if(!bulkThrow(firstBulk, false, pipelined, cutoffWeight))
     {
       Serial.println("Enable toggled off during first bulk pulse, exiting to idle");
-      firstIdleUpdate = true;
 
       return IDLE_STATE;
     }
     endTime = millis();
 
-    // Collect weight again to evaluate next steps
-    dispenseWeight = StableWeight(SHORT);
+    // Collect weight again to evaluate next steps, a confident prediction is enough if a second bulk pulse is clearly needed
+    if(!predictSettledWeight(endTime, dispenseWeight + (weightDiff / 2), GRAINS(PREDICT_MIN_REMAINING_BULK), &dispenseWeight))
+    {
+      Serial.println("Enable toggled off while waiting for first bulk pulse to settle, exiting to idle");
+
+      return IDLE_STATE;
+    }
     weightDiff = targetWeight - dispenseWeight;
-    float dispenseTotal = startingWeightDiff - weightDiff;
+
+    // Scale could not settle within its latency budget, let the Evaluate state measure the charge
+    if(!stableEnough())
+    {
+      Serial.println("Weight did not stabilize during dispense, exiting to evaluate");
+      return EVALUATE_STATE;
+    }
+
+    // Calibrate the bulk on what it left by itself, without the pipelined kernels
+    Weight bulkDiff = weightDiff + KernelsToWeight(pipelined, GetKernelWeightFixed());
+    Weight dispenseTotal = startingWeightDiff - bulkDiff;
+    learnBulkLatency(targetWeight - bulkDiff);
 
     // Less than 1gr was dispensed, skip straight to eval state
-    if(dispenseTotal < 1)
+    if(dispenseTotal < GRAINS(1))
     {
       return EVALUATE_STATE;
     }
 
-    // Getting too close to target case, small calibration adjustment
-    else if(weightDiff < (0.02 * targetWeight))
+    // Refine grainsPerRev from the steps the pulse turned and the weight it dropped
+    ObserveBulk(bulkThrowSteps, WeightToGrains(dispenseTotal));
+
+    // The planner sizes the next closed loop pulses from how far this one settled from its cutoff
+    if(BULK_CLOSED_LOOP)
     {
-      Serial.println("First bulk pulse too close to target, making slight calibration adjustment");
-      smallIncreaseBulkCalibration();
+      observeFirstBulk(WeightToGrains((targetWeight - bulkDiff) - cutoffWeight));
     }
-    // Overthrow case, adjust calibration
-    else if(weightDiff < (-1.2 * errorMargin))
+
+    // Overthrow case
+    if(overthrown(weightDiff))
     {
       Serial.println("First bulk pulse overthrow, exiting to evaluate");
-      increaseBulkCalibration();
       
       return EVALUATE_STATE;
     }
     // Perfect throw case
-    else if(weightDiff < 0.01)
+    else if(weightDiff < GRAINS(0.01))
     {
       // Go to evaluate state
       Serial.println("1st bulk pulse hit exact targetWeight, exiting to evaluate");
@@ -895,217 +1483,171 @@ int DispenseState()
       return EVALUATE_STATE;
     }
     // Advance to trickle if our weightDiff <= 1, but get a second short weight measurement first
-    else if(weightDiff <= 1)
+    else if(weightDiff <= GRAINS(1))
     {
       Serial.println("Good 1st bulk, take short weight measurement and advance to trickle");
-      dispenseWeight = StableWeight(SHORT);
+      dispenseWeight = measureCharge(SHORT);
       weightDiff = targetWeight - dispenseWeight;
+
+      // Scale could not settle within its latency budget, let the Evaluate state measure the charge
+      if(!stableEnough())
+      {
+        Serial.println("Weight did not stabilize during dispense, exiting to evaluate");
+        return EVALUATE_STATE;
+      }
     }
-    // Underthrow, need a second bulk pulse (second bulk will activate for quantities larger than 1.75gr)
-    else if(weightDiff > 1.75)
+    // Underthrow, need a second bulk pulse (the planner decides whether it is quicker than trickling, until it has measured enough pulses it activates for quantities larger than 1.75gr)
+    else if((secondFraction = secondBulkFraction(SECOND_PULSE_TOP_UP, WeightToGrains(weightDiff), 1.75)) > 0)
     {
       // Handle extreme underthrow case (return to ready state or go to error state in this instance)
-      if(weightDiff > targetWeight * 0.5)
+      if(weightDiff > (targetWeight / 2))
       {
         Serial.println("Extreme underthrow error during first bulk pulse");
 
         return READY_STATE;
       }
-      // Adjust calibration for large underthrow (15% or more)
-      if(weightDiff > targetWeight * 0.15)
-      {
-        Serial.println("Large first bulk underthrow, decreasing calibration value");
-        decreaseBulkCalibration();
-      }
-      // Adjust calibration for smaller underthrow (10% or more)
-      else if(weightDiff > targetWeight * 0.1)
-      {
-        Serial.println("Small first bulk underthrow, slightly decreasing calibration value");
-        smallDecreaseBulkCalibration();
-      }
 
-      // Dispense a portion of the required amount and wait for bulk to finish while monitoring enable button
-      if(!bulkThrow(weightDiff * secondBulkCalibration))
+      int next = secondBulkPulse(SECOND_PULSE_TOP_UP, secondFraction, startingWeightDiff, &weightDiff);
+      if(next != DISPENSE_STATE)
       {
-        Serial.println("Enable toggled off during second bulk pulse, exiting to idle");
-        firstIdleUpdate = true;
-
-        return IDLE_STATE;
+        return next;
       }
-      endTime = millis();
-
-      dispenseWeight = StableWeight(SHORT);
-      weightDiff = targetWeight - dispenseWeight;
+    }
+  }
+  // Start with a second stage bulk dispense if we have < 15 kernels but > 2 kernels left to dispense (or once it has measured enough pulses, if the planner expects it to be quicker than trickling)
+  else if((secondFraction = secondBulkFraction(SECOND_PULSE_ONLY, WeightToGrains(weightDiff), 2)) > 0)
+  {
+    int next = secondBulkPulse(SECOND_PULSE_ONLY, secondFraction, startingWeightDiff, &weightDiff);
+    if(next != DISPENSE_STATE)
+    {
+      return next;
+    }
+  }
+  // Update the screen to indicate we are moving on to the trickle
+  TrickleScreen(WeightToGrains(targetWeight), WeightToGrains(errorMargin));
 
-      // Take a long measurement if the weightDiff is small
-      if(weightDiff < 0.2 && weightDiff > -0.1)
-      {
-        dispenseWeight = StableWeight(LONG);
-        weightDiff = targetWeight - dispenseWeight;
-      }
+  // Time the trickle, the bulk planner weighs the trickle time a bulk pulse saves against the time the pulse takes
+  trickleStart = millis();
+  trickleStartWeight = dispenseWeight;
+  trickleTimed = true;
 
-      // Overthrow case
-      if(weightDiff < (-1.2 * errorMargin))
-      {
-        Serial.println("Second bulk pulse overthrow, exiting to evaluate");
-        secondBulkCalibration = secondBulkCalibration - 0.02;
-        Serial.print("secondBulkCalibration reduced by 0.02, new value = ");
-        Serial.println(secondBulkCalibration);
-      
-        return EVALUATE_STATE;
-      }
-      // Perfect throw case
-      else if(weightDiff < 0.01)
+  // Now do a final trickle, on first entry we already have a current weight and weightDiff from above sections of code
+  bool burstOnly = false; // Set when a continuous trickle stops without dropping anything, the remainder is then trickled in bursts
+  while(isEnabled())
+  {
+    // Do not allow it to trickle more than 5gr of powder
+    if(weightDiff > GRAINS(5))
+    {
+      return DISPENSE_STATE;
+    }
+    
+    // If weightDiff is one kernel or less, re-measure the weight just in case
+    if((5 * weightDiff) < (6 * errorMargin))
+    {
+      dispenseWeight = measureCharge(LONG);
+      weightDiff = targetWeight - dispenseWeight;
+
+      // Scale could not settle within its latency budget, let the Evaluate state measure the charge
+      if(!stableEnough())
       {
-        // Go to evaluate state after adjusting calibration
-        Serial.println("2nd bulk pulse hit exact targetWeight, exiting to evaluate");
-        secondBulkCalibration = secondBulkCalibration - 0.005;
-        Serial.print("secondBulkCalibration reduced by 0.005, new value = ");
-        Serial.println(secondBulkCalibration);
+        Serial.println("Weight did not stabilize during dispense, exiting to evaluate");
+        return EVALUATE_STATE;
+      }
 
+      // If target weight has been reached, go directly to Evaluate state
+      if(weightDiff <= GRAINS(0.01))
+      {
         return EVALUATE_STATE;
       }
-      // Fine tune calibration on close calls to avoid overthrows
-      else if(weightDiff < 0.15)
+    }
+
+    // Trickle large remainders continuously rather than in repeated stop, settle and restart bursts
+    if(CONTINUOUS_TRICKLE && !burstOnly && weightDiff >= GRAINS(CONTINUOUS_MIN_REMAINING))
+    {
+      Serial.print("Continuous trickling with weight difference of ");
+      Serial.println(WeightToGrains(weightDiff), 2);
+
+      TimingPhase(TIMING_TRICKLE);
+      Weight startWeight = dispenseWeight;
+      int continuousKernels = continuousTrickle(startWeight);
+      if(continuousKernels < 0)
       {
-        Serial.println("Second bulk pulse too close to target, adjusting calibration");
-        secondBulkCalibration = secondBulkCalibration - 0.005;
-        Serial.print("secondBulkCalibration reduced by 0.005, new value = ");
-        Serial.println(secondBulkCalibration);
+        Serial.println("Continuous trickle in Dispense state failed");
 
-        // Do not exit dispense state in this instance
+        return IDLE_STATE;
       }
-      // Handle extreme underthrow case (relative to starting point, not relative to target weight now that re-trickle was added)
-      else if(weightDiff > startingWeightDiff * 0.5)
+      if(continuousKernels == 0)
       {
-        Serial.println("Extreme underthrow error during second bulk pulse");
-        
-        return READY_STATE;
+        Serial.println("Continuous trickle stopped before dropping a kernel, trickling the remainder in bursts");
+        burstOnly = true;
+        continue;
       }
-      // Handle normal underthrow second
-      else if (weightDiff > 0.7)
+      endTime = millis();
+
+      // Wait for the kernels still in flight to register
+      if(!predictSettledWeight(millis(), startWeight + ((3 * weightDiff) / 4), GRAINS(PREDICT_MIN_REMAINING), &dispenseWeight, SETTLE_CONTINUOUS))
       {
-        Serial.println("Second bulk pulse underthrow");
-        secondBulkCalibration = secondBulkCalibration + 0.01;
-        Serial.print("secondBulkCalibration increased by 0.01, new value = ");
-        Serial.println(secondBulkCalibration);
+        Serial.println("Enable button toggled to off while waiting for scale to register a change in weight");
 
-        // Do not exit dispense state in this instance
+        return IDLE_STATE;
       }
-    }
-  }
-  // Start with a second stage bulk dispense if we have < 15 kernels but > 2 kernels left to dispense
-  else if(weightDiff > 2)
-  {
-    // Dispense a portion of the required amount and wait for bulk to finish while monitoring enable button
-    if(!bulkThrow(weightDiff * secondBulkCalibration))
-    {
-      Serial.println("Enable toggled off during second bulk pulse, exiting to idle");
-      firstIdleUpdate = true;
-
-      return IDLE_STATE;
-    }
-    endTime = millis();
+      weightDiff = targetWeight - dispenseWeight;
 
-    dispenseWeight = StableWeight(SHORT);
-    weightDiff = targetWeight - dispenseWeight;
+      // Scale could not settle within its latency budget, let the Evaluate state measure the charge
+      if(!stableEnough())
+      {
+        Serial.println("Weight did not stabilize during dispense, exiting to evaluate");
+        return EVALUATE_STATE;
+      }
 
-    // Take a long measurement if the weightDiff is small
-    if(weightDiff < 0.2 && weightDiff > -0.1)
-    {
-      dispenseWeight = StableWeight(LONG);
-      weightDiff = targetWeight - dispenseWeight;
-    }
+      // The continuous trickle directly measures the kernel weight
+      ObserveKernels(continuousKernels, WeightToGrains(dispenseWeight - startWeight));
 
-    // Overthrow case
-    if(weightDiff < (-1.2 * errorMargin))
-    {
-      Serial.println("Second bulk pulse overthrow, exiting to evaluate");
-      secondBulkCalibration = secondBulkCalibration - 0.02;
-      Serial.print("secondBulkCalibration reduced by 0.02, new value = ");
-      Serial.println(secondBulkCalibration);
-      
-      return EVALUATE_STATE;
-    }
-    // Perfect throw case
-    else if(weightDiff < 0.01)
-    {
-      // Go to evaluate state after adjusting calibration
-      Serial.println("2nd bulk pulse hit exact targetWeight, exiting to evaluate");
-      secondBulkCalibration = secondBulkCalibration - 0.005;
-      Serial.print("secondBulkCalibration reduced by 0.005, new value = ");
-      Serial.println(secondBulkCalibration);
+      // Overthrow case
+      if(overthrown(weightDiff))
+      {
+        Serial.println("Continuous trickle overthrow, exiting to evaluate");
 
-      return EVALUATE_STATE;
-    }
-    // Fine tune calibration on close calls to avoid overthrows
-    else if(weightDiff < 0.15)
-    {
-      Serial.println("Second bulk pulse too close to target, adjusting calibration");
-      secondBulkCalibration = secondBulkCalibration - 0.005;
-      Serial.print("secondBulkCalibration reduced by 0.005, new value = ");
-      Serial.println(secondBulkCalibration);
+        return EVALUATE_STATE;
+      }
+      // Target reached (or within the error margin)
+      else if(weightDiff < GRAINS(0.01))
+      {
+        Serial.println("Continuous trickle reached targetWeight, exiting to evaluate");
 
-      // Do not exit dispense state in this instance
-    }
-    // Handle extreme underthrow case (relative to starting point, not relative to target weight now that re-trickle was added)
-    else if(weightDiff > startingWeightDiff * 0.5)
-    {
-      Serial.println("Extreme underthrow error during second bulk pulse");
-        
-      return READY_STATE;
-    }
-    // Handle normal underthrow second
-    else if (weightDiff > 0.7)
-    {
-      Serial.println("Second bulk pulse underthrow");
-      secondBulkCalibration = secondBulkCalibration + 0.01;
-      Serial.print("secondBulkCalibration increased by 0.01, new value = ");
-      Serial.println(secondBulkCalibration);
+        return EVALUATE_STATE;
+      }
 
-      // Do not exit dispense state in this instance
+      // Underthrow, the remainder is finished by another pass through the trickle loop
+      Serial.println("Continuous trickle did not reach targetWeight, restarting the trickle");
+      continue;
     }
-  }
-  // Update the screen to indicate we are moving on to the trickle
-  TrickleScreen(targetWeight, errorMargin);
 
-  // Now do a final trickle, on first entry we already have a current weight and weightDiff from above sections of code
-  while(isEnabled())
-  {
-    // Do not allow it to trickle more than 5gr of powder
-    if(weightDiff > 5)
+    // Calculate kernels, from the learned slot spread once there is one
+    bool planned = TRICKLE_PLANNER && SlotSpreadReady();
+    int kernels;
+    if(planned)
     {
-      return DISPENSE_STATE;
+      kernels = plannedTrickleKernels(weightDiff);
     }
-    
-    // If weightDiff is one kernel or less, re-measure the weight just in case
-    if(weightDiff < (1.2 * errorMargin))
+    else
     {
-      dispenseWeight = StableWeight(LONG);
-      weightDiff = targetWeight - dispenseWeight;
+      // The remainder is kept in the fixed point of the kernelWeight, and compared with 0.6 error margins as a ratio of integers
+      long kernelWeight = GetKernelWeightFixed();
+      kernels = (weightDiff << KERNEL_WEIGHT_BITS) / kernelWeight;
+      long remainder = (weightDiff << KERNEL_WEIGHT_BITS) - (kernels * kernelWeight);
 
-      // If target weight has been reached, go directly to Evaluate state
-      if(weightDiff <= 0.01)
+      Serial.print("Predicted remainder after dispening kernels = ");
+      Serial.println(WeightToGrains(remainder) / (1L << KERNEL_WEIGHT_BITS), 6);
+
+      // Check the remainder to see if we need to add an extra kernel
+      if((5 * remainder) >= ((3 * errorMargin) << KERNEL_WEIGHT_BITS))
       {
-        return EVALUATE_STATE;
+        Serial.print("Adding kernel because remainder = ");
+        Serial.println(WeightToGrains(remainder) / (1L << KERNEL_WEIGHT_BITS), 6);
+        kernels = kernels + 1;
       }
     }
-
-    // Calculate kernels
-    float kernelWeight = GetKernelWeight();
-    int kernels = weightDiff / kernelWeight;
-    float remainder = ((weightDiff / kernelWeight) - kernels) * kernelWeight;
-
-    Serial.print("Predicted remainder after dispening kernels = ");
-    Serial.println(remainder, 6);
-
-    // Check the remainder to see if we need to add an extra kernel
-    if(remainder >= (0.60 * errorMargin))
-    {
-      Serial.print("Adding kernel because remainder = ");
-      Serial.println(remainder, 6);
-      kernels = kernels + 1;
-    }
     
     // Handle single kernel dispense cases (positive weightDiff and calculated kernels <= 1)
     if((weightDiff > 0) && (kernels <= 1))
@@ -1114,6 +1656,7 @@ int DispenseState()
       kernels = 1;
 
       // Dispense the one kernel
+      TimingPhase(TIMING_TRICKLE);
       TrickleDispense(1);
 
       endTime = millis();
@@ -1122,12 +1665,12 @@ int DispenseState()
       return EVALUATE_STATE;
     }
 
-    // Adjust kernel target for longer trickles
-    if(weightDiff > 0.8)
+    // Adjust kernel target for longer trickles, a planned burst already allows for its spread
+    if(!planned && (weightDiff > GRAINS(0.8)))
     {
       kernels = kernels - 4;
     }
-    else if(weightDiff > 0.4)
+    else if(!planned && (weightDiff > GRAINS(0.4)))
     {
       kernels = kernels - 1;
     }
@@ -1135,65 +1678,46 @@ int DispenseState()
     Serial.print("Fine trickling '");
     Serial.print(kernels);
     Serial.print("' kernels, with weight difference of ");
-    Serial.println(weightDiff, 6);
+    Serial.println(WeightToGrains(weightDiff), 2);
 
     // Dispense appropriate number of kernels
+    Weight burstStartWeight = dispenseWeight;
+    TimingPhase(TIMING_TRICKLE);
     TrickleDispense(kernels);
 
     if(!waitForTrickle())
     {
       Serial.println("Trickle in Dispense state failed");
-      firstIdleUpdate = true;
 
       return IDLE_STATE;
     }
     endTime = millis();
 
-    // Calculate the settling delay based on the time spent trickling and the maximum delay time
-    // We can drop ~20 kernels per second (18.7 revs/minute and 64 kernels/rev)
-    // LONG is the duration of our stable measurement window in ms
-    int delayStart = millis();
-
-    // Loop for a max duration of settlingDelayMs looking for a change in the scale weight, polling every 50ms
-    // Can only exit early if we disable dispensing or see the weight increase by at least 75% of the weightDiff to target
-    while(StableWeight(50) <= (dispenseWeight + (0.75 * weightDiff)))
+    // Wait for the scale to register the trickled kernels, for as long as the previous bursts took to settle (at most MAX_DELAY)
+    // A confident prediction of the settled weight that is still well short of the target starts the next trickle straight away
+    // Can only exit early if we disable dispensing or see the predicted weight increase by at least 75% of the weightDiff to target
+    if(!predictSettledWeight(millis(), dispenseWeight + ((3 * weightDiff) / 4), GRAINS(PREDICT_MIN_REMAINING), &dispenseWeight, SETTLE_BURST))
     {
-      // Return to idle if no longer enabled
-      if(!isEnabled())
-      {
-        Serial.println("Enable button toggled to off while waiting for scale to register a change in weight");
-        firstIdleUpdate = true;
+      Serial.println("Enable button toggled to off while waiting for scale to register a change in weight");
 
-        return IDLE_STATE;
-      }
+      return IDLE_STATE;
+    }
+    weightDiff = targetWeight - dispenseWeight;
 
-      // Check if we have reached settlingDelayMs and break from the polling loop if so
-      int curTime = millis();
-      if((curTime - delayStart) > MAX_DELAY)
-      {
-        break;
-      }
+    // Scale could not settle within its latency budget, let the Evaluate state measure the charge
+    if(!stableEnough())
+    {
+      Serial.println("Weight did not stabilize during dispense, exiting to evaluate");
+      return EVALUATE_STATE;
     }
-    // Weight has changed from the last time dispenseWeight was measured or it has timed out waiting for it to change
 
-    // Get new dispenseWeight and weightDiff
-    dispenseWeight = StableWeight(LONG);
-    weightDiff = targetWeight - dispenseWeight;
+    // Refine kernelWeight from the kernels dropped and the weight they added
+    ObserveKernels(kernels, WeightToGrains(dispenseWeight - burstStartWeight));
 
     // Overthrow and perfect throw cases
-    if(weightDiff < (-1.2 * errorMargin))
+    if(overthrown(weightDiff))
     {
-      // Handle case of overthrow only 1 tick past errorMargin (0.02 over) on a long throw
-      if(kernels > 20 && (weightDiff > ((-1.2 * errorMargin) - 0.02)))
-      {
-        Serial.println("Tiny overthrow on a long trickle, exiting to evaluate");
-        smallIncreaseTrickleCalibration();
-
-        return EVALUATE_STATE;
-      }
-      // Increase trickler calibration before going to evaluate
       Serial.println("Trickler overthrow, exiting to evaluate");
-      increaseTrickleCalibration();
 
       return EVALUATE_STATE;
     }
@@ -1201,12 +1725,11 @@ int DispenseState()
     else if(weightDiff < 0)
     {
       Serial.println("Slight overthrow within the error margin, exiting to evaluate");
-      smallIncreaseTrickleCalibration();
 
       return EVALUATE_STATE;
     }
     // Perfect throw case
-    else if(weightDiff < 0.01)
+    else if(weightDiff < GRAINS(0.01))
     {
       // Go to evaluate state
       Serial.println("Trickled to correct targetWeight, exiting to evaluate");
@@ -1217,45 +1740,13 @@ int DispenseState()
     else
     {
       // Handle extreme underthrow
-      if(weightDiff > 2)
+      if(weightDiff > GRAINS(2))
       {
         Serial.println("Extreme underthrow error during trickle");
 
         return READY_STATE;
       }
       Serial.println("Trickle did not reach targetWeight, restarting the trickle");
-
-      // Adjust calibration for underthrow of at least 4 kernels (on long throws we are targeting 3 kernels under the target)
-      if(weightDiff > (3.5 * errorMargin))
-      {
-        // Smaller calibration tweak for those long throws
-        if(kernels > 20)
-        {
-          smallDecreaseTrickleCalibration();
-        }
-        else
-        {
-          decreaseTrickleCalibration();
-        }
-      }
-      // Do a tiny calibration change for underthrow of 2 kernels or more for short throws
-      else if(weightDiff > (1.2 * errorMargin))
-      {
-        if(kernels > 50)
-        {
-          // Do nothing for very large throws
-        }
-        else if(kernels > 20)
-        {
-          // Tiny adjustment for moderately large throws
-          tinyDecreaseTrickleCalibration();
-        }
-        else
-        {
-          // Small adjustment for small throws
-          smallDecreaseTrickleCalibration();
-        }
-      }
     }
   }
   // Return idle because reaching this point means enable button is no longer pressed (we exited the isEnabled() while loop that runs the trickler)
@@ -1265,24 +1756,13 @@ int DispenseState()
 
 int EvaluateState()
 {
-  float weightDiff;
-  float kernelWeight = GetKernelWeight();
+  Weight weightDiff;
+  long kernelWeight = GetKernelWeightFixed();
 
   // Test if we are enabled or not
   if(!isEnabled())
   {
     Serial.println("Enable switch toggled to off in Evaluate state before weight measurements, returning to Idle state");
-    // Reset evaluate and idle flags
-    firstEvaluate = true;
-    evaluateUpdate = false;
-    firstIdleUpdate = true;
-
-    // Reset LEDs before exiting evaluate
-    digitalWrite(GREEN_LED, LOW);
-    digitalWrite(YELLOW_LED, LOW);
-    digitalWrite(RED_LED, LOW);
-
-    // Return to idle state
     return IDLE_STATE;
   }
 
@@ -1293,7 +1773,7 @@ int EvaluateState()
     if(upPressed() && !downPressed())
     {
       // Delay and re-measure for debounce
-      delay(100);
+      WaitMillis(100);
       if(!upPressed() || downPressed())
       {
         // If button state changes go back to top of evaluate
@@ -1306,7 +1786,7 @@ int EvaluateState()
       TrickleDispense(1);
 
       // Wait for half a second to avoid rapid fire kernel dispenses
-      delay(500);
+      WaitMillis(500);
 
       Serial.println("Kernel dispensed, returning to top of Evaluate state");
       // Return to top of Evaluate state to assess status after kernel was added
@@ -1325,44 +1805,71 @@ int EvaluateState()
     weightDiff = targetWeight - evaluateWeight;
 
     elapsedTime = endTime - startTime;
+    learnTrickleRate(evaluateWeight);
 
     Serial.print("----- Entered Evaluate state after ");
     Serial.print(elapsedTime);
     Serial.print("ms, evaluateWeight = ");
-    Serial.print(evaluateWeight, 6);
+    Serial.print(WeightToGrains(evaluateWeight), 2);
     Serial.print("gr and weightDiff = ");
-    Serial.print(weightDiff, 6);
+    Serial.print(WeightToGrains(weightDiff), 2);
     Serial.println(" -----");
+
+    Serial.print("Settle time = ");
+    Serial.print(GetSettleTime());
+    Serial.print("ms across ");
+    Serial.print(GetSettleCount());
+    Serial.println(" stable weight measurements");
+
+    PrintScaleStats();
+    TimingEnd();
+
+#ifdef SIMULATE_POWDER
+    SimChargeComplete();
+#endif
+
+#ifdef BENCHMARK
+    BenchmarkCharge(WeightToGrains(evaluateWeight), WeightToGrains(targetWeight), elapsedTime, secondBulkCalibration, GetKernelWeight());
+#endif
+
+    // Snapshot what has been adapted every few charges, the store writes it out while charges wait on the scale
+    snapshotCharges++;
+    if(snapshotCharges >= PROFILE_SNAPSHOT_CHARGES)
+    {
+      saveProfile();
+      snapshotCharges = 0;
+    }
   }
   // Repeat loops in Evaluate state
   else
   {
     // Take new weight reading
-    float tmpWeight = StableWeight(LONG);
+    Weight tmpWeight = StableCentigrains(LONG, EVALUATE_STABILITY);
 
     // Case 1, weight has changed
     // Test if new weight reading is different from the existing one
     if(tmpWeight != evaluateWeight)
     {
+      // Weights the scale could settle on are verified with a second measurement, which may also be the first to see the shot glass removed
+      Weight confirmWeight = tmpWeight;
+      bool confirmed = false;
+      if(tmpWeight <= GRAINS(500) && tmpWeight >= GRAINS(-200) && stableEnough())
+      {
+        confirmWeight = StableCentigrains(LONG, EVALUATE_STABILITY);
+        confirmed = (confirmWeight == tmpWeight) && stableEnough();
+      }
+
       // Case 1.1 - tmpWeight indicates user has removed the shot glass
       // Verify weight is less than -200 or greater than 500 (overflow error), since shot glass will weigh at least that much
-      if(tmpWeight > 500 || tmpWeight < -200)
+      if(tmpWeight > GRAINS(500) || tmpWeight < GRAINS(-200) || confirmWeight > GRAINS(500) || confirmWeight < GRAINS(-200))
       {
-        // Reset the evaluation flags
-        firstEvaluate = true;
-        evaluateUpdate = false;
-
-        // Reset LEDs before exiting evaluate
-        digitalWrite(GREEN_LED, LOW);
-        digitalWrite(YELLOW_LED, LOW);
-        digitalWrite(RED_LED, LOW);
-
         // Return to Ready state
         return READY_STATE;
       }
       // Case 1.2 - Weight has changed without user removing the shot glass
       // Verify this changed weight with a second measurement
-      else if(StableWeight(LONG) == tmpWeight)
+      // Weights the scale could not settle on are not used to update the evaluation
+      else if(confirmed)
       {
         evaluateUpdate = false;
 
@@ -1371,9 +1878,9 @@ int EvaluateState()
 
         // Report this weight change to serial comms
         Serial.print("Weight changed during Evaluate state, new weight = ");
-        Serial.print(evaluateWeight, 6);
+        Serial.print(WeightToGrains(evaluateWeight), 2);
         Serial.print("gr and weightDiff = ");
-        Serial.println(weightDiff, 6);
+        Serial.println(WeightToGrains(weightDiff), 2);
       }
       // Case 1.3 - Weight change cannot be confirmed
       else
@@ -1389,212 +1896,1078 @@ int EvaluateState()
       return EVALUATE_STATE;
     }
   }
-  // End of the update to evaluateWeight and weightDiff
+  // End of the update to evaluateWeight and weightDiff
+
+  // Make sure that we are still enabled after the weight measurements complete
+  if(!isEnabled())
+  {
+    Serial.println("Enable switch toggled to off in Evaluate state after weight measurements, returning to Idle state");
+    return IDLE_STATE;
+  }
+
+  // Determine evaluation display update based on weightDiff
+  // Case 1 - overthrow
+  if(overthrown(weightDiff))
+  {
+    // Change the display
+    Serial.println("Overthrow detected in Evaluate State");
+    OverthrowScreen(WeightToGrains(targetWeight), WeightToGrains(evaluateWeight), elapsedTime, WeightToGrains(errorMargin));
+
+    // Illuminate the Red LED after turning the others off
+    digitalWrite(YELLOW_LED, LOW);
+    digitalWrite(GREEN_LED, LOW);
+    digitalWrite(RED_LED, HIGH);
+  }
+  // Case 2 - correct weight (0.02 under is acceptable as a good throw)
+  else if(weightDiff <= GRAINS(0.02))
+  {
+    // Change the display
+    Serial.println("Acceptable charge detected in Evaluate State");
+    GoodChargeScreen(WeightToGrains(targetWeight), WeightToGrains(evaluateWeight), elapsedTime, WeightToGrains(errorMargin));
+
+    // Illuminate the Green LED after turning the others off
+    digitalWrite(YELLOW_LED, LOW);
+    digitalWrite(RED_LED, LOW);
+    digitalWrite(GREEN_LED, HIGH);
+  }
+  // Case 3 - underthrow
+  else
+  {
+    // Handle extreme underthrow (this should never happen)
+    if(weightDiff > GRAINS(1))
+    {
+      // Reset LEDs before exiting evaluate (yellow plus red for extreme underthrow)
+      LowChargeScreen(WeightToGrains(targetWeight), WeightToGrains(evaluateWeight), elapsedTime, WeightToGrains(errorMargin));
+      digitalWrite(GREEN_LED, LOW);
+      digitalWrite(YELLOW_LED, HIGH);
+      digitalWrite(RED_LED, HIGH);
+
+      // Set evaluateUpdate flag
+      evaluateUpdate = true;
+
+      Serial.println("Extreme underthrow error during evaluate");
+      return EVALUATE_STATE;
+    }
+    // Underthrow by more than 0.02gr (which tests as a good throw above), but no more than 1.2 calibrated kernel weights (compared in fixed point)
+    else if((5 * (weightDiff << KERNEL_WEIGHT_BITS)) <= (6 * kernelWeight))
+    {
+      // Reset LEDS before exiting evaluate (both green and yellow illuminated for this case)
+      StaleChargeScreen(WeightToGrains(targetWeight), WeightToGrains(evaluateWeight), elapsedTime, WeightToGrains(errorMargin));
+      digitalWrite(GREEN_LED, HIGH);
+      digitalWrite(YELLOW_LED, HIGH);
+      digitalWrite(RED_LED, LOW);
+
+      // Set evaluateUpdate flag
+      evaluateUpdate = true;
+
+      Serial.println("Sub-kernel underthrow detected in Evaluate state, changing to light to indicate caution but remaining in Evaluate state");
+      return EVALUATE_STATE;
+    }
+    else
+    {
+      // Reset LEDs before exiting evaluate (yellow only for true underthrow)
+      LowChargeScreen(WeightToGrains(targetWeight), WeightToGrains(evaluateWeight), elapsedTime, WeightToGrains(errorMargin));
+      digitalWrite(GREEN_LED, LOW);
+      digitalWrite(YELLOW_LED, HIGH);
+      digitalWrite(RED_LED, LOW);
+
+      // Set evaluateUpdate flag
+      evaluateUpdate = true;
+
+      Serial.println("Underthrow detected in Evaluate state, changing to light to indicate caution but remaining in Evaluate state");
+      return EVALUATE_STATE;
+    }
+  }
+
+  // Set evaluate flags to false since it's not our first evaluation and any updates have been completed
+  firstEvaluate = false;
+  evaluateUpdate = false;
+
+  // Return to top of Evaluate state
+  return EVALUATE_STATE;
+}
+
+// enterEvaluate()
+// The first tick evaluates the weight the charge was dispensed to
+static void enterEvaluate()
+{
+  firstEvaluate = true;
+  evaluateUpdate = false;
+}
+
+// exitEvaluate()
+// Clears the LEDs showing the result of the charge
+static void exitEvaluate()
+{
+  digitalWrite(GREEN_LED, LOW);
+  digitalWrite(YELLOW_LED, LOW);
+  digitalWrite(RED_LED, LOW);
+}
+
+// ErrorIdState()
+// Decides whether the error that was set before entering this state can be recovered from
+//
+// Entered from:
+// - Ready state (when the scale times out or returns out of range characters)
+// - Any state (when it returns a state the state table does not allow it to exit to)
+// Exits to:
+// - Recoverable Error state (when the scale timed out)
+// - Unrecoverable Error state (for any other error)
+int ErrorIdState()
+{
+  Serial.print("Identifying error ");
+  Serial.println(error);
+
+  if(error == 1)
+  {
+    return RECOVERABLE_STATE;
+  }
+
+  return UNRECOVERABLE_STATE;
+}
+
+// enterRecoverable()
+// Stops the motors and shows the error until the user acknowledges it
+static void enterRecoverable()
+{
+  StopMotors();
+
+  Serial.println("Recoverable error, waiting for the enable toggle to be switched off");
+  ErrorScreen(error, true);
+  digitalWrite(GREEN_LED, LOW);
+  digitalWrite(YELLOW_LED, LOW);
+  digitalWrite(RED_LED, HIGH);
+}
+
+// RecoverableErrorState()
+// Waits for the user to switch the enable toggle off
+//
+// Entered from:
+// - Error ID state (when the error can be recovered from)
+// Exits to:
+// - Idle state (when the enable toggle has been switched off)
+int RecoverableErrorState()
+{
+  if(isEnabled())
+  {
+    return RECOVERABLE_STATE;
+  }
+
+  Serial.println("Enable switch toggled to off in Recoverable Error state, returning to Idle state");
+  return IDLE_STATE;
+}
+
+// exitRecoverable()
+// The error has been acknowledged
+static void exitRecoverable()
+{
+  error = 0;
+  digitalWrite(RED_LED, LOW);
+}
+
+// enterUnrecoverable()
+// Stops the motors and shows the error
+static void enterUnrecoverable()
+{
+  StopMotors();
+
+  Serial.println("Unrecoverable error, power cycle the trickler once the cause has been fixed");
+  ErrorScreen(error, false);
+  digitalWrite(GREEN_LED, LOW);
+  digitalWrite(YELLOW_LED, LOW);
+  digitalWrite(RED_LED, HIGH);
+}
+
+// UnrecoverableErrorState()
+// Nothing leaves this state, the trickler has to be power cycled
+//
+// Entered from:
+// - Error ID state (when the error cannot be recovered from)
+int UnrecoverableErrorState()
+{
+  return UNRECOVERABLE_STATE;
+}
+
+// changeTarget(Weight weightDiff)
+void changeTarget(Weight weightDiff)
+{
+  targetWeight = targetWeight + weightDiff;
+
+  // The store waits for the buttons to stop before writing, so a burst of presses is written once
+  saveSettings();
+}
+
+// isEnabled()
+// Returns whether or not the enable toggle is currently pressed
+bool isEnabled()
+{
+  // A switch off caught by the interrupt holds until the state machine is back at rest, even if the switch was flicked back on
+  if(EmergencyStopped())
+  {
+    return false;
+  }
+
+  if(digitalRead(ENABLE_BTN))
+  {
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+bool upPressed()
+{
+  if(!digitalRead(UP_BTN))
+  {
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+bool downPressed()
+{
+  if(!digitalRead(DOWN_BTN))
+  {
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+// stableEnough()
+// Returns whether the last StableWeight() result can be acted on
+// Results returned when the latency budget expired are only used if enough of the recent samples agreed with them
+bool stableEnough()
+{
+  return (StableStatus() == STABLE_OK) || (StableConfidence() >= MIN_UNSTABLE_CONFIDENCE);
+}
+
+// calibrationWeight()
+// Weighs for the calibration, weighing again up to CALIBRATION_WEIGH_ATTEMPTS times in all if the scale errors, reads below CALIBRATION_MIN_WEIGHT or the weight is not stable enough
+// Returns false if no attempt gave a weight the calibration can use, or the enable switch was turned off
+bool calibrationWeight(int durationMillis, byte mode, float* weight)
+{
+  for(byte attempt = 0; attempt < CALIBRATION_WEIGH_ATTEMPTS; attempt++)
+  {
+    *weight = StableWeight(durationMillis, mode);
+    if(*weight >= CALIBRATION_MIN_WEIGHT && stableEnough())
+    {
+      return true;
+    }
+
+    if(!isEnabled())
+    {
+      return false;
+    }
+
+    Serial.print("Calibration weight '");
+    Serial.print(*weight, 6);
+    Serial.println("' is not usable, weighing again");
+  }
+
+  return false;
+}
+
+// overthrown()
+// Returns true if weightDiff is past the target by more than 1.2 error margins, compared exactly in whole centigrains
+bool overthrown(Weight weightDiff)
+{
+  return (5 * weightDiff) < (-6 * errorMargin);
+}
+
+// secondBulkPulse()
+// Throws a second bulk pulse of the given kind for secondFraction of weightDiff, weighs it and adjusts secondBulkCalibration (for pulses the planner did not size) by where it landed
+// weightDiff is updated to what is left after the pulse, startingWeightDiff is what the charge started from
+// Returns the state to move to, or DISPENSE_STATE to carry on to the trickle
+int secondBulkPulse(byte kind, float secondFraction, Weight startingWeightDiff, Weight* weightDiff)
+{
+  // Dispense a portion of the required amount and wait for bulk to finish while monitoring enable button, trickling part of the rest alongside it
+  Weight secondBulk = *weightDiff * secondFraction;
+  Weight secondStartDiff = *weightDiff;
+  unsigned long secondStart = millis();
+  int pipelined = pipelineKernels(secondStartDiff - secondBulk, GrainsToWeight(secondBulkAllowance(kind, WeightToGrains(secondBulk))));
+  if(!bulkThrow(secondBulk, false, pipelined))
+  {
+    Serial.println("Enable toggled off during second bulk pulse, exiting to idle");
+
+    return IDLE_STATE;
+  }
+  endTime = millis();
+
+  dispenseWeight = measureCharge(SHORT);
+  *weightDiff = targetWeight - dispenseWeight;
+
+  // Scale could not settle within its latency budget, let the Evaluate state measure the charge
+  if(!stableEnough())
+  {
+    Serial.println("Weight did not stabilize during dispense, exiting to evaluate");
+    return EVALUATE_STATE;
+  }
+
+  // Take a long measurement if the weightDiff is small
+  if(*weightDiff < GRAINS(0.2) && *weightDiff > GRAINS(-0.1))
+  {
+    dispenseWeight = measureCharge(LONG);
+    *weightDiff = targetWeight - dispenseWeight;
+
+    // Scale could not settle within its latency budget, let the Evaluate state measure the charge
+    if(!stableEnough())
+    {
+      Serial.println("Weight did not stabilize during dispense, exiting to evaluate");
+      return EVALUATE_STATE;
+    }
+  }
+
+  // Calibrate the bulk on what it left by itself, without the pipelined kernels
+  Weight bulkDiff = *weightDiff + KernelsToWeight(pipelined, GetKernelWeightFixed());
+
+  // secondBulkCalibration is only adjusted for pulses it sized, the planner sizes them from its own statistics once it has measured enough
+  bool planned = secondBulkPlanned(kind);
+  observeSecondBulk(kind, WeightToGrains(secondBulk), WeightToGrains(secondStartDiff - bulkDiff), millis() - secondStart);
+
+  // Overthrow case, adjust calibration if the bulk pulse overthrew by itself
+  if(overthrown(*weightDiff))
+  {
+    Serial.println("Second bulk pulse overthrow, exiting to evaluate");
+    if(!planned && overthrown(bulkDiff))
+    {
+      secondBulkCalibration = secondBulkCalibration - 0.02;
+      Serial.print("secondBulkCalibration reduced by 0.02, new value = ");
+      Serial.println(secondBulkCalibration);
+    }
+
+    return EVALUATE_STATE;
+  }
+  // Perfect throw case
+  else if(*weightDiff < GRAINS(0.01))
+  {
+    // Go to evaluate state after adjusting calibration
+    Serial.println("2nd bulk pulse hit exact targetWeight, exiting to evaluate");
+    if(!planned && bulkDiff < GRAINS(0.15))
+    {
+      secondBulkCalibration = secondBulkCalibration - 0.005;
+      Serial.print("secondBulkCalibration reduced by 0.005, new value = ");
+      Serial.println(secondBulkCalibration);
+    }
+
+    return EVALUATE_STATE;
+  }
+  // Fine tune calibration on close calls to avoid overthrows
+  else if(!planned && bulkDiff < GRAINS(0.15))
+  {
+    Serial.println("Second bulk pulse too close to target, adjusting calibration");
+    secondBulkCalibration = secondBulkCalibration - 0.005;
+    Serial.print("secondBulkCalibration reduced by 0.005, new value = ");
+    Serial.println(secondBulkCalibration);
+  }
+  // Handle extreme underthrow case (relative to starting point, not relative to target weight now that re-trickle was added)
+  else if(*weightDiff > (startingWeightDiff / 2))
+  {
+    Serial.println("Extreme underthrow error during second bulk pulse");
+
+    return READY_STATE;
+  }
+  // Handle normal underthrow second
+  else if(!planned && bulkDiff > GRAINS(0.7))
+  {
+    Serial.println("Second bulk pulse underthrow");
+    secondBulkCalibration = secondBulkCalibration + 0.01;
+    Serial.print("secondBulkCalibration increased by 0.01, new value = ");
+    Serial.println(secondBulkCalibration);
+  }
+
+  return DISPENSE_STATE;
+}
+
+// measureCharge()
+// Measures the charge weight during the Dispense state, timing the wait as the weigh phase of the charge and adding it to the settle time
+Weight measureCharge(int durationMillis)
+{
+  byte previousPhase = TimingPhase(TIMING_WEIGH);
+  unsigned long settleStart = millis();
+  Weight weight = StableCentigrains(durationMillis, DISPENSE_STABILITY);
+  AddSettleTime(millis() - settleStart);
+  TimingPhase(previousPhase);
+
+  return weight;
+}
+
+// predictSettledWeight()
+// Waits up to MAX_DELAY for the settling curve received since the given time to pass minWeight and predict its final weight with PREDICT_CONFIDENCE
+// A confident prediction that leaves more than minRemaining to dispense is stored into weight straight away
+// Otherwise a stable weight is measured and stored, and the prediction error is logged so PREDICT_CONFIDENCE can be tuned
+// After a trickle the waits are shortened to the learned arrival and settle times, which are timed from the readings seen while waiting
+// Returns false if the enable toggle is switched off while waiting
+bool predictSettledWeight(unsigned long since, Weight minWeight, Weight minRemaining, Weight* weight, byte timing)
+{
+  Weight predictedWeight = 0;
+  byte confidence = 0;
+  bool predicted = false;
+
+  // The weight on entry is the weight before a burst, the settle is timed from the latest reading
+  Weight startWeight = *weight;
+  Weight lastWeight = startWeight;
+  unsigned long latestTime;
+  LatestWeight(&lastWeight, &latestTime);
+  unsigned long lastSample = since;
+  unsigned long lastChange = 0; // Time since the trickle ended the reading last changed
+  unsigned long arrival = 0;
+  bool arrived = false;
+  unsigned long arrivalLimit = (timing == SETTLE_BURST) ? settleWait(&arrivalStats) : MAX_DELAY;
+  unsigned long settleLimit = (timing != SETTLE_UNTIMED) ? settleWait(&settleStats) : MAX_DELAY;
+
+  TimingPhase(TIMING_ARRIVAL);
+  while(true)
+  {
+    RunTasks();
+
+    // Return to idle if no longer enabled
+    if(!isEnabled())
+    {
+      TimingPhase(TIMING_OTHER);
+      return false;
+    }
+
+    // Time the arrival and settle from each new reading
+    Weight sample;
+    unsigned long sampleTime;
+    if(LatestWeight(&sample, &sampleTime) && ((long)(sampleTime - lastSample) > 0))
+    {
+      lastSample = sampleTime;
+      if(sample != lastWeight)
+      {
+        lastWeight = sample;
+        lastChange = sampleTime - since;
+      }
+      if((timing == SETTLE_BURST) && !arrived && (labs(sample - startWeight) >= (SETTLE_ARRIVAL_DIVISIONS * CENTIGRAINS_PER_DIVISION)))
+      {
+        arrived = true;
+        arrival = sampleTime - since;
+      }
+    }
+
+    if(PredictWeight(since, &predictedWeight, &confidence) && (predictedWeight > minWeight) && (confidence >= PREDICT_CONFIDENCE))
+    {
+      predicted = true;
+      break;
+    }
+
+    // Nothing has registered well after a burst usually has, it dropped little or nothing
+    if((timing == SETTLE_BURST) && !arrived && ((millis() - since) > arrivalLimit))
+    {
+      break;
+    }
+
+    // Check if we have reached the settle wait (MAX_DELAY until one is learned) and break from the polling loop if so
+    if((millis() - since) > settleLimit)
+    {
+      break;
+    }
+  }
+
+  if(predicted && ((targetWeight - predictedWeight) > minRemaining))
+  {
+    Serial.print("Using predicted settled weight = ");
+    Serial.print(WeightToGrains(predictedWeight), 2);
+    Serial.print(", confidence = ");
+    Serial.print(confidence);
+    Serial.println("%");
+
+    // The burst has arrived but is still settling, only its arrival can be timed
+    if(arrived)
+    {
+      observeSettle(true, arrival, false, 0);
+    }
+
+    *weight = predictedWeight;
+    TimingPhase(TIMING_OTHER);
+    return true;
+  }
+
+  *weight = measureCharge((timing != SETTLE_UNTIMED) ? settleWindow(since) : LONG);
+  TimingPhase(TIMING_OTHER);
+  Weight settledWeight = *weight;
+
+  // A stable weight that was already showing when the wait ended settled at its last change, otherwise where the stable measurement started
+  bool timed = (timing == SETTLE_CONTINUOUS) || (labs(settledWeight - startWeight) >= (SETTLE_MIN_DIVISIONS * CENTIGRAINS_PER_DIVISION));
+  if((timing != SETTLE_UNTIMED) && timed && (StableStatus() == STABLE_OK))
+  {
+    unsigned long settle = (settledWeight == lastWeight) ? lastChange : (StableSince() - since);
+    observeSettle(arrived, arrival, true, settle);
+  }
+
+  if(predicted)
+  {
+    Weight predictionError = predictedWeight - settledWeight;
+    predictionCount++;
+    predictionErrorTotal += labs(predictionError);
+
+    Serial.print("Settle prediction error = ");
+    Serial.print(WeightToGrains(predictionError), 2);
+    Serial.print(" at confidence ");
+    Serial.print(confidence);
+    Serial.print("%, mean absolute error = ");
+    Serial.print(WeightToGrains(predictionErrorTotal) / predictionCount, 4);
+    Serial.print(" over ");
+    Serial.print(predictionCount);
+    Serial.println(" predictions");
+  }
+
+  return true;
+}
+
+// settleWait()
+// Returns how long to wait in ms for a trickle to register or settle, SETTLE_QUANTILE of the learned delays plus SETTLE_MARGIN
+// Delays run long rather than short, so the spread above the mean is used, and the wait never exceeds MAX_DELAY
+unsigned long settleWait(RunningStats* stats)
+{
+  if(!SETTLE_TIMING || !StatsReady(stats))
+  {
+    return MAX_DELAY;
+  }
+
+  float wait = max(stats->mean, 0) + (NormalQuantile(SETTLE_QUANTILE) * StatsUpperStdDev(stats)) + SETTLE_MARGIN;
+
+  return (wait < MAX_DELAY) ? wait : MAX_DELAY;
+}
+
+// settleWindow()
+// Returns the stability window in ms for the weight after a trickle that ended at the given time
+// It covers what is left of the learned settle wait, so a weight measured once the trickle has usually settled only needs a short confirmation
+int settleWindow(unsigned long since)
+{
+  if(!SETTLE_TIMING || !StatsReady(&settleStats))
+  {
+    return LONG;
+  }
+
+  long remaining = (long)settleWait(&settleStats) - (long)(millis() - since);
+
+  return constrain(remaining, SETTLE_MIN_WINDOW, LONG);
+}
+
+// observeSettle()
+// Learns how long a trickle took to register on the scale and to settle, from the end of the trickle
+void observeSettle(bool arrived, unsigned long arrival, bool settled, unsigned long settle)
+{
+  Serial.print("Trickle");
+  if(arrived)
+  {
+    StatsObserve(&arrivalStats, arrival, SETTLE_FORGETTING);
+    Serial.print(" registered after ");
+    Serial.print(arrival);
+    Serial.print("ms");
+  }
+  if(settled)
+  {
+    StatsObserve(&settleStats, settle, SETTLE_FORGETTING);
+    Serial.print(" settled after ");
+    Serial.print(settle);
+    Serial.print("ms");
+  }
+  Serial.print(", waits now ");
+  Serial.print(settleWait(&arrivalStats));
+  Serial.print("ms to register and ");
+  Serial.print(settleWait(&settleStats));
+  Serial.println("ms to settle");
+}
+
+// PrintSettleTiming()
+// Prints the learned arrival and settle times of the trickles and the waits set from them
+void PrintSettleTiming()
+{
+  Serial.print("Trickle arrival = ");
+  Serial.print(arrivalStats.mean, 0);
+  Serial.print(" +/- ");
+  Serial.print(StatsStdDev(&arrivalStats), 0);
+  Serial.print("ms (+");
+  Serial.print(StatsUpperStdDev(&arrivalStats), 0);
+  Serial.print("ms above) over ");
+  Serial.print(arrivalStats.count);
+  Serial.print(" bursts, waiting up to ");
+  Serial.print(settleWait(&arrivalStats));
+  Serial.println("ms");
+
+  Serial.print("Trickle settle = ");
+  Serial.print(settleStats.mean, 0);
+  Serial.print(" +/- ");
+  Serial.print(StatsStdDev(&settleStats), 0);
+  Serial.print("ms (+");
+  Serial.print(StatsUpperStdDev(&settleStats), 0);
+  Serial.print("ms above) over ");
+  Serial.print(settleStats.count);
+  Serial.print(" trickles, waiting up to ");
+  Serial.print(settleWait(&settleStats));
+  Serial.println("ms");
+}
+
+// Does a bulk throw, including the retraction at the end
+// If trickleKernels is given the trickler drops that many kernels alongside the retraction, and this returns once both motors have stopped
+// If cutoffWeight is given the dispense is cut off (or extended) from the streaming weight so the scale settles at cutoffWeight
+bool bulkThrow(Weight weight, bool forceContinue, int trickleKernels, Weight cutoffWeight)
+{
+  // Do not allow dispensing of more than 250 grains of powder
+  if(weight > GRAINS(250))
+  {
+    return false;
+  }
+
+  // The charge goes back to the phase it was in however the throw ends, so a cancelled throw is not counted as bulk time
+  byte previousPhase = TimingPhase(TIMING_BULK);
+  bool thrown = throwBulkPlan(weight, forceContinue, trickleKernels, cutoffWeight);
+  TimingPhase(previousPhase);
+
+  return thrown;
+}
+
+// throwBulkPlan()
+// Queues and waits for the dispense, retraction and recovery of a bulk throw, moving the charge's timing through its phases
+// Returns false if the throw could not be queued or was cancelled
+bool throwBulkPlan(Weight weight, bool forceContinue, int trickleKernels, Weight cutoffWeight)
+{
+
+  // Queue the dispense, the retraction and the recovery (going forwards again) as one plan so the motor runs them back to back
+  // The recovery distance is added back onto the dispense as it has to be made up on every throw
+  MotionSegment plan[] =
+  {
+    {BulkSteps(weight) + (long)(1.5 * RECOVERY_STEPS), BULK_SPEED, BULK_RAMP},
+    {-RETRACT_STEPS, BULK_SPEED, BULK_RAMP},
+    {RECOVERY_STEPS, BULK_SPEED, BULK_RAMP}
+  };
+
+  // Bulk dispense the requested number of grains of powder
+  unsigned int handle = QueueMotion(MOTION_BULK, plan, 3);
+  if(!handle)
+  {
+    Serial.println("Bulk motion queue full or emergency stopped, bulk throw cancelled");
+    return false;
+  }
 
-  // Make sure that we are still enabled after the weight measurements complete
-  if(!isEnabled())
+  // handle - 2 is the dispense segment of the plan
+  long startPosition = GetBulkPosition();
+  bulkCutoffValid = false;
+  bool dispensed = (cutoffWeight > 0) ? closedLoopBulk(handle - 2, plan[0].steps, cutoffWeight, forceContinue) : waitForBulk(forceContinue, handle - 2);
+  if(!dispensed)
   {
-    Serial.println("Enable switch toggled to off in Evaluate state after weight measurements, returning to Idle state");
-    // Reset evaluation and idle flags
-    firstEvaluate = true;
-    evaluateUpdate = false;
-    firstIdleUpdate = true;
+    Serial.println("Bulk throw cancelled during the dispense phase");
+    // Return false if enable is toggled to off during the bulk dispense
+    return false;
+  }
 
-    // Reset LEDs before exiting evaluate
-    digitalWrite(GREEN_LED, LOW);
-    digitalWrite(YELLOW_LED, LOW);
-    digitalWrite(RED_LED, LOW);
+  // The retraction has started
+  TimingPhase(TIMING_RETRACT);
 
-    // Return to idle state
-    return IDLE_STATE;
+  // Pipeline the start of the trickle with the retraction, both motors can run at once
+  if(trickleKernels > 0)
+  {
+    Serial.print("Pipelining '");
+    Serial.print(trickleKernels);
+    Serial.println("' kernels with the bulk retraction");
+    TrickleDispense(trickleKernels);
   }
 
-  // Determine evaluation display update based on weightDiff
-  // Case 1 - overthrow
-  if(weightDiff < (-1.2 * errorMargin))
+  if(!waitForBulk(forceContinue, handle))
   {
-    // Change the display
-    Serial.println("Overthrow detected in Evaluate State");
-    OverthrowScreen(targetWeight, evaluateWeight, elapsedTime, errorMargin);
-
-    // Illuminate the Red LED after turning the others off
-    digitalWrite(YELLOW_LED, LOW);
-    digitalWrite(GREEN_LED, LOW);
-    digitalWrite(RED_LED, HIGH);
+    Serial.println("Bulk throw cancelled during the retract phase");
+    // Return false if enable is toggled to off during the retraction
+    return false;
   }
-  // Case 2 - correct weight (0.02 under is acceptable as a good throw)
-  else if(weightDiff < 0.021)
-  {
-    // Change the display
-    Serial.println("Acceptable charge detected in Evaluate State");
-    GoodChargeScreen(targetWeight, evaluateWeight, elapsedTime, errorMargin);
 
-    // Illuminate the Green LED after turning the others off
-    digitalWrite(YELLOW_LED, LOW);
-    digitalWrite(RED_LED, LOW);
-    digitalWrite(GREEN_LED, HIGH);
-  }
-  // Case 3 - underthrow
-  else
+  // Let any pipelined kernels finish dropping
+  if(IsTrickling())
   {
-    // Handle extreme underthrow (this should never happen)
-    if(weightDiff > 1)
+    TimingPhase(TIMING_TRICKLE);
+    if(!waitForTrickle())
     {
-      // Reset LEDs before exiting evaluate (yellow plus red for extreme underthrow)
-      LowChargeScreen(targetWeight, evaluateWeight, elapsedTime, errorMargin);
-      digitalWrite(GREEN_LED, LOW);
-      digitalWrite(YELLOW_LED, HIGH);
-      digitalWrite(RED_LED, HIGH);
+      Serial.println("Bulk throw cancelled during the pipelined trickle");
+      return false;
+    }
+  }
 
-      // Set evaluateUpdate flag
-      evaluateUpdate = true;
+  // Net travel of the throw, plus the retraction it made up and less the recovery allowance, is the dispense as BulkSteps() counts it
+  bulkThrowSteps = (GetBulkPosition() - startPosition) + (RETRACT_STEPS - RECOVERY_STEPS) - (long)(1.5 * RECOVERY_STEPS);
 
-      Serial.println("Extreme underthrow error during evaluate");
-      return EVALUATE_STATE;
-    }
-    // Underthrow by more than 0.02gr (which tests as a good throw above), but less than the calibrated kernel weight
-    else if(weightDiff <= (1.2 * kernelWeight))
+  // Return true if the dispense plus retraction completes successfully
+  return true;
+}
+
+// closedLoopBulk()
+// Waits for the dispense segment of a bulk throw, moving its end so the weight settles at cutoffWeight
+// The weight to come is the streaming weight, plus the powder still falling or settling (bulkLatency at the bulk speed), plus the steps left to turn
+// The pulse is never extended past BULK_MAX_EXTEND of its planned steps, and runs to its current end if the scale stops streaming
+// The weight of a revolution and the powder in flight are fixed for the pulse, so each sample is handled in integer centigrains and steps
+bool closedLoopBulk(unsigned int handle, long plannedSteps, Weight cutoffWeight, bool forceContinue)
+{
+  Weight revWeight = GetBulkRevWeight();
+  long latency = bulkLatency;
+  long inFlightSteps = ((BULK_SPEED * (long)STEPS_PER_REV) / 600) * latency / 1000;
+  Weight inFlight = (inFlightSteps * revWeight) / STEPS_PER_REV;
+  long startPosition = GetBulkPosition();
+  long lastEnd = startPosition + plannedSteps;
+  long latestEnd = startPosition + (plannedSteps * (1 + BULK_MAX_EXTEND));
+  unsigned long startMillis = millis();
+  unsigned long lastStamp = 0;
+  bool retargeted = false;
+
+  while(!MotionDone(MOTION_BULK, handle))
+  {
+    // Keep the scale stream and motion queues running so the next weight reading is fresh
+    RunTasks();
+
+    // Exit to Idle state if enable switch is toggled off at any time
+    if(!isEnabled() && !forceContinue)
     {
-      // Reset LEDS before exiting evaluate (both green and yellow illuminated for this case)
-      StaleChargeScreen(targetWeight, evaluateWeight, elapsedTime, errorMargin);
-      digitalWrite(GREEN_LED, HIGH);
-      digitalWrite(YELLOW_LED, HIGH);
-      digitalWrite(RED_LED, LOW);
+      Serial.println("Enable toggled off during bulk, stopping motors and ending their movement");
+      StopMotors();
 
-      // Set evaluateUpdate flag
-      evaluateUpdate = true;
+      EndBulk();
+      EndTrickle();
+      return false;
+    }
 
-      Serial.println("Sub-kernel underthrow detected in Evaluate state, changing to light to indicate caution but remaining in Evaluate state");
-      return EVALUATE_STATE;
+    // Only act on new samples, taken after the first powder could have reached the scale
+    Weight weight;
+    unsigned long stamp;
+    if(!LatestWeight(&weight, &stamp) || stamp == lastStamp || (millis() - stamp) > SCALE_MAX_AGE || (long)(stamp - startMillis) < latency)
+    {
+      continue;
     }
-    else
+    lastStamp = stamp;
+
+    long position = GetBulkPosition();
+    long remaining = MotionRemaining(MOTION_BULK, handle);
+    if(remaining < 0)
     {
-      // Reset LEDs before exiting evaluate (yellow only for true underthrow)
-      LowChargeScreen(targetWeight, evaluateWeight, elapsedTime, errorMargin);
-      digitalWrite(GREEN_LED, LOW);
-      digitalWrite(YELLOW_LED, HIGH);
-      digitalWrite(RED_LED, LOW);
+      // The dispense has handed over to the retraction
+      continue;
+    }
 
-      // Set evaluateUpdate flag
-      evaluateUpdate = true;
+    // Weight still to come from powder already dropped, then the steps needed to make up the rest
+    long wanted = ((cutoffWeight - (weight + inFlight)) * STEPS_PER_REV) / revWeight;
+    wanted = constrain(wanted, 0, latestEnd - position);
 
-      Serial.println("Underthrow detected in Evaluate state, changing to light to indicate caution but remaining in Evaluate state");
-      return EVALUATE_STATE;
+    if(abs(wanted - remaining) > BULK_RETARGET_STEPS && RetargetMotion(MOTION_BULK, handle, wanted))
+    {
+      remaining = wanted;
+      lastEnd = position + wanted;
+      retargeted = true;
     }
+
+    bulkCutoffPrediction = weight + inFlight + ((remaining * revWeight) / STEPS_PER_REV);
+    bulkCutoffValid = true;
   }
 
-  // Set evaluate flags to false since it's not our first evaluation and any updates have been completed
-  firstEvaluate = false;
-  evaluateUpdate = false;
+  if(retargeted)
+  {
+    Serial.print("Closed loop bulk pulse moved by ");
+    Serial.print(lastEnd - (startPosition + plannedSteps));
+    Serial.print(" steps, predicting ");
+    Serial.print(WeightToGrains(bulkCutoffPrediction), 2);
+    Serial.println("gr");
+  }
 
-  // Return to top of Evaluate state
-  return EVALUATE_STATE;
+  return true;
 }
 
-int ErrorIdState()
+// learnBulkLatency()
+// Corrects bulkLatency from how far the settled weight of a closed loop pulse was from its prediction
+// Powder still falling when the pulse was cut off arrives at the bulk flow rate, so the error in grains converts to an error in time
+void learnBulkLatency(Weight settledWeight)
 {
+  if(!bulkCutoffValid)
+  {
+    return;
+  }
+  bulkCutoffValid = false;
 
-}
-int RecoverableErrorState()
-{
+  float grainsPerSecond = ((BULK_SPEED * (float)STEPS_PER_REV) / 600.0) * (GetBulkWeight() / STEPS_PER_REV);
+  float latencyError = 1000.0 * WeightToGrains(settledWeight - bulkCutoffPrediction) / grainsPerSecond;
+  bulkLatency = constrain(bulkLatency + (BULK_LATENCY_GAIN * latencyError), BULK_MIN_LATENCY, BULK_MAX_LATENCY);
 
+  Serial.print("Closed loop bulk error = ");
+  Serial.print(WeightToGrains(settledWeight - bulkCutoffPrediction), 2);
+  Serial.print("gr, new bulkLatency = ");
+  Serial.print(bulkLatency, 0);
+  Serial.println("ms");
 }
-void UnrecoverableErrorState()
+
+// pipelineKernels()
+// Returns the number of kernels that can safely be trickled alongside a bulk pulse
+// Sized from the residual the bulk pulse is expected to leave, less the allowance for what it could overthrow by, so the two together stay under the target
+int pipelineKernels(Weight expectedResidual, Weight allowance)
 {
+  if(!PIPELINED_DISPENSE)
+  {
+    return 0;
+  }
 
+  long kernels = ((expectedResidual - allowance) * (1L << KERNEL_WEIGHT_BITS)) / GetKernelWeightFixed();
+
+  return constrain(kernels, 0, PIPELINE_MAX_KERNELS);
 }
 
-// changeTarget(float weightDiff)
-void changeTarget(float weightDiff)
+// plannedTrickleKernels()
+// Returns the largest fine trickle burst that goes more than the error margin past the target with at most TRICKLE_MAX_OVERTHROW chance
+// Its spread is that of each slot plus the uncertainty of the kernelWeight, which grows with every kernel, and the two readings the weight difference is taken from
+// The burst's upper quantile is rounded up to centigrains and compared exactly with the weight it may reach
+int plannedTrickleKernels(Weight weightDiff)
 {
-  targetWeight = targetWeight + weightDiff;
+  float kernelWeight = GetKernelEstimate();
+  float slotVariance = sq(GetSlotSpread());
+  float weightVariance = sq(GetKernelUncertainty());
+  float quantile = NormalQuantile(1 - TRICKLE_MAX_OVERTHROW);
+  Weight limit = weightDiff + errorMargin;
+
+  int kernels = WeightToGrains(limit) / kernelWeight;
+  float spread = 0;
+  for(; kernels > 0; kernels--)
+  {
+    spread = sqrt((kernels * slotVariance) + (sq(kernels) * weightVariance) + (sq(SCALE_DIVISION) / 6));
+    if((Weight)ceil(((kernels * kernelWeight) + (quantile * spread)) * CENTIGRAINS_PER_GRAIN) <= limit)
+    {
+      break;
+    }
+  }
+
+  Serial.print("Planned trickle of ");
+  Serial.print(kernels);
+  Serial.print(" kernels, expected to land ");
+  Serial.print((kernels * kernelWeight) - WeightToGrains(weightDiff), 3);
+  Serial.print(" +/- ");
+  Serial.print(spread, 3);
+  Serial.println("gr from the target");
+
+  return kernels;
 }
 
-// isEnabled()
-// Returns whether or not the enable toggle is currently pressed
-bool isEnabled()
+// resetBulkPlanner()
+// Forgets what the bulk planner has measured, for a new calibration
+void resetBulkPlanner()
 {
-  if(digitalRead(ENABLE_BTN))
+  StatsReset(&cutoffStats);
+  for(byte kind = 0; kind < SECOND_PULSE_KINDS; kind++)
   {
-    return true;
+    StatsReset(&excessStats[kind]);
+    lastPlanned[kind] = 0;
+    bulkPulseTime[kind] = BULK_PULSE_TIME;
   }
-  else
+  cutoffWarmup = BULK_PLAN_WARMUP;
+  trickleRate = TRICKLE_RATE;
+}
+
+// pipelineReserve()
+// Weight the planner leaves for a full set of pipelined kernels, they drop while the bulk retracts so cost no time and add no bulk spread
+static float pipelineReserve()
+{
+  return PIPELINED_DISPENSE ? (PIPELINE_MAX_KERNELS * GetKernelWeight()) : 0;
+}
+
+// overthrowQuantile()
+// Standard deviations above the mean a pulse has to be planned for so it overthrows with at most BULK_MAX_OVERTHROW chance
+static float overthrowQuantile()
+{
+  return NormalQuantile(1 - BULK_MAX_OVERTHROW);
+}
+
+// firstBulkAllowance()
+// Returns how far past its cutoff the closed loop first bulk pulse may settle, the upper quantile of the measured cutoff error (at least BULK_MIN_RESIDUAL)
+// Until enough pulses have been measured the whole of BULK_CLOSED_LOOP_RESIDUAL is allowed for, so nothing is pipelined behind the pulse
+float firstBulkAllowance()
+{
+  if(!BULK_PLANNER || !StatsReady(&cutoffStats))
   {
-    return false;
+    return BULK_CLOSED_LOOP_RESIDUAL;
   }
+
+  // An underthrow bias is removed by learnBulkLatency(), so it is not relied on
+  float allowance = max(cutoffStats.mean, 0) + (overthrowQuantile() * sqrt(cutoffStats.upperVariance + sq(BULK_PLAN_FLOOR)));
+
+  return max(allowance, BULK_MIN_RESIDUAL);
 }
 
-bool upPressed()
+// firstBulkResidual()
+// Returns the weight the closed loop first bulk pulse is cut off short of the target by
+// Once enough pulses have been measured it covers the upper quantile of their cutoff error (at least BULK_MIN_RESIDUAL) plus the pipeline reserve, otherwise it is BULK_CLOSED_LOOP_RESIDUAL
+float firstBulkResidual()
 {
-  if(!digitalRead(UP_BTN))
+  if(!BULK_PLANNER || !StatsReady(&cutoffStats))
   {
-    return true;
+    return BULK_CLOSED_LOOP_RESIDUAL;
   }
-  else
+
+  float residual = firstBulkAllowance() + pipelineReserve();
+  residual = min(residual, BULK_MAX_RESIDUAL);
+
+  Serial.print("Bulk planner leaving ");
+  Serial.print(residual, 3);
+  Serial.print("gr after the closed loop pulse, cutoff error = ");
+  Serial.print(cutoffStats.mean, 3);
+  Serial.print(" +");
+  Serial.print(StatsUpperStdDev(&cutoffStats), 3);
+  Serial.println("gr");
+
+  return residual;
+}
+
+// secondBulkPlanned()
+// Returns true once the planner has measured enough second pulses of a kind to size them
+bool secondBulkPlanned(byte kind)
+{
+  return BULK_PLANNER && StatsReady(&excessStats[kind]);
+}
+
+// secondBulkAllowance()
+// Returns how much more than the given weight a second bulk pulse planned for it may deliver, at the BULK_MAX_OVERTHROW quantile
+float secondBulkAllowance(byte kind, float grains)
+{
+  if(!secondBulkPlanned(kind))
   {
-    return false;
+    return PIPELINE_BULK_ERROR * grains;
   }
+
+  return excessStats[kind].mean + (overthrowQuantile() * sqrt(excessStats[kind].upperVariance + sq(BULK_PLAN_FLOOR)));
 }
 
-bool downPressed()
+// secondBulkFraction()
+// Returns the fraction of weightDiff to plan a second bulk pulse for, or 0 if trickling the rest is expected to be quicker
+// The planned pulse is the largest whose allowance, plus the pipeline reserve, stays within weightDiff and that is expected to leave BULK_MIN_RESIDUAL, up to BULK_PLAN_REACH past the last one measured
+// It is only made if the trickle time it saves, at the learned trickle rate, is more than the learned time a pulse takes
+// Until enough pulses have been measured this is secondBulkCalibration for any weightDiff over legacyMinimum
+float secondBulkFraction(byte kind, float weightDiff, float legacyMinimum)
 {
-  if(!digitalRead(DOWN_BTN))
+  if(!secondBulkPlanned(kind))
   {
-    return true;
+    return (weightDiff > legacyMinimum) ? secondBulkCalibration : 0;
   }
-  else
+
+  // The excess is only known near the sizes measured so far, so the plan may not reach far past them
+  RunningStats* excess = &excessStats[kind];
+  float grains = weightDiff - max(secondBulkAllowance(kind, 0), excess->mean + BULK_MIN_RESIDUAL) - pipelineReserve();
+  grains = constrain(grains, 0, (1 + BULK_PLAN_REACH) * lastPlanned[kind]);
+  float saved = 1000.0 * (grains + excess->mean) / trickleRate;
+
+  Serial.print("Bulk planner pulse for ");
+  Serial.print(grains, 3);
+  Serial.print("gr of ");
+  Serial.print(weightDiff, 3);
+  Serial.print("gr, delivers ");
+  Serial.print(excess->mean, 3);
+  Serial.print(" +");
+  Serial.print(StatsUpperStdDev(excess), 3);
+  Serial.print("gr over plan, saves ");
+  Serial.print(saved, 0);
+  Serial.print("ms of trickle for a ");
+  Serial.print(bulkPulseTime[kind], 0);
+  Serial.println("ms pulse");
+
+  if(saved <= bulkPulseTime[kind])
   {
-    return false;
+    return 0;
   }
+
+  return grains / weightDiff;
 }
 
-// Does a bulk throw, including the retraction at the end
-bool bulkThrow(float grains, bool forceContinue)
+// observeFirstBulk()
+// Adds the error of a closed loop first pulse, its settled weight less its cutoff weight, to the planner's statistics
+// The first pulses after a calibration are skipped, their large underthrows while bulkLatency is learned would not be repeated
+void observeFirstBulk(float cutoffError)
 {
-  // Do not allow dispensing of more than 250 grains of powder
-  if(grains > 250)
+  if(cutoffWarmup)
   {
-    return false;
+    cutoffWarmup--;
+    return;
   }
 
-  // Bulk dispense the requested number of grains of powder
-  BulkDispense(grains, (1.5 * RECOVERY_STEPS));
+  StatsObserve(&cutoffStats, cutoffError, BULK_PLAN_FORGETTING);
+}
 
-  if(!waitForBulk(forceContinue))
+// observeSecondBulk()
+// Adds what a second pulse delivered against its plan, and how long it took, to the planner's statistics
+void observeSecondBulk(byte kind, float planned, float delivered, unsigned long duration)
+{
+  if(planned <= 0)
   {
-    Serial.println("Bulk throw cancelled during the dispense phase");
-    // Return false if enable is toggled to off during the bulk dispense
-    return false;
+    return;
   }
 
-  // Retract the bulk trickler by the specified retraction distance
-  BulkRetract(RETRACT_STEPS);
+  StatsObserve(&excessStats[kind], delivered - planned, BULK_PLAN_FORGETTING);
+  lastPlanned[kind] = planned;
+  bulkPulseTime[kind] += PLAN_TIME_GAIN * (duration - bulkPulseTime[kind]);
+}
 
-  if(!waitForBulk(forceContinue))
+// learnTrickleRate()
+// Updates the trickle rate from the weight the charge was trickled from and to, and the time the trickler took
+void learnTrickleRate(Weight finalWeight)
+{
+  if(!trickleTimed)
   {
-    Serial.println("Bulk throw cancelled during the 1st retract phase");
-    // Return false if enable is toggled to off during the retraction
-    return false;
+    return;
   }
+  trickleTimed = false;
 
-  // Go forwards the recovery distance
-  BulkRetract(-1 * RECOVERY_STEPS);
-  if(!waitForBulk(forceContinue))
+  float grains = WeightToGrains(finalWeight - trickleStartWeight);
+  long duration = endTime - trickleStart;
+  if(grains < 0.1 || duration <= 0)
   {
-    Serial.println("Bulk throw cancelled during the shimmy phase");
-    // Return false if enable is toggled to off during the retraction
-    return false;
+    return;
   }
 
-  // Return true if the dispense plus retraction completes successfully
-  return true;
+  trickleRate += PLAN_TIME_GAIN * ((1000.0 * grains / duration) - trickleRate);
+}
+
+// PrintBulkPlanner()
+// Prints what the bulk planner has measured
+void PrintBulkPlanner()
+{
+  Serial.print("Closed loop cutoff error = ");
+  Serial.print(cutoffStats.mean, 3);
+  Serial.print(" +/- ");
+  Serial.print(StatsStdDev(&cutoffStats), 3);
+  Serial.print("gr (+");
+  Serial.print(StatsUpperStdDev(&cutoffStats), 3);
+  Serial.print("gr above) over ");
+  Serial.print(cutoffStats.count);
+  Serial.println(" pulses");
+
+  for(byte kind = 0; kind < SECOND_PULSE_KINDS; kind++)
+  {
+    Serial.print((kind == SECOND_PULSE_TOP_UP) ? "Top up pulse delivery = " : "Only pulse delivery = ");
+    Serial.print(excessStats[kind].mean, 3);
+    Serial.print(" +/- ");
+    Serial.print(StatsStdDev(&excessStats[kind]), 3);
+    Serial.print("gr (+");
+    Serial.print(StatsUpperStdDev(&excessStats[kind]), 3);
+    Serial.print("gr above) over plan from ");
+    Serial.print(excessStats[kind].count);
+    Serial.print(" pulses, pulse time = ");
+    Serial.print(bulkPulseTime[kind], 0);
+    Serial.println("ms");
+  }
+
+  Serial.print("Trickle rate = ");
+  Serial.print(trickleRate, 3);
+  Serial.print("gr/s, slot spread = ");
+  Serial.print(GetSlotSpread(), 4);
+  Serial.println(SlotSpreadReady() ? "gr" : "gr (not yet learned)");
 }
 
-bool waitForBulk(bool forceContinue)
+// Waits for the bulk to finish moving, or only until the queued motion with the given handle is done
+bool waitForBulk(bool forceContinue, unsigned int handle)
 {
   // Wait for initial bulk to complete
-  while(IsBulking())
+  while(handle ? !MotionDone(MOTION_BULK, handle) : IsBulking())
   {
+    // Keep the scale stream and motion queues running so the next weight reading is fresh
+    RunTasks();
+
     // Exit to Idle state if enable switch is toggled off at any time
     if(!isEnabled() && !forceContinue)
     {
@@ -1608,7 +2981,7 @@ bool waitForBulk(bool forceContinue)
   }
   /*
   // Delay an extra 100ms
-  delay(100);
+  WaitMillis(100);
 
   // Perform EndBulk() retraction
   EndBulk();
@@ -1618,12 +2991,16 @@ bool waitForBulk(bool forceContinue)
 
 }
 
-
+// waitForTrickle()
+// Waits for the trickler to finish its movement, running the background tasks while it does
+// Returns false if the enable toggle is switched off or the cup is removed, the motors are stopped
 bool waitForTrickle()
 {
-  // Wait for initial bulk to complete
+  // Wait for the trickle to complete, checking the latest sample each pass instead of waiting for a stable weight so the checks below never stall
   while(IsTrickling())
   {
+    RunTasks();
+
     // Exit to Idle state if enable switch is toggled off at any time
     if(!isEnabled())
     {
@@ -1635,7 +3012,9 @@ bool waitForTrickle()
       return false;
     }
     // Stop the trickle if the weight goes below zero at any time
-    if(StableWeight(50) < 0)
+    Weight weight;
+    unsigned long weightTime;
+    if(LatestWeight(&weight, &weightTime) && weight < CUP_REMOVED_WEIGHT)
     {
       Serial.println("Cup removed during trickle, stopping motors and ending their movement");
       StopMotors();
@@ -1649,88 +3028,238 @@ bool waitForTrickle()
   return true;
 }
 
-void increaseBulkCalibration()
+// continuousInFlight()
+// Returns the weight of the kernels a continuous trickle at the given speed drops within CONTINUOUS_LAG, from a fixed point kernelWeight
+static Weight continuousInFlight(int speed, long kernelWeight)
 {
-  float curRevs = GetBulkWeight();
-  SetBulkWeight(curRevs * 1.03);
+  // Thousandths of a kernel, a speed of rotations per minute * 10 drops KERNELS_PER_REV / 600 kernels per second for each unit
+  long milliKernels = ((long)speed * KERNELS_PER_REV * CONTINUOUS_LAG) / 600;
 
-  Serial.print("Adjusting calibration up by 3%, grainsPerRev = ");
-  Serial.println(GetBulkWeight(), 6);
+  return (KernelsToWeight(milliKernels, kernelWeight) + 500) / 1000;
 }
 
-void smallIncreaseBulkCalibration()
+// continuousTrickle()
+// Runs the trickler continuously from the given starting weight, tapering its speed as the predicted final weight approaches targetWeight
+// The final weight is predicted from the streaming weight plus the kernels still in flight at the current speed
+// The kernels dropped by the motor are only used as a safety stop in case the streaming weight stops rising
+// The remaining weight is compared in centigrains, the kernels in flight are converted to centigrains for it and half a kernel is rounded up so the trickle stops where it would on the exact weights
+// The kernelWeight is read once in fixed point, so each sample is handled in integer arithmetic
+// Returns the number of kernels dispensed, or -1 if the enable toggle is switched off or the cup is removed
+int continuousTrickle(Weight startWeight)
 {
-  float curRevs = GetBulkWeight();
-  SetBulkWeight(curRevs * 1.01);
+  long kernelWeight = GetKernelWeightFixed();
+  Weight halfKernel = (kernelWeight + (2L << KERNEL_WEIGHT_BITS) - 1) >> (KERNEL_WEIGHT_BITS + 1);
+  long startPosition = GetTricklePosition();
+  long maxSteps = (CONTINUOUS_MAX_KERNELS * (STEPS_PER_REV / KERNELS_PER_REV)) * ((targetWeight - startWeight) << KERNEL_WEIGHT_BITS) / kernelWeight;
+  Weight weight = startWeight;
 
-  Serial.print("Adjusting calibration up by 3%, grainsPerRev = ");
-  Serial.println(GetBulkWeight(), 6);
-}
+  // A speed is in rotations per minute * 10, the kernels in flight at a speed drop over the last CONTINUOUS_LAG
+  // Dividing a remaining weight by taperDivisor gives the speed that has CONTINUOUS_TAPER of it in flight
+  long taperDivisor = (kernelWeight * KERNELS_PER_REV) / CONTINUOUS_TAPER;
 
-void decreaseBulkCalibration()
-{
-  float curRevs = GetBulkWeight();
-  SetBulkWeight(curRevs * 0.98);
+  // Start at the tapered speed, where the kernels in flight are CONTINUOUS_TAPER of what will then be left
+  Weight startRemaining = (targetWeight - startWeight) / (1 + CONTINUOUS_TAPER);
+  int speed = constrain(((startRemaining << KERNEL_WEIGHT_BITS) * (600000L / CONTINUOUS_LAG)) / taperDivisor, CONTINUOUS_MIN_SPEED, TRICKLE_SPEED);
+  Weight inFlight = continuousInFlight(speed, kernelWeight);
+  unsigned long weightTime;
 
-  Serial.print("Adjusting calibration down by 2%, grainsPerRev = ");
-  Serial.println(GetBulkWeight(), 6);
-}
+  TrickleRun(speed);
 
-void smallDecreaseBulkCalibration()
-{
-  float curRevs = GetBulkWeight();
-  SetBulkWeight(curRevs * 0.99);
+  while(true)
+  {
+    RunTasks();
 
-  Serial.print("Adjusting calibration down by 2%, grainsPerRev = ");
-  Serial.println(GetBulkWeight(), 6);
-}
+    // Exit to Idle state if enable switch is toggled off at any time
+    if(!isEnabled())
+    {
+      Serial.println("Enable toggled off during continuous trickle, stopping motors and ending their movement");
+      StopMotors();
 
-void increaseTrickleCalibration()
-{
-  // Adjust kernel weight to be slightly larger
-  float curKernel = GetKernelWeight();
-  SetKernelWeight(curKernel * 1.03);
+      EndTrickle();
+      EndBulk();
+      return -1;
+    }
+
+    // Stop on a stale weight, the scale is no longer keeping up with the trickle
+    if(LatestWeight(&weight, &weightTime))
+    {
+      if((millis() - weightTime) > SCALE_MAX_AGE)
+      {
+        Serial.println("Scale weight went stale during continuous trickle, stopping the trickle");
+        break;
+      }
+    }
+
+    // Stop the trickle if the weight goes below zero at any time
+    if(weight < 0)
+    {
+      Serial.println("Cup removed during continuous trickle, stopping motors and ending their movement");
+      StopMotors();
+
+      EndTrickle();
+      EndBulk();
+      return -1;
+    }
+
+    // Safety stop if far more kernels were dropped than the remainder should need
+    if((GetTricklePosition() - startPosition) > maxSteps)
+    {
+      Serial.println("Continuous trickle dropped more kernels than expected, stopping the trickle");
+      break;
+    }
+
+    // Kernels dropped within the last CONTINUOUS_LAG at the current speed have not registered on the scale yet
+    Weight remaining = targetWeight - (weight + inFlight);
+
+    // Stop once the next kernel would overshoot the target by more than it would help
+    if(remaining < halfKernel)
+    {
+      break;
+    }
+
+    // Taper the speed so the kernels in flight stay a fixed fraction of the remaining weight, only ramping when it changes by at least 0.5 rpm
+    int newSpeed = constrain(((remaining << KERNEL_WEIGHT_BITS) * (600000L / CONTINUOUS_LAG)) / taperDivisor, CONTINUOUS_MIN_SPEED, TRICKLE_SPEED);
+    if(abs(newSpeed - speed) >= 5)
+    {
+      speed = newSpeed;
+      inFlight = continuousInFlight(speed, kernelWeight);
+      TrickleRun(speed);
+    }
+  }
+
+  TrickleStop();
+  while(IsTrickling())
+  {
+    RunTasks();
+  }
 
-  Serial.print("Adjusting calibration up by 3%, kernelWeight = ");
-  Serial.println(GetKernelWeight(), 6);
+  int kernels = (GetTricklePosition() - startPosition) / (STEPS_PER_REV / KERNELS_PER_REV);
+
+  Serial.print("Continuous trickle dispensed ");
+  Serial.print(kernels);
+  Serial.print(" kernels, final speed = ");
+  Serial.println(speed);
+
+  return kernels;
 }
 
-void smallIncreaseTrickleCalibration()
+// loadSettings()
+// Reads the saved settings, moving settings saved by older firmware at fixed EEPROM addresses into the store the first time
+// Returns false if nothing valid has been saved, meaning first time setup is needed
+bool loadSettings()
 {
-  // Adjust kernel weight to be slightly larger
-  float curKernel = GetKernelWeight();
-  SetKernelWeight(curKernel * 1.01);
+  if(StorageRead(SETTINGS_KEY, &settings, sizeof(Settings)))
+  {
+    return true;
+  }
+
+  EEPROM.get(TARGET_MEMORY_ADDR, settings.targetWeight);
+  if(isnan(settings.targetWeight) || settings.targetWeight <= 0 || settings.targetWeight > 275)
+  {
+    return false;
+  }
+
+  EEPROM.get(VERSION_MEMORY_ADDR, settings.versionNumber);
+  EEPROM.get(DIRECTION_MEMORY_ADDR, settings.motorDirection);
+  settings.powderSlot = 0;
+  settings.startups = 0;
+  StorageWrite(SETTINGS_KEY, &settings, sizeof(Settings));
 
-  Serial.print("Adjusting calibration up by 1%, kernelWeight = ");
-  Serial.println(GetKernelWeight(), 6);
+  Serial.println("Moved settings saved by older firmware into the EEPROM store");
+  return true;
 }
 
-void decreaseTrickleCalibration()
+// saveSettings()
+// Saves the target, motor direction and selected powder, the version number is only set by first time setup
+void saveSettings()
 {
-  // Adjust kernel weight to be slightly smaller
-  float curKernel = GetKernelWeight();
-  SetKernelWeight(curKernel * 0.98);
-
-  Serial.print("Adjusting calibration down by 2%, kernelWeight = ");
-  Serial.println(GetKernelWeight(), 6);
+  settings.targetWeight = WeightToGrains(targetWeight);
+  settings.motorDirection = motorDirection;
+  settings.powderSlot = powderSlot;
+  StorageWrite(SETTINGS_KEY, &settings, sizeof(Settings));
 }
 
-void smallDecreaseTrickleCalibration()
+// loadProfile()
+// Replaces the calibration in use with the saved profile of the selected powder, including what was adapted while dispensing it if the profile is recent
+// Returns false, leaving the calibration unchanged, if the powder has no saved profile or its values are out of range
+bool loadProfile()
 {
-  // Adjust kernel weight to be slightly smaller
-  float curKernel = GetKernelWeight();
-  SetKernelWeight(curKernel * 0.99);
+  PowderProfile profile;
+  if(!LoadProfile(powderSlot, &profile))
+  {
+    Serial.print("No saved profile for powder ");
+    Serial.println(powderSlot + 1);
+    return false;
+  }
+
+  // Same ranges the calibration accepts
+  if(!((20 < profile.grainsPerRev) && (profile.grainsPerRev < 150)) || !((0.01 < profile.kernelWeight) && (profile.kernelWeight < 0.10)) || !((0 < profile.errorMargin) && (profile.errorMargin <= GRAINS(0.1))))
+  {
+    Serial.print("Saved profile for powder ");
+    Serial.print(powderSlot + 1);
+    Serial.println(" is out of range, ignoring it");
+    return false;
+  }
+
+  SetBulkWeight(profile.grainsPerRev);
+  SetKernelWeight(profile.kernelWeight);
+  errorMargin = profile.errorMargin;
+
+  // Values adapted while dispensing are only restored if the profile is recent and they are within range, otherwise they restart from the defaults
+  byte age = settings.startups - profile.startup;
+  bool uncertaintiesValid = (0 < profile.bulkUncertainty) && (profile.bulkUncertainty < profile.grainsPerRev) && (0 < profile.kernelUncertainty) && (profile.kernelUncertainty < profile.kernelWeight);
+  if((age <= PROFILE_MAX_AGE) && uncertaintiesValid && (STAGE_TWO_MIN <= profile.secondBulkCalibration) && (profile.secondBulkCalibration <= STAGE_TWO_MAX) && (BULK_MIN_LATENCY <= profile.bulkLatency) && (profile.bulkLatency <= BULK_MAX_LATENCY))
+  {
+    SetBulkWeight(profile.grainsPerRev, profile.bulkUncertainty);
+    SetKernelWeight(profile.kernelWeight, profile.kernelUncertainty);
+    secondBulkCalibration = profile.secondBulkCalibration;
+    bulkLatency = profile.bulkLatency;
+
+    // The restored latency has already converged, the planner can learn from the first pulse
+    cutoffWarmup = 0;
+  }
+  else
+  {
+    secondBulkCalibration = STAGE_TWO_DEFAULT;
+    bulkLatency = BULK_FALL_LATENCY;
+
+    Serial.print("Saved profile is ");
+    Serial.print(age);
+    Serial.println(" startups old or its adapted values are out of range, restoring only its calibration");
+  }
 
-  Serial.print("Adjusting calibration down by 1%, kernelWeight = ");
-  Serial.println(GetKernelWeight(), 6);
+  Serial.print("Loaded profile for powder ");
+  Serial.print(powderSlot + 1);
+  Serial.print(", grainsPerRev = ");
+  Serial.print(profile.grainsPerRev, 4);
+  Serial.print(", kernelWeight = ");
+  Serial.print(profile.kernelWeight, 6);
+  Serial.print(", secondBulkCalibration = ");
+  Serial.println(secondBulkCalibration);
+
+  return true;
 }
 
-void tinyDecreaseTrickleCalibration()
+// saveProfile()
+// Saves the calibration in use as the profile of the powder it belongs to
+void saveProfile()
 {
-  // Adjust kernel weight to be slightly smaller
-  float curKernel = GetKernelWeight();
-  SetKernelWeight(curKernel * 0.995);
+  if(loadedPowder >= PROFILE_COUNT)
+  {
+    return;
+  }
 
-  Serial.print("Adjusting calibration down by 0.5%, kernelWeight = ");
-  Serial.println(GetKernelWeight(), 6);
+  PowderProfile profile;
+  profile.grainsPerRev = GetBulkEstimate();
+  profile.bulkUncertainty = GetBulkUncertainty();
+  profile.kernelWeight = GetKernelEstimate();
+  profile.kernelUncertainty = GetKernelUncertainty();
+  profile.secondBulkCalibration = secondBulkCalibration;
+  profile.bulkLatency = bulkLatency;
+  profile.startup = settings.startups;
+  profile.errorMargin = errorMargin;
+  SaveProfile(loadedPowder, &profile);
+
+  Serial.print("Saved calibration as the profile for powder ");
+  Serial.println(loadedPowder + 1);
 }
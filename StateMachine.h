@@ -1,18 +1,8 @@
 // StateMachine.h
 // Implements the state machine for the trickler
-// Each state will have its own function for the main program to call
-// The return value of each state will be the updated state machine tracker value
-//
-// State machine tracker values
-// 0 = Setup
-// 1 = Calibration
-// 2 = Idle
-// 3 = Ready
-// 4 = Dispense/Run
-// 5 = Evaluate
-// -1 = Error identification
-// -2 = Recoverable Error (waiting for reset)
-// -3 = Unrecoverable Error (waiting for power cycle)
+// Each state has a tick function, run once per pass of the main loop, whose return value is the updated state machine tracker value
+// The state table gives each state optional enter and exit hooks and the states it may exit to, RunStateMachine() makes every change of state through it
+// Each change of state is timestamped into a trace buffer, and the time spent in each state is totalled, for reporting over USB serial
 
 #ifndef STATES_H
 #define STATES_H
@@ -25,6 +15,26 @@
 #include "Display.h" // LCD controls
 #include "Scale.h" // Scale controls
 #include "Steppers.h" // Motor controls
+#include "Benchmark.h" // Simulated throw benchmark
+#include "Timing.h" // Charge phase timing
+#include "Profiles.h" // Saved powder calibration profiles
+#include "Storage.h" // EEPROM store
+#include "Tasks.h" // Background tasks run while waiting
+
+// State machine tracker values
+#define SETUP_STATE 0
+#define CALIBRATION_STATE 1
+#define IDLE_STATE 2
+#define READY_STATE 3
+#define DISPENSE_STATE 4 // Dispense/Run
+#define EVALUATE_STATE 5
+#define ERRORID_STATE -1 // Error identification
+#define RECOVERABLE_STATE -2 // Recoverable Error (waiting for reset)
+#define UNRECOVERABLE_STATE -3 // Unrecoverable Error (waiting for power cycle)
+#define FIRST_STATE UNRECOVERABLE_STATE // Lowest tracker value, the state table starts from it
+#define STATE_COUNT 9
+
+#define STATE_TRACE_LENGTH 32 // Changes of state kept in the trace buffer, the oldest is overwritten
 
 // Definitions
 #define ENABLE_BTN 5
@@ -34,27 +44,149 @@
 #define LONG 500
 #define SHORT 350
 
+#define BUTTON_DEBOUNCE 250 // Time in ms a button (or the enable toggle) must be held before it acts, a held up or down button repeats at this interval
+#define RECALIBRATE_HOLD 2000 // Holding both buttons in Idle state for this long requests re-calibration
+#define UP_HELD 1 // Button bits of heldButtons
+#define DOWN_HELD 2
+#define POWDER_SELECT_HOLD 500 // Holding both buttons in Idle state for at least this long, but releasing them before the recalibration hold, selects the next powder
+#define PROFILE_VERIFY_TOLERANCE 0.1 // A saved profile is used if its verification throw lands within this fraction of the weight the profile predicts
+#define QUICK_CALIBRATION true // Weigh each calibration throw and trickle on its own and stop once the estimates are confident, instead of fixed counts weighed once
+#define QUICK_BULK_MAX_THROWS 4 // Most targetWeight throws the quick bulk calibration makes
+#define QUICK_BULK_AGREEMENT 0.05 // The quick bulk calibration stops once a throw's grainsPerRev is within this fraction of the previous throw's (the first is compared with the prime)
+#define QUICK_TRICKLE_KERNELS 50 // Kernels per quick trickle calibration chunk, up to the 200 of the full calibration
+#define QUICK_KERNEL_SPREAD 0.04 // The quick trickle calibration stops once the standard deviation of the kernelWeight estimate is within this fraction of it
+#define CALIBRATION_STABILITY STABLE_HEADER // Stability mode for the quick calibration weights
+#define CALIBRATION_WEIGH_ATTEMPTS 3 // Times a calibration weight is taken before it is given up on, if the scale errors, reads below CALIBRATION_MIN_WEIGHT or does not stabilize
+#define CALIBRATION_MIN_WEIGHT -0.5 // Calibration weights below this are scale errors (-5000, -6000) or a lifted cup
+#define CALIBRATION_KERNELS 200 // Kernels the trickle calibration drops
+#define PRIME_KERNELS 40 // Kernels the trickler prime drops
+
+#define PROFILE_SNAPSHOT_CHARGES 5 // The profile in use is saved after this many charges, as well as each time the trickler returns to Idle state
+#define PROFILE_MAX_AGE 30 // Values adapted while dispensing are only restored from a profile saved within this many startups, older ones restart from the defaults
+
+// Stability mode used for StableWeight() in each state (STABLE_WINDOW restores the repeated value window for comparison)
+#define READY_STABILITY STABLE_HEADER
+#define DISPENSE_STABILITY STABLE_HEADER
+#define EVALUATE_STABILITY STABLE_HEADER
+
+#define MIN_UNSTABLE_CONFIDENCE 0.75 // Weights returned after the stability budget expired are only used at or above this confidence
+
 #define MAX_DELAY 1500
+#define CUP_REMOVED_WEIGHT GRAINS(-0.5) // A trickle is stopped once the latest sample reads below this, single samples of an empty cup can read a division or two below zero
+
+#define SETTLE_TIMING true // Wait for trickled kernels for the arrival and settle times learned from the previous trickles, instead of MAX_DELAY and a LONG stability window
+#define SETTLE_QUANTILE 0.99 // Fraction of the trickles the learned waits are long enough for
+#define SETTLE_MARGIN 100 // Time in ms added to the learned waits
+#define SETTLE_FORGETTING 0.95 // Weight kept by the earlier delays at each trickle, about the last 20 count
+#define SETTLE_ARRIVAL_DIVISIONS 2 // A burst has registered once the reading has moved this many scale divisions
+#define SETTLE_MIN_DIVISIONS 3 // Bursts adding fewer scale divisions than this are not timed
+#define SETTLE_MIN_WINDOW 150 // Shortest stability window in ms after a trickle, once it is expected to have settled
+#define SETTLE_UNTIMED 0 // Wait after a bulk pulse, MAX_DELAY and LONG are used
+#define SETTLE_BURST 1 // Wait after a fine trickle burst, its arrival and settle are learned
+#define SETTLE_CONTINUOUS 2 // Wait after a continuous trickle, which has already registered when it stops so only its settle is learned
+
+#define PREDICT_CONFIDENCE 50 // Minimum confidence in percent of a settled weight prediction (100 = last two fits agree exactly, 50 = within one division)
+#define PREDICT_MIN_REMAINING 0.3 // Predicted weight is only acted on after a trickle if more than this is left to dispense
+#define PREDICT_MIN_REMAINING_BULK 2.0 // Predicted weight is only acted on after a bulk pulse if more than this is left to dispense
+
+#define CONTINUOUS_TRICKLE true // Trickle large remainders continuously, tapering the speed from the streaming weight, instead of in fixed kernel bursts
+#define CONTINUOUS_MIN_REMAINING 0.4 // Remainders of this or more (in grains) are trickled continuously
+#define CONTINUOUS_TAPER 1.0 // Speed is limited so the kernels in flight weigh at most this fraction of the predicted remaining weight
+#define CONTINUOUS_MIN_SPEED 20 // Slowest continuous trickle speed in rotations per minute * 10 (~2 kernels per second)
+#define CONTINUOUS_LAG 400 // Time in ms for a dropped kernel to register on the scale, used to estimate the kernels still in flight
+#define CONTINUOUS_MAX_KERNELS 1.25 // Safety stop once the motor has dropped this multiple of the kernels the calibrated kernelWeight expects for the remainder
+
+#define PIPELINED_DISPENSE true // Start the trickler while the bulk is retracting, dropping a conservative share of the residual the bulk pulse is expected to leave
+#define PIPELINE_BULK_ERROR 0.06 // Fraction of a bulk pulse it may overthrow by, kept in reserve when sizing the pipelined trickle
+#define PIPELINE_MAX_KERNELS 10 // Most kernels pipelined with a bulk pulse, about the time the bulk takes to retract and its powder to land
+#define PIPELINE_MAX_NOISE 0.5 // Kernels are only pipelined behind the first bulk pulse while the scale's noise estimate is below this many divisions
+
+#define BULK_CLOSED_LOOP true // Cut the first bulk pulse off from the streaming weight instead of running a fixed fraction of the steps
+#define BULK_CLOSED_LOOP_RESIDUAL 0.8 // Grains the closed loop first bulk pulse aims to leave for the trickler
+#define BULK_FALL_LATENCY 400 // Starting estimate in ms from powder leaving the bulk disk to it registering on the scale, learned after each pulse
+#define BULK_LATENCY_GAIN 0.5 // Fraction of the measured latency error applied after each closed loop pulse
+#define BULK_MIN_LATENCY 100 // Range in ms the learned latency is kept within
+#define BULK_MAX_LATENCY 1500
+#define BULK_MAX_EXTEND 0.15 // Fraction of the planned steps the closed loop may extend a pulse by, in case the scale stops responding
+#define BULK_RETARGET_STEPS 20 // The pulse is only retargeted when its end moves by more than this many steps
+
+#define BULK_PLANNER true // Size the bulk pulses from the measured spread of what they deliver, instead of the fixed closed loop residual and secondBulkCalibration
+#define BULK_MAX_OVERTHROW 0.005 // Largest chance a planned bulk pulse (with its pipelined kernels) may go past the target by itself
+#define BULK_PLAN_FORGETTING 0.97 // Weight kept by the previous bulk statistics at each pulse, about the last 30 pulses count
+#define BULK_PLAN_WARMUP 4 // Closed loop pulses after a calibration the planner does not learn from, while bulkLatency converges from BULK_FALL_LATENCY
+#define BULK_PLAN_FLOOR 0.05 // Spread in grains of any pulse however small, from the scale division and the kernels it ends on
+#define BULK_MIN_RESIDUAL 0.45 // Least weight in grains a planned pulse is expected to leave after its pipelined kernels, enough for a continuous trickle (CONTINUOUS_MIN_REMAINING)
+#define BULK_MAX_RESIDUAL 2.0 // Most weight in grains the planned closed loop first pulse leaves for the trickler
+#define BULK_PLAN_REACH 0.1 // Largest planned second pulse as a fraction over the last one measured, so the plan only moves gradually away from the sizes its statistics describe
+#define SECOND_PULSE_TOP_UP 0 // Second bulk pulse topping up after the closed loop first pulse, part of what it turns refills behind the retraction
+#define SECOND_PULSE_ONLY 1 // Second stage bulk pulse of a charge too small for the closed loop first pulse, the only one it makes
+#define SECOND_PULSE_KINDS 2 // The planner keeps separate statistics for each kind
+#define BULK_PULSE_TIME 2100 // Starting estimate in ms of a second bulk pulse, from starting it to its weight being measured, learned after each pulse
+#define TRICKLE_RATE 0.35 // Starting estimate of the trickle rate in grains per second (including settling between bursts), learned after each charge
+#define TRICKLE_PLANNER true // Size fine trickle bursts from the learned kernelWeight and slot spread, instead of the fixed extra and fewer kernel rules
+#define TRICKLE_MAX_OVERTHROW 0.02 // Largest chance a planned fine trickle burst may go more than the error margin past the target
+#define PLAN_TIME_GAIN 0.2 // Fraction of its measured error the pulse time and trickle rate estimates move by after each charge
 
 #define RETRACT_STEPS 250
 #define RECOVERY_STEPS 50
 
 #define STAGE_TWO_DEFAULT 0.7
+#define STAGE_TWO_MIN 0.3 // Range of secondBulkCalibration a saved profile may restore
+#define STAGE_TWO_MAX 0.95
 
 #define GREEN_LED 14
 #define YELLOW_LED 15
 #define RED_LED 16
 
+#define SETTINGS_KEY 1 // Storage key of the settings
+
+// Fixed EEPROM addresses older firmware saved the settings at, only read to move them into the store
 #define TARGET_MEMORY_ADDR 0
 #define VERSION_MEMORY_ADDR 10
 #define DIRECTION_MEMORY_ADDR 20
 
+// Settings
+// Values kept between power cycles
+typedef struct
+{
+  float targetWeight;
+  float versionNumber; // Firmware version that did the first time setup
+  int motorDirection;
+  byte powderSlot;
+  byte startups; // Times the trickler has started, wrapping around, used to tell the age of a saved profile
+} Settings;
+
+// StateHandlers
+// One row of the state table
+typedef struct
+{
+  int state; // Tracker value, rows are in tracker value order from FIRST_STATE
+  const char* name;
+  void (*enter)(); // Run on entering the state, before its first tick (may be null)
+  int (*tick)(); // Run once per pass of the main loop, returns the next state
+  void (*exit)(); // Run on leaving the state (may be null)
+  unsigned int exits; // STATE_BIT() of each state the tick may return, other than its own
+  bool storageWrites; // EEPROM writes are allowed while in the state
+} StateHandlers;
+
+#define STATE_BIT(state) (1U << ((state) - FIRST_STATE))
+
 // Error tracker values
 // 0 = No error
 // 1 = Scale response timed out (recoverable)
 // 2 = Scale response includes out of range characters (unrecoverable, fix scale configuration)
+// 3 = Scale response < -0.5 after bulk is completed
+// 4 = A state returned a state the state table does not allow it to exit to (unrecoverable)
 //int error = 0;
 
+// State machine
+void StartStateMachine();
+void RunStateMachine();
+int CurrentState();
+void PrintStateTrace();
+void PrintStateTimes();
+void ResetStateTimes();
+
 // State functions
 int CalibrationState();
 int IdleState();
@@ -64,28 +196,54 @@ int EvaluateState();
 
 int ErrorIdState();
 int RecoverableErrorState();
-void UnrecoverableErrorState();
+int UnrecoverableErrorState();
 
-void changeTarget(float weightDiff);
+void changeTarget(Weight weightDiff);
 
 bool isEnabled();
 bool upPressed();
 bool downPressed();
 
-bool bulkThrow(float grains, bool forceContinue = false);
-
-bool waitForBulk(bool forceContinue = false);
+bool bulkThrow(Weight weight, bool forceContinue = false, int trickleKernels = 0, Weight cutoffWeight = 0);
+bool throwBulkPlan(Weight weight, bool forceContinue, int trickleKernels, Weight cutoffWeight);
+int secondBulkPulse(byte kind, float secondFraction, Weight startingWeightDiff, Weight* weightDiff);
+bool closedLoopBulk(unsigned int handle, long plannedSteps, Weight cutoffWeight, bool forceContinue);
+void learnBulkLatency(Weight settledWeight);
+int pipelineKernels(Weight expectedResidual, Weight allowance);
+int plannedTrickleKernels(Weight weightDiff);
+
+void resetBulkPlanner();
+float firstBulkAllowance();
+float firstBulkResidual();
+bool secondBulkPlanned(byte kind);
+float secondBulkFraction(byte kind, float weightDiff, float legacyMinimum);
+float secondBulkAllowance(byte kind, float grains);
+void observeFirstBulk(float cutoffError);
+void observeSecondBulk(byte kind, float planned, float delivered, unsigned long duration);
+void learnTrickleRate(Weight finalWeight);
+void PrintBulkPlanner();
+
+bool waitForBulk(bool forceContinue = false, unsigned int handle = 0);
 bool waitForTrickle();
-
-void increaseBulkCalibration();
-void smallIncreaseBulkCalibration();
-void decreaseBulkCalibration();
-void smallDecreaseBulkCalibration();
-void increaseTrickleCalibration();
-void smallIncreaseTrickleCalibration();
-void decreaseTrickleCalibration();
-void smallDecreaseTrickleCalibration();
-void tinyDecreaseTrickleCalibration();
+int continuousTrickle(Weight startWeight);
+
+bool stableEnough();
+bool calibrationWeight(int durationMillis, byte mode, float* weight);
+bool overthrown(Weight weightDiff);
+bool predictSettledWeight(unsigned long since, Weight minWeight, Weight minRemaining, Weight* weight, byte timing = SETTLE_UNTIMED);
+unsigned long settleWait(RunningStats* stats);
+int settleWindow(unsigned long since);
+void observeSettle(bool arrived, unsigned long arrival, bool settled, unsigned long settle);
+void PrintSettleTiming();
+Weight measureCharge(int durationMillis);
+
+bool loadSettings();
+void saveSettings();
+
+bool loadProfile();
+void saveProfile();
+int calibrationSetup();
+int calibrationResults();
 
 
 #endif // STATES_H
\ No newline at end of file
@@ -3,17 +3,60 @@
 
 // Include the header file
 #include "Steppers.h"
+#include "Scale.h" // Scale divisions
 
 // MoToStepper objects
 MoToStepper trickler(STEPS_PER_REV, STEPDIR);
 MoToStepper bulk(STEPS_PER_REV, STEPDIR);
 
-// Calibration parameters
-static float kernelWeight = 0.021; // Weight of single kernel in grains for trickler
-static float grainsPerRev = 65.00; // Weight of powder dumped by bulk in one full revolution
+// Calibration parameters, estimated from every observed trickle and bulk pulse
+static Estimator kernelWeight = {0.021, (0.021 * KERNEL_PRIOR_SPREAD) * (0.021 * KERNEL_PRIOR_SPREAD), 0}; // Weight of single kernel in grains for trickler
+static RunningStats slotSpread; // Variance of the weight of a single slot, from how far each trickle landed from the kernelWeight estimate
+static Estimator grainsPerRev = {65.00, (65.00 * BULK_PRIOR_SPREAD) * (65.00 * BULK_PRIOR_SPREAD), 0}; // Weight of powder dumped by bulk in one full revolution
 
 int stepperMotorDirection = 1;
 
+// MotionQueue
+// Segments waiting to run on one motor
+// Every segment gets a sequence number when queued, a plan's handle is the sequence number of its last segment
+typedef struct
+{
+  MoToStepper* stepper;
+  MotionSegment segments[MOTION_QUEUE_LENGTH];
+  byte head; // Index of the next segment to start
+  byte count; // Segments waiting to start
+  bool running; // A segment has been handed to the stepper and has not finished
+  int runningRamp; // Ramp length of the running segment
+  long target; // Absolute position the running segment ends at
+  unsigned int queued; // Sequence number of the last segment queued
+  unsigned int started; // Sequence number of the last segment handed to the stepper
+  unsigned int completed; // Sequence number of the last segment finished
+} MotionQueue;
+
+static MotionQueue queues[2] = {{&bulk}, {&trickler}};
+
+// Emergency stop, set by the enable switch interrupt
+static volatile bool stopArmed = false;
+static volatile bool stopLatched = false;
+static volatile unsigned long stopTime = 0; // micros() the interrupt cut the drivers
+static byte stopPin = 0; // Enable switch pin
+static bool stopHandled = false; // The step pulses have been stopped since the latch was set
+static bool stopCutMotion = false; // A motor was running when the step pulses were stopped
+static bool stopConfirmed = false; // The switch has read off after STOP_BOUNCE_WINDOW, so the stop is not a bounce
+static unsigned long stopOffTime = 0; // micros() the switch last read off since the latch
+static bool stopSeen = false; // The state machine has seen the latch
+
+// Emergency stop statistics
+static unsigned int stopCount = 0;
+static unsigned long stopPulseMax = 0; // Longest time in us from the interrupt to the step pulses stopping
+static unsigned long stopPulseTotal = 0;
+static unsigned long stopSeenMax = 0; // Longest time in ms from the interrupt to the state machine seeing the latch
+
+static void updateQueue(MotionQueue* queue);
+static void clearQueue(MotionQueue* queue);
+static void enableSwitchISR();
+static void releaseStop();
+
 // MotorSetup()
 // Attachs motor pins and enable pins for MoToStepper objects
 void MotorSetup()
@@ -36,10 +79,18 @@ void MotorSetup()
 // Returns the step target that was given to the trickler stepper
 int TrickleDispense(int kernels)
 {
+  // Nothing moves after an emergency stop until the state machine clears it
+  if(stopLatched)
+  {
+    return 0;
+  }
+
   // Calculate required steps
   int steps = (STEPS_PER_REV / KERNELS_PER_REV) * kernels;
 
-  // Command motor to begin moving the calculated number of steps
+  // Command motor to begin moving the calculated number of steps, at full speed in case a continuous trickle slowed it down
+  clearQueue(&queues[MOTION_TRICKLE]);
+  trickler.setSpeed(TRICKLE_SPEED);
   trickler.move(stepperMotorDirection * steps);
 
   return steps;
@@ -49,16 +100,41 @@ int TrickleDispense(int kernels)
 // Immediately end the current trickle
 void EndTrickle()
 {
+  clearQueue(&queues[MOTION_TRICKLE]);
   trickler.move(0);
 }
 
+// TrickleRun()
+// Runs the trickler continuously in the dispensing direction at the given speed (rotations per minute * 10)
+// May be called again while running to change the speed, the change is ramped over TRICKLE_RAMP steps
+void TrickleRun(int speed)
+{
+  // Nothing moves after an emergency stop until the state machine clears it
+  if(stopLatched)
+  {
+    return;
+  }
+
+  clearQueue(&queues[MOTION_TRICKLE]);
+  trickler.setSpeed(speed);
+  trickler.rotate(stepperMotorDirection);
+}
+
+// TrickleStop()
+// Ramps a continuously running trickler to a stop, IsTrickling() stays true until it has stopped
+void TrickleStop()
+{
+  trickler.rotate(0);
+}
+
 // IsTrickling()
 // Returns true if trickle motor is currently moving, false if it isn't
 bool IsTrickling()
 {
+  updateQueue(&queues[MOTION_TRICKLE]);
   long moving = trickler.stepsToDo();
 
-  if(moving > 0)
+  if(moving > 0 || queues[MOTION_TRICKLE].count > 0)
   {
     return true;
   }
@@ -72,22 +148,40 @@ bool IsTrickling()
 // Starts the bulk dispenser rotating in positive direction to dispense a targeted weight
 void BulkDispense(float targetWeight, int recover)
 {
-  // Calculate the number of revs based on targetWeight and grainsPerRev
-  float targetRevs = targetWeight / grainsPerRev;
-  float targetSteps = targetRevs * STEPS_PER_REV;
+  // Nothing moves after an emergency stop until the state machine clears it
+  if(stopLatched)
+  {
+    return;
+  }
 
   // Adjust the targetSteps based on retraction distance (must add the retraction distance back onto the next dispense)
-  targetSteps = targetSteps + recover;
+  long targetSteps = BulkSteps(GrainsToWeight(targetWeight)) + recover;
 
   // Trigger bulk to move that many steps
+  clearQueue(&queues[MOTION_BULK]);
   bulk.move(stepperMotorDirection * targetSteps);
 }
 
+// BulkSteps()
+// Returns the number of steps the bulk dispenser turns to dispense a targeted weight, based on grainsPerRev
+long BulkSteps(Weight targetWeight)
+{
+  // Calculate the number of steps based on targetWeight and the weight of a revolution, 250gr fits a long with room to spare
+  return (targetWeight * STEPS_PER_REV) / GetBulkRevWeight();
+}
+
 // BulkRetract()
 // Starts the bulk dispenser rotating in negative direction to retract the bulk dispenser by a given number of steps
 void BulkRetract(int steps)
 {
+  // Nothing moves after an emergency stop until the state machine clears it
+  if(stopLatched)
+  {
+    return;
+  }
+
   // Turn the steps value negative before moving the desired number of steps
+  clearQueue(&queues[MOTION_BULK]);
   bulk.move((-stepperMotorDirection) * steps);
 }
 
@@ -95,25 +189,111 @@ void BulkRetract(int steps)
 // Moves the bulk dispense disk 150 steps backwards from current position (to avoid bumps dumping extra kernels)
 void EndBulk()
 {
+  clearQueue(&queues[MOTION_BULK]);
   bulk.move(0);
 }
 
+// GetKernelWeight()
+// Returns the kernelWeight used for dispensing, the estimate plus CALIBRATION_CONFIDENCE standard deviations of its uncertainty
 float GetKernelWeight()
 {
-  return kernelWeight;
+  return kernelWeight.value + (CALIBRATION_CONFIDENCE * EstimatorStdDev(&kernelWeight));
+}
+// SetKernelWeight()
+// Starts the kernelWeight estimate over from a new value and its standard deviation, KERNEL_PRIOR_SPREAD of the value if none is given
+void SetKernelWeight(float newValue, float uncertainty)
+{
+  if(uncertainty <= 0)
+  {
+    uncertainty = newValue * KERNEL_PRIOR_SPREAD;
+  }
+
+  EstimatorReset(&kernelWeight, newValue, sq(uncertainty));
+  StatsReset(&slotSpread);
+}
+
+// ObserveKernels()
+// Refines the kernelWeight estimate from the weight a trickle of the given number of kernels dropped
+// Each slot adds its own spread to the observation, and the weight is the difference of two scale readings
+void ObserveKernels(int kernels, float grains)
+{
+  // Each trickle's miss, less what the estimate and the two readings account for, is a sample of the variance of a slot
+  if(kernels >= SLOT_SPREAD_MIN_KERNELS)
+  {
+    float miss = grains - (kernels * kernelWeight.value);
+    float sample = (sq(miss) - (sq(kernels) * kernelWeight.variance) - (sq(SCALE_DIVISION) / 6)) / kernels;
+    StatsObserve(&slotSpread, sample, SLOT_SPREAD_FORGETTING);
+  }
+
+  float noise = (kernels * sq(GetSlotSpread())) + (2 * sq(SCALE_DIVISION));
+  if(!EstimatorObserve(&kernelWeight, kernels, grains, noise))
+  {
+    Serial.println("Trickle far from the kernelWeight estimate, restarting the estimate around it");
+  }
+
+  Serial.print("kernelWeight estimate = ");
+  Serial.print(kernelWeight.value, 6);
+  Serial.print(" +/- ");
+  Serial.print(EstimatorStdDev(&kernelWeight), 6);
+  Serial.print(", slot spread = ");
+  Serial.println(GetSlotSpread(), 6);
+}
+
+// GetKernelEstimate()
+// Returns the kernelWeight estimate, without the margin GetKernelWeight() adds
+float GetKernelEstimate()
+{
+  return kernelWeight.value;
+}
+
+// GetKernelUncertainty()
+// Returns the standard deviation of the kernelWeight estimate
+float GetKernelUncertainty()
+{
+  return EstimatorStdDev(&kernelWeight);
+}
+
+// GetKernelWeightFixed()
+// Returns GetKernelWeight() as a Weight with KERNEL_WEIGHT_BITS fractional bits, rounded to the nearest
+long GetKernelWeightFixed()
+{
+  return (GetKernelWeight() * CENTIGRAINS_PER_GRAIN * (1L << KERNEL_WEIGHT_BITS)) + 0.5;
 }
-void SetKernelWeight(float newValue)
+
+// KernelsToWeight()
+// Returns the weight of the given number of kernels of a fixed point kernelWeight, rounded to the nearest centigrain
+Weight KernelsToWeight(long kernels, long kernelWeightFixed)
 {
-  kernelWeight = newValue;
+  return ((kernels * kernelWeightFixed) + (1L << (KERNEL_WEIGHT_BITS - 1))) >> KERNEL_WEIGHT_BITS;
+}
+
+// GetSlotSpread()
+// Returns the standard deviation of the weight one slot drops, KERNEL_OBSERVATION_SPREAD of the kernelWeight until enough trickles have been seen
+float GetSlotSpread()
+{
+  if(!SlotSpreadReady())
+  {
+    return KERNEL_OBSERVATION_SPREAD * kernelWeight.value;
+  }
+
+  return sqrt(max(slotSpread.mean, sq(SCALE_DIVISION) / 12));
+}
+
+// SlotSpreadReady()
+// Returns true once the slot spread has been learned from enough trickles
+bool SlotSpreadReady()
+{
+  return StatsReady(&slotSpread);
 }
 
 // IsBulk()
 // Returns true if bulk motor is currently moving, false if it isn't
 bool IsBulking()
 {
+  updateQueue(&queues[MOTION_BULK]);
   long moving = bulk.stepsToDo();
 
-  if(moving > 0)
+  if(moving > 0 || queues[MOTION_BULK].count > 0)
   {
     return true;
   }
@@ -123,21 +303,229 @@ bool IsBulking()
   }
 }
 
+// GetBulkWeight()
+// Returns the grainsPerRev used for dispensing, the estimate plus CALIBRATION_CONFIDENCE standard deviations of its uncertainty
 float GetBulkWeight()
 {
-  return grainsPerRev;
+  return grainsPerRev.value + (CALIBRATION_CONFIDENCE * EstimatorStdDev(&grainsPerRev));
 }
-void SetBulkWeight(float newValue)
+// SetBulkWeight()
+// Starts the grainsPerRev estimate over from a new value and its standard deviation, BULK_PRIOR_SPREAD of the value if none is given
+void SetBulkWeight(float newValue, float uncertainty)
 {
-  grainsPerRev = newValue;
+  if(uncertainty <= 0)
+  {
+    uncertainty = newValue * BULK_PRIOR_SPREAD;
+  }
+
+  EstimatorReset(&grainsPerRev, newValue, sq(uncertainty));
+}
+
+// ObserveBulk()
+// Refines the grainsPerRev estimate from the weight a bulk dispense of the given number of steps dropped
+void ObserveBulk(long steps, float grains)
+{
+  float revs = (float)steps / STEPS_PER_REV;
+  float noise = sq(BULK_OBSERVATION_SPREAD * grains) + (2 * sq(SCALE_DIVISION));
+  if(!EstimatorObserve(&grainsPerRev, revs, grains, noise))
+  {
+    Serial.println("Bulk pulse far from the grainsPerRev estimate, restarting the estimate around it");
+  }
+
+  Serial.print("grainsPerRev estimate = ");
+  Serial.print(grainsPerRev.value, 4);
+  Serial.print(" +/- ");
+  Serial.println(EstimatorStdDev(&grainsPerRev), 4);
+}
+
+// GetBulkEstimate()
+// Returns the grainsPerRev estimate, without the margin GetBulkWeight() adds
+float GetBulkEstimate()
+{
+  return grainsPerRev.value;
+}
+
+// GetBulkUncertainty()
+// Returns the standard deviation of the grainsPerRev estimate
+float GetBulkUncertainty()
+{
+  return EstimatorStdDev(&grainsPerRev);
+}
+
+// GetBulkRevWeight()
+// Returns GetBulkWeight() as the Weight of one revolution, rounded to the nearest centigrain
+Weight GetBulkRevWeight()
+{
+  return GrainsToWeight(GetBulkWeight());
 }
 
 void StopMotors()
 {
+  clearQueue(&queues[MOTION_BULK]);
+  clearQueue(&queues[MOTION_TRICKLE]);
   trickler.rotate(0);
   bulk.rotate(0);
 }
 
+// QueueMotion()
+// Adds a plan of segments to the end of a motor's queue, starting it straight away if the motor is idle
+// Returns a handle for MotionDone(), the handle of the plan's n-th segment (counting from 0) is the returned value - (count - 1 - n)
+// Returns 0 without queueing anything if there is not room for the whole plan, or after an emergency stop
+unsigned int QueueMotion(byte motor, const MotionSegment* segments, byte count)
+{
+  MotionQueue* queue = &queues[motor];
+  updateQueue(queue);
+
+  // Nothing moves after an emergency stop until the state machine clears it
+  if(stopLatched || count == 0 || queue->count + count > MOTION_QUEUE_LENGTH)
+  {
+    return 0;
+  }
+
+  for(byte i = 0; i < count; i++)
+  {
+    queue->segments[(queue->head + queue->count) % MOTION_QUEUE_LENGTH] = segments[i];
+    queue->count++;
+
+    // Skip 0, it is the "nothing queued" handle
+    queue->queued++;
+    if(queue->queued == 0)
+    {
+      queue->queued = 1;
+    }
+  }
+
+  updateQueue(queue);
+  return queue->queued;
+}
+
+// MotionDone()
+// Returns true once the segment with the given handle, and everything queued before it, has finished
+bool MotionDone(byte motor, unsigned int handle)
+{
+  MotionQueue* queue = &queues[motor];
+  updateQueue(queue);
+
+  // Wrap-safe comparison of sequence numbers
+  return (int)(queue->completed - handle) >= 0;
+}
+
+// MotionRemaining()
+// Returns the steps left in the segment with the given handle, or -1 if it is not the segment running
+long MotionRemaining(byte motor, unsigned int handle)
+{
+  MotionQueue* queue = &queues[motor];
+  updateQueue(queue);
+
+  if(!queue->running || queue->started != handle)
+  {
+    return -1;
+  }
+
+  return stepperMotorDirection * (queue->target - queue->stepper->readSteps());
+}
+
+// RetargetMotion()
+// Moves the end of the running segment with the given handle to a number of steps from the current position, extending or truncating it
+// Segments queued after it are chained from the new end, returns false if the segment is not running
+bool RetargetMotion(byte motor, unsigned int handle, long steps)
+{
+  MotionQueue* queue = &queues[motor];
+  updateQueue(queue);
+
+  if(!queue->running || queue->started != handle)
+  {
+    return false;
+  }
+
+  queue->target = queue->stepper->readSteps() + (stepperMotorDirection * steps);
+  queue->stepper->moveTo(queue->target);
+
+  return true;
+}
+
+// MotionUpdate()
+// Starts the next segment on any motor whose running segment is finishing
+void MotionUpdate()
+{
+  updateQueue(&queues[MOTION_BULK]);
+  updateQueue(&queues[MOTION_TRICKLE]);
+}
+
+// updateQueue()
+// Hands the next segment to the stepper once the running one is within its ramp of the end
+// The next target is given while the motor is still ramping down, so it changes direction or carries on without stopping and its enable output stays on
+static void updateQueue(MotionQueue* queue)
+{
+  bool chained = false;
+  if(queue->running)
+  {
+    long remaining = queue->stepper->stepsToDo();
+
+    // Still running, or finishing with nothing to follow it
+    if(remaining > queue->runningRamp || (remaining > 0 && queue->count == 0))
+    {
+      return;
+    }
+
+    queue->running = false;
+    queue->completed = queue->started;
+    chained = true;
+  }
+
+  if(queue->count == 0)
+  {
+    return;
+  }
+
+  // Segments are chained from the end of the previous one, or from where the motor is if it was idle
+  if(!chained)
+  {
+    queue->target = queue->stepper->readSteps();
+  }
+
+  MotionSegment* segment = &queue->segments[queue->head];
+  queue->head = (queue->head + 1) % MOTION_QUEUE_LENGTH;
+  queue->count--;
+
+  queue->target += stepperMotorDirection * segment->steps;
+  queue->stepper->setSpeed(segment->speed);
+  queue->stepper->setRampLen(segment->ramp);
+  queue->stepper->moveTo(queue->target);
+
+  queue->runningRamp = segment->ramp;
+  queue->started++;
+  if(queue->started == 0)
+  {
+    queue->started = 1;
+  }
+  queue->running = true;
+}
+
+// clearQueue()
+// Drops the queued segments and marks everything queued as finished, used when a motor is commanded directly or stopped
+static void clearQueue(MotionQueue* queue)
+{
+  queue->count = 0;
+  queue->running = false;
+  queue->started = queue->queued;
+  queue->completed = queue->queued;
+}
+
+// GetBulkPosition()
+// Returns the bulk motor position in steps, positive in the dispensing direction
+long GetBulkPosition()
+{
+  return stepperMotorDirection * bulk.readSteps();
+}
+
+// GetTricklePosition()
+// Returns the trickle motor position in steps, positive in the dispensing direction
+long GetTricklePosition()
+{
+  return stepperMotorDirection * trickler.readSteps();
+}
+
 bool SetMotorDirection(int direction)
 {
   if(direction > 0 )
@@ -151,4 +539,164 @@ bool SetMotorDirection(int direction)
     return false;
   }
 
-}
\ No newline at end of file
+}
+
+// EmergencyStopSetup()
+// Attaches the interrupt that cuts the motor drivers when the enable switch on the given pin turns off
+void EmergencyStopSetup(byte pin)
+{
+  stopPin = pin;
+  attachInterrupt(digitalPinToInterrupt(pin), enableSwitchISR, FALLING);
+  stopArmed = true;
+}
+
+// ArmEmergencyStop()
+// Allows or stops the enable switch interrupt cutting the motor drivers
+void ArmEmergencyStop(bool armed)
+{
+  stopArmed = armed;
+}
+
+// EmergencyStopUpdate()
+// Once the interrupt has cut the drivers, stops the step pulses and clears the queued motion so nothing turns the motors back on
+// A stop that cut no motion is released again if the switch reads steadily on, a toggle bouncing as it is turned on gives the interrupt a falling edge
+void EmergencyStopUpdate()
+{
+  if(!stopLatched)
+  {
+    return;
+  }
+
+  if(stopHandled)
+  {
+    if(stopCutMotion || stopConfirmed)
+    {
+      return;
+    }
+
+    unsigned long now = micros();
+    if(!digitalRead(stopPin))
+    {
+      stopOffTime = now;
+      stopConfirmed = (now - stopTime) > (STOP_BOUNCE_WINDOW * 1000UL);
+    }
+    else if((now - stopOffTime) >= (STOP_DEBOUNCE * 1000UL))
+    {
+      Serial.println("Enable switch bounced on, emergency stop released");
+      releaseStop();
+    }
+    return;
+  }
+
+  stopCutMotion = queues[MOTION_BULK].running || queues[MOTION_TRICKLE].running || trickler.stepsToDo() || bulk.stepsToDo();
+  stopConfirmed = false;
+  stopOffTime = stopTime;
+
+  clearQueue(&queues[MOTION_BULK]);
+  clearQueue(&queues[MOTION_TRICKLE]);
+  trickler.stop();
+  bulk.stop();
+  stopHandled = true;
+
+  unsigned long latency = micros() - stopTime;
+  stopCount++;
+  stopPulseTotal += latency;
+  if(latency > stopPulseMax)
+  {
+    stopPulseMax = latency;
+  }
+
+  Serial.print("Emergency stop, drivers cut by the enable switch and step pulses stopped ");
+  Serial.print(latency);
+  Serial.println("us later");
+}
+
+// EmergencyStopped()
+// Returns true from the enable switch turning off until ClearEmergencyStop(), even if the switch has been turned back on
+// A stop that cut no motion ends early if EmergencyStopUpdate() finds it was the switch bouncing on
+bool EmergencyStopped()
+{
+  if(!stopLatched)
+  {
+    return false;
+  }
+
+  if(!stopSeen)
+  {
+    unsigned long latency = (micros() - stopTime) / 1000;
+    if(latency > stopSeenMax)
+    {
+      stopSeenMax = latency;
+    }
+    stopSeen = true;
+  }
+
+  return true;
+}
+
+// ClearEmergencyStop()
+// Re-arms the interrupt for the next switch off, called once the state machine is at rest with the switch off
+void ClearEmergencyStop()
+{
+  if(!stopLatched)
+  {
+    return;
+  }
+
+  // Stop the motors even if RunTasks() has not run since the interrupt
+  EmergencyStopUpdate();
+
+  releaseStop();
+}
+
+// PrintEmergencyStopStats()
+// Prints how quickly the emergency stops since the statistics were reset took effect
+void PrintEmergencyStopStats()
+{
+  Serial.print("Emergency stops = ");
+  Serial.print(stopCount);
+  Serial.print(", step pulses stopped within ");
+  Serial.print(stopPulseMax);
+  Serial.print("us (mean ");
+  Serial.print(stopCount ? (stopPulseTotal / stopCount) : 0);
+  Serial.print("us), state machine responded within ");
+  Serial.print(stopSeenMax);
+  Serial.println("ms");
+}
+
+// ResetEmergencyStopStats()
+// Clears the emergency stop statistics
+void ResetEmergencyStopStats()
+{
+  stopCount = 0;
+  stopPulseMax = 0;
+  stopPulseTotal = 0;
+  stopSeenMax = 0;
+}
+
+// releaseStop()
+// Clears the latch, re-arming the interrupt for the next switch off
+static void releaseStop()
+{
+  stopHandled = false;
+  stopSeen = false;
+  stopLatched = false;
+}
+
+// enableSwitchISR()
+// Runs when the enable switch turns off, disabling both drivers straight away whatever the main loop is doing
+// Every falling edge cuts the drivers, EmergencyStopUpdate() sorts out the ones that were the switch bouncing on
+static void enableSwitchISR()
+{
+  if(!stopArmed || stopLatched)
+  {
+    return;
+  }
+
+  // The enable outputs are active low, MobaTools turns them back on when the next move starts
+  digitalWrite(TRICKLE_ENABLE, HIGH);
+  digitalWrite(BULK_ENABLE, HIGH);
+
+  stopTime = micros();
+  stopLatched = true;
+}
@@ -9,6 +9,10 @@
 #include <Arduino.h> // Standard Arduino libraries
 #include <MobaTools.h> // Stepper motor control
 
+// Internal libraries
+#include "Estimator.h" // Calibration estimators
+#include "Scale.h" // Weights in centigrains
+
 // Conversion and calibration constants
 #define STEPS_PER_REV 6400 // Using 1/32 microstepping we have 200 * 32 steps per revolution
 #define KERNELS_PER_REV 64 // There are 64 slots in the disk so 64 kernels to be dropped in a full turn
@@ -16,6 +20,16 @@
 #define DEFAULT_KERNEL_WEIGHT 0.021 // Default kernel weight of 0.021 is a conservative estimate for Varget (actual is usually 0.18-0.2)
 #define DEFAULT_BULK_WEIGHT 65.00 // Default weight of 65gr of powder dumped by bulk dispense in one full revolution
 
+// Calibration estimators
+#define CALIBRATION_CONFIDENCE 1.0 // Standard deviations of estimate uncertainty added to the kernelWeight and grainsPerRev in use, so a new estimate errs towards underthrowing
+#define KERNEL_PRIOR_SPREAD 0.2 // Relative standard deviation of kernelWeight when it is set without observations
+#define BULK_PRIOR_SPREAD 0.1 // Relative standard deviation of grainsPerRev when it is set without observations
+#define KERNEL_OBSERVATION_SPREAD 0.3 // Relative standard deviation of the weight one trickler slot drops (kernel size plus empty and double slots)
+#define BULK_OBSERVATION_SPREAD 0.03 // Relative standard deviation of the weight of a bulk pulse
+#define SLOT_SPREAD_MIN_KERNELS 4 // Trickles of fewer kernels than this are too dominated by the scale divisions to measure the slot spread
+#define SLOT_SPREAD_FORGETTING 0.95 // Weight kept by the earlier slot spread samples each trickle, so the spread follows the powder through a session
+#define KERNEL_WEIGHT_BITS 10 // Fractional bits of the fixed point kernelWeight the dispense plans with, a Weight in 1/1024ths of a centigrain
+
 // Stepper control pin definitions
 #define TRICKLE_ENABLE 4 // Pin 4
 #define TRICKLE_DIR 2 // Pin 2
@@ -29,6 +43,23 @@
 #define BULK_SPEED 187 // Max speed of 18.7 rotations per minute, or ~1,995 steps per second
 #define BULK_RAMP 10 // Ramp length of 10 steps for any speed changes (short, targeting ~0.02s or less)
 
+// Emergency stop
+#define STOP_DEBOUNCE 20 // Time in ms the enable switch must read on for a stop latched with nothing moving to be taken as a bounce
+#define STOP_BOUNCE_WINDOW 100 // Time in ms after the interrupt that the switch can still read off during a bounce, reading off later confirms the stop
+
+// Motion queue
+#define MOTION_BULK 0 // Motor index of the bulk dispenser
+#define MOTION_TRICKLE 1 // Motor index of the trickler
+#define MOTION_QUEUE_LENGTH 4 // Segments that can be waiting on each motor
+
+// MotionSegment
+// One move of a motion plan
+typedef struct
+{
+  long steps; // Steps to move, positive in the dispensing direction
+  int speed; // Speed in rotations per minute * 10
+  int ramp; // Ramp length in steps
+} MotionSegment;
 
 void MotorSetup();
 
@@ -38,6 +69,9 @@ int TrickleDispense(int kernels);
 void EndTrickle();
 // Determine if trickle is dispensing
 bool IsTrickling();
+// Run the trickler continuously at a variable speed
+void TrickleRun(int speed);
+void TrickleStop();
 
 // Begin running bulk dispense motor
 void BulkDispense(float targetWeight, int recover);
@@ -48,13 +82,57 @@ void EndBulk();
 bool IsBulking();
 
 float GetKernelWeight();
-void SetKernelWeight(float newValue);
+void SetKernelWeight(float newValue, float uncertainty = 0);
+// Refine kernelWeight from the weight a trickle of the given number of kernels dropped
+void ObserveKernels(int kernels, float grains);
+float GetKernelEstimate();
+float GetKernelUncertainty();
+// kernelWeight as a fixed point Weight, and the weight of a number of kernels of a fixed point kernelWeight, so a burst is planned in integer arithmetic
+long GetKernelWeightFixed();
+Weight KernelsToWeight(long kernels, long kernelWeightFixed);
+// Standard deviation of the weight one slot drops, learned from the trickles since the kernelWeight was last set
+float GetSlotSpread();
+bool SlotSpreadReady();
 
 float GetBulkWeight();
-void SetBulkWeight(float newValue);
+void SetBulkWeight(float newValue, float uncertainty = 0);
+// Refine grainsPerRev from the weight a bulk dispense of the given number of steps dropped
+void ObserveBulk(long steps, float grains);
+float GetBulkEstimate();
+float GetBulkUncertainty();
+// grainsPerRev as a Weight per revolution, a weight of steps is then rev weight * steps / STEPS_PER_REV
+Weight GetBulkRevWeight();
 
 void StopMotors();
 
+// Emergency stop, an interrupt on the enable switch cuts both drivers the moment it is switched off
+void EmergencyStopSetup(byte pin);
+// The switch is used to confirm the motor direction during first time setup, it only stops the motors while armed
+void ArmEmergencyStop(bool armed);
+// Stops the step pulses and queued motion once the interrupt has fired, called by RunTasks()
+void EmergencyStopUpdate();
+// True from the switch turning off until the state machine clears it at rest, or until a stop that cut no motion turns out to be the switch bouncing on
+bool EmergencyStopped();
+void ClearEmergencyStop();
+void PrintEmergencyStopStats();
+void ResetEmergencyStopStats();
+
+// Queue a multi-segment motion plan, returning a handle for MotionDone() or 0 if the queue is full
+unsigned int QueueMotion(byte motor, const MotionSegment* segments, byte count);
+// Determine if a queued plan, or a single segment of it, has finished
+bool MotionDone(byte motor, unsigned int handle);
+// Steps left in a running segment, and changing them while it runs
+long MotionRemaining(byte motor, unsigned int handle);
+bool RetargetMotion(byte motor, unsigned int handle, long steps);
+// Start the next queued segments, called from the main loop and while waiting on a motor
+void MotionUpdate();
+// Steps the bulk dispenser turns to dispense a given weight
+long BulkSteps(Weight targetWeight);
+
+// Current motor positions in steps, positive in the dispensing direction
+long GetBulkPosition();
+long GetTricklePosition();
+
 bool SetMotorDirection(int direction);
 
 #endif // STEPPERS_H
\ No newline at end of file
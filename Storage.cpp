@@ -0,0 +1,289 @@
+// Storage.cpp
+// Contains implementations of functions declared in Storage.h
+//
+// Slot layout
+// 0 = Key (1 to STORAGE_KEYS, anything else is an empty slot)
+// 1-2 = Sequence number, low byte first
+// 3 = Data size
+// 4 onwards = Data, followed by a CRC-8 of everything before it
+
+// Include the header file
+#include "Storage.h"
+
+// StorageEntry
+// RAM cache of one key
+typedef struct
+{
+  byte data[STORAGE_MAX_DATA];
+  byte size; // 0 while the key has no value
+  byte slot; // Slot holding the newest written copy, STORAGE_SLOTS if there is none
+  uint16_t sequence; // Sequence number of that copy
+  bool dirty; // The cached value still has to be written
+  unsigned long changed; // millis() of the last change
+} StorageEntry;
+
+static StorageEntry entries[STORAGE_KEYS];
+static uint16_t sequence = 0; // Sequence number of the newest record
+static byte head = 0; // Slot the search for a free slot starts from
+
+// Record being written
+static byte record[STORAGE_SLOT_SIZE];
+static byte recordKey = 0; // 0 while nothing is being written
+static byte recordSlot = 0;
+static byte recordLength = 0;
+static byte recordPosition = 0;
+static bool recordChanged = false; // The value changed after the record was built, it is written again afterwards
+
+static bool startRecord();
+static byte slotKey(byte slot);
+static bool newer(uint16_t a, uint16_t b);
+static byte crc8(const byte* data, byte length);
+
+// StorageBegin()
+// Scans the EEPROM for the newest valid record of each key and loads them into the cache
+void StorageBegin()
+{
+  bool found = false;
+  recordKey = 0;
+
+  for(byte key = 0; key < STORAGE_KEYS; key++)
+  {
+    entries[key].size = 0;
+    entries[key].slot = STORAGE_SLOTS;
+    entries[key].dirty = false;
+  }
+
+  for(byte slot = 0; slot < STORAGE_SLOTS; slot++)
+  {
+    int address = slot * STORAGE_SLOT_SIZE;
+    byte key = EEPROM.read(address);
+    byte size = EEPROM.read(address + 3);
+    if(key < 1 || key > STORAGE_KEYS || size < 1 || size > STORAGE_MAX_DATA)
+    {
+      continue;
+    }
+
+    byte length = STORAGE_HEADER_SIZE + size;
+    for(byte i = 0; i <= length; i++)
+    {
+      record[i] = EEPROM.read(address + i);
+    }
+    if(crc8(record, length) != record[length])
+    {
+      continue;
+    }
+
+    // Keep the newest copy of each key
+    uint16_t recordSequence = record[1] | (record[2] << 8);
+    StorageEntry* entry = &entries[key - 1];
+    if(entry->slot < STORAGE_SLOTS && !newer(recordSequence, entry->sequence))
+    {
+      continue;
+    }
+
+    memcpy(entry->data, &record[STORAGE_HEADER_SIZE], size);
+    entry->size = size;
+    entry->slot = slot;
+    entry->sequence = recordSequence;
+
+    // The newest record overall marks the end of the log
+    if(!found || newer(recordSequence, sequence))
+    {
+      sequence = recordSequence;
+      head = (slot + 1) % STORAGE_SLOTS;
+      found = true;
+    }
+  }
+
+  Serial.print("Storage loaded, newest record #");
+  Serial.print(sequence);
+  Serial.print(", next slot ");
+  Serial.println(head);
+}
+
+// StorageRead()
+// Copies the cached value of a key
+// Returns false if the key has no value or it was stored with a different size
+bool StorageRead(byte key, void* data, byte size)
+{
+  if(key < 1 || key > STORAGE_KEYS || entries[key - 1].size != size)
+  {
+    return false;
+  }
+
+  memcpy(data, entries[key - 1].data, size);
+  return true;
+}
+
+// StorageWrite()
+// Changes the cached value of a key, it is written to the EEPROM by StorageUpdate() once it has stopped changing for STORAGE_FLUSH_DELAY
+void StorageWrite(byte key, const void* data, byte size)
+{
+  if(key < 1 || key > STORAGE_KEYS || size < 1 || size > STORAGE_MAX_DATA)
+  {
+    return;
+  }
+
+  StorageEntry* entry = &entries[key - 1];
+  if(entry->size == size && !memcmp(entry->data, data, size))
+  {
+    return;
+  }
+
+  memcpy(entry->data, data, size);
+  entry->size = size;
+  entry->dirty = true;
+  entry->changed = millis();
+
+  if(recordKey == key)
+  {
+    recordChanged = true;
+  }
+}
+
+// StorageUpdate()
+// Writes one byte of the record being written, starting the next record when there is none
+void StorageUpdate()
+{
+  if(!recordKey && !startRecord())
+  {
+    return;
+  }
+
+  // EEPROM.update() skips bytes that already hold the value
+  EEPROM.update((recordSlot * STORAGE_SLOT_SIZE) + recordPosition, record[recordPosition]);
+  recordPosition++;
+
+  if(recordPosition < recordLength)
+  {
+    return;
+  }
+
+  // The record is complete, the cache now points at it and its old copy is free
+  StorageEntry* entry = &entries[recordKey - 1];
+  entry->slot = recordSlot;
+  entry->sequence = sequence;
+  entry->dirty = recordChanged;
+  head = (recordSlot + 1) % STORAGE_SLOTS;
+  recordKey = 0;
+}
+
+// StoragePending()
+// Returns true while any changed value has not been completely written
+bool StoragePending()
+{
+  if(recordKey)
+  {
+    return true;
+  }
+
+  for(byte key = 0; key < STORAGE_KEYS; key++)
+  {
+    if(entries[key].dirty)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// startRecord()
+// Builds the record of the first changed value that is ready to be written, in the first free slot from the head
+// Returns false if there is nothing to write or no free slot
+static bool startRecord()
+{
+  byte key = 0;
+  for(byte i = 0; i < STORAGE_KEYS; i++)
+  {
+    if(entries[i].dirty && (millis() - entries[i].changed) >= STORAGE_FLUSH_DELAY)
+    {
+      key = i + 1;
+      break;
+    }
+  }
+  if(!key)
+  {
+    return false;
+  }
+
+  // Live records between the head and the free slot are moved ahead of the head next, so every slot takes its share of the writes
+  byte slot = head;
+  for(byte i = 0; i < STORAGE_SLOTS; i++)
+  {
+    byte live = slotKey(slot);
+    if(!live)
+    {
+      break;
+    }
+
+    if(!entries[live - 1].dirty)
+    {
+      entries[live - 1].dirty = true;
+      entries[live - 1].changed = millis() - STORAGE_FLUSH_DELAY;
+    }
+    slot = (slot + 1) % STORAGE_SLOTS;
+  }
+  if(slotKey(slot))
+  {
+    // Every slot holds a live record, STORAGE_KEYS is too large for the EEPROM
+    return false;
+  }
+
+  StorageEntry* entry = &entries[key - 1];
+  sequence++;
+  record[0] = key;
+  record[1] = sequence & 0xFF;
+  record[2] = sequence >> 8;
+  record[3] = entry->size;
+  memcpy(&record[STORAGE_HEADER_SIZE], entry->data, entry->size);
+  record[STORAGE_HEADER_SIZE + entry->size] = crc8(record, STORAGE_HEADER_SIZE + entry->size);
+
+  recordKey = key;
+  recordSlot = slot;
+  recordLength = STORAGE_HEADER_SIZE + entry->size + 1;
+  recordPosition = 0;
+  recordChanged = false;
+
+  return true;
+}
+
+// slotKey()
+// Returns the key whose newest copy is in a slot, or 0 if the slot is free
+static byte slotKey(byte slot)
+{
+  for(byte key = 0; key < STORAGE_KEYS; key++)
+  {
+    if(entries[key].slot == slot)
+    {
+      return key + 1;
+    }
+  }
+
+  return 0;
+}
+
+// newer()
+// Returns true if sequence number a was written after b, allowing for the sequence numbers wrapping around
+static bool newer(uint16_t a, uint16_t b)
+{
+  return (int16_t)(a - b) > 0;
+}
+
+// crc8()
+// CRC-8 (polynomial 0x07) of a block of bytes
+static byte crc8(const byte* data, byte length)
+{
+  byte crc = 0;
+
+  for(byte i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for(byte bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+    }
+  }
+
+  return crc;
+}
\ No newline at end of file
@@ -0,0 +1,32 @@
+// Storage.h
+// Log structured record store over the EEPROM, with a RAM cache of the latest value of each key
+// The EEPROM is divided into fixed size slots used as a ring, a new value is always written to a free slot so a write cut short by a power loss leaves the previous value intact
+// Each record carries a sequence number, so the newest copy of each key can be found at startup, and a CRC so torn or stale bytes are ignored
+// Live records the write head passes are moved ahead of it, spreading wear over every slot instead of the cells of a few fixed addresses
+// Writes only update the RAM cache, StorageUpdate() writes them out later a byte at a time so EEPROM write times never hold up a charge
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+// External libraries
+#include <Arduino.h> // Standard Arduino libraries
+#include <EEPROM.h> // Arduino EEPROM libraries
+
+#define STORAGE_SLOT_SIZE 32 // Bytes per slot, a record and its header must fit in one slot
+#define STORAGE_HEADER_SIZE 4 // Key, sequence number (2 bytes) and data size ahead of the data
+#define STORAGE_MAX_DATA (STORAGE_SLOT_SIZE - STORAGE_HEADER_SIZE - 1) // Largest value that can be stored, leaving room for the CRC
+#define STORAGE_KEYS 5 // Keys 1 to STORAGE_KEYS can be stored
+#define STORAGE_FLUSH_DELAY 1000 // Time in ms a changed value waits for further changes before it is written, so a burst of changes is written once
+
+#define STORAGE_SIZE 256 // Bytes of EEPROM used, all of the Nano Every's EEPROM
+#define STORAGE_SLOTS (STORAGE_SIZE / STORAGE_SLOT_SIZE)
+
+void StorageBegin();
+bool StorageRead(byte key, void* data, byte size);
+void StorageWrite(byte key, const void* data, byte size);
+
+// Write out changed values, a byte per call, must only be called where an EEPROM write cannot delay dispensing
+void StorageUpdate();
+bool StoragePending();
+
+#endif // STORAGE_H
\ No newline at end of file
@@ -0,0 +1,111 @@
+// Tasks.cpp
+// Contains implementations of functions declared in Tasks.h
+
+// Include the header file
+#include "Tasks.h"
+#include "Scale.h"
+#include "Steppers.h"
+#include "Storage.h"
+#include "Timing.h"
+
+static bool storageWrites = false;
+
+// Task loop statistics
+static unsigned long passCount = 0;
+static unsigned long statsStart = 0; // millis() the statistics were reset
+static unsigned long lastPass = 0; // micros() the previous pass started
+static bool passed = false; // lastPass is valid
+static unsigned long longestTick = 0; // Longest gap between passes in us
+static unsigned long longestTickTime = 0; // millis() the longest gap ended
+static unsigned long slowTicks = 0;
+
+// RunTasks()
+// Runs one pass of every background task, must be called from the main loop and from within any wait loops
+void RunTasks()
+{
+  // Measure the time since the previous pass
+  unsigned long now = micros();
+  if(passed)
+  {
+    unsigned long tick = now - lastPass;
+    if(tick > longestTick)
+    {
+      longestTick = tick;
+      longestTickTime = millis();
+    }
+    if(tick > (TASK_SLOW_TICK * 1000UL))
+    {
+      slowTicks++;
+    }
+  }
+  lastPass = now;
+  passed = true;
+  passCount++;
+
+  // Finish an emergency stop the enable switch interrupt started
+  EmergencyStopUpdate();
+
+  // Pump the streaming scale driver
+  ScaleUpdate();
+
+  // Start the next segment of any queued motor motion
+  MotionUpdate();
+
+  // Handle any commands sent over USB serial
+  ProcessSerialCommands();
+
+  // Write out saved values a byte at a time
+  if(storageWrites)
+  {
+    StorageUpdate();
+  }
+}
+
+// WaitMillis()
+// Waits for the given time while running the background tasks, used in place of delay()
+void WaitMillis(unsigned long duration)
+{
+  unsigned long start = millis();
+
+  while((millis() - start) < duration)
+  {
+    RunTasks();
+  }
+}
+
+// SetStorageWrites()
+// Allows or stops RunTasks() writing out saved values
+void SetStorageWrites(bool allowed)
+{
+  storageWrites = allowed;
+}
+
+// PrintTaskStats()
+// Prints the task loop rate and the longest gap between passes since the statistics were reset
+void PrintTaskStats()
+{
+  unsigned long elapsed = millis() - statsStart;
+
+  Serial.print("Task loop rate = ");
+  Serial.print(elapsed ? ((passCount * 1000.0) / elapsed) : 0, 0);
+  Serial.print(" passes/s, longest tick = ");
+  Serial.print(longestTick / 1000.0, 1);
+  Serial.print("ms (");
+  Serial.print((millis() - longestTickTime) / 1000.0, 1);
+  Serial.print("s ago), slow ticks = ");
+  Serial.print(slowTicks);
+  Serial.print(" of ");
+  Serial.println(passCount);
+}
+
+// ResetTaskStats()
+// Clears the task loop statistics
+void ResetTaskStats()
+{
+  passCount = 0;
+  statsStart = millis();
+  passed = false;
+  longestTick = 0;
+  longestTickTime = statsStart;
+  slowTicks = 0;
+}
@@ -0,0 +1,25 @@
+// Tasks.h
+// Cooperative background tasks, run once per pass of the main loop and from within every wait
+// RunTasks() finishes emergency stops and pumps the scale driver, the motion queues, USB serial commands and (where allowed) EEPROM writes, so they keep going while a state waits
+// States wait with WaitMillis() instead of delay(), and loops waiting on a motor or the scale call RunTasks() each time around
+// The time between passes is tracked, the longest gap shows how long the tasks were held up by anything blocking
+
+#ifndef TASKS_H
+#define TASKS_H
+
+// External libraries
+#include <Arduino.h> // Standard Arduino libraries
+
+#define TASK_SLOW_TICK 50 // Gaps between passes longer than this (in ms) are counted as slow ticks
+
+void RunTasks();
+void WaitMillis(unsigned long duration);
+
+// EEPROM writes stall the CPU for several ms, so they are only made by RunTasks() while the state machine allows it
+void SetStorageWrites(bool allowed);
+
+// Task loop statistics
+void PrintTaskStats();
+void ResetTaskStats();
+
+#endif // TASKS_H
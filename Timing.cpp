@@ -0,0 +1,199 @@
+// Timing.cpp
+// Contains implementations of functions declared in Timing.h
+
+// Include the header file
+#include "Timing.h"
+#include "Scale.h"
+#include "Tasks.h"
+#include "Steppers.h"
+#include "StateMachine.h"
+
+// Completed records
+static ChargeTiming records[TIMING_RECORD_COUNT];
+static byte recordHead = 0; // Index the next record will be written to
+static byte recordCount = 0;
+
+// Record being built
+static ChargeTiming current;
+static bool recording = false;
+static byte currentPhase = TIMING_OTHER;
+static unsigned long chargeStart = 0;
+static unsigned long phaseStart = 0;
+
+static void closePhase(unsigned long now);
+
+// TimingStart()
+// Opens a new record for a charge of the given target weight, starting in the TIMING_OTHER phase
+void TimingStart(float target)
+{
+  memset(&current, 0, sizeof(current));
+  current.target = (target * 100) + 0.5;
+
+  chargeStart = millis();
+  phaseStart = chargeStart;
+  currentPhase = TIMING_OTHER;
+  current.phaseEntries[TIMING_OTHER] = 1;
+  recording = true;
+}
+
+// TimingPhase()
+// Moves the open record to a new phase, returning the previous phase so nested phases can restore it
+// Does nothing but return TIMING_OTHER when no record is open
+byte TimingPhase(byte phase)
+{
+  if(!recording)
+  {
+    return TIMING_OTHER;
+  }
+
+  byte previous = currentPhase;
+  if(phase != currentPhase)
+  {
+    closePhase(millis());
+
+    currentPhase = phase;
+    if(current.phaseEntries[phase] < 255)
+    {
+      current.phaseEntries[phase]++;
+    }
+  }
+
+  return previous;
+}
+
+// TimingEnd()
+// Closes the open record and stores it in the ring buffer
+void TimingEnd()
+{
+  if(!recording)
+  {
+    return;
+  }
+
+  unsigned long now = millis();
+  closePhase(now);
+
+  unsigned long total = now - chargeStart;
+  current.totalMillis = (total > 65535) ? 65535 : total;
+
+  records[recordHead] = current;
+  recordHead = (recordHead + 1) % TIMING_RECORD_COUNT;
+  if(recordCount < TIMING_RECORD_COUNT)
+  {
+    recordCount++;
+  }
+
+  recording = false;
+}
+
+// PrintTiming()
+// Prints the stored records, oldest first, followed by the mean of each column
+// Each phase column is the total ms spent in that phase, with the number of times it was entered after the slash
+void PrintTiming()
+{
+  Serial.println("TIMING,charge,target,total_ms,other,bulk,retract,weigh,trickle,arrival");
+
+  unsigned long phaseTotals[TIMING_PHASE_COUNT] = {0};
+  unsigned long totalTotal = 0;
+
+  for(byte i = 0; i < recordCount; i++)
+  {
+    ChargeTiming* record = &records[(recordHead + TIMING_RECORD_COUNT - recordCount + i) % TIMING_RECORD_COUNT];
+
+    Serial.print("TIMING,");
+    Serial.print(i);
+    Serial.print(",");
+    Serial.print(record->target / 100.0, 2);
+    Serial.print(",");
+    Serial.print(record->totalMillis);
+    for(byte phase = 0; phase < TIMING_PHASE_COUNT; phase++)
+    {
+      Serial.print(",");
+      Serial.print(record->phaseMillis[phase]);
+      Serial.print("/");
+      Serial.print(record->phaseEntries[phase]);
+
+      phaseTotals[phase] += record->phaseMillis[phase];
+    }
+    Serial.println();
+
+    totalTotal += record->totalMillis;
+  }
+
+  if(recordCount)
+  {
+    Serial.print("TIMING,mean,,");
+    Serial.print(totalTotal / recordCount);
+    for(byte phase = 0; phase < TIMING_PHASE_COUNT; phase++)
+    {
+      Serial.print(",");
+      Serial.print(phaseTotals[phase] / recordCount);
+    }
+    Serial.println();
+  }
+}
+
+// ClearTiming()
+// Discards all stored records
+void ClearTiming()
+{
+  recordHead = 0;
+  recordCount = 0;
+}
+
+// ProcessSerialCommands()
+// Handles single character commands sent over USB serial, called by RunTasks()
+void ProcessSerialCommands()
+{
+  while(Serial.available())
+  {
+    char command = Serial.read();
+
+    switch(command)
+    {
+      case TIMING_DUMP_CMD:
+        PrintTiming();
+        break;
+      case TIMING_CLEAR_CMD:
+        ClearTiming();
+        Serial.println("Charge timing records cleared");
+        break;
+      case SCALE_STATS_CMD:
+        PrintScaleStats();
+        PrintScaleLatency();
+        break;
+      case SCALE_RESET_CMD:
+        ResetScaleStats();
+        ResetTaskStats();
+        ResetEmergencyStopStats();
+        ResetStateTimes();
+        Serial.println("Scale, task loop, emergency stop and state time statistics reset");
+        break;
+      case TASK_STATS_CMD:
+        PrintTaskStats();
+        break;
+      case STOP_STATS_CMD:
+        PrintEmergencyStopStats();
+        break;
+      case STATE_TRACE_CMD:
+        PrintStateTrace();
+        PrintStateTimes();
+        break;
+      case BULK_PLANNER_CMD:
+        PrintBulkPlanner();
+        break;
+      case SETTLE_TIMING_CMD:
+        PrintSettleTiming();
+        break;
+    }
+  }
+}
+
+// closePhase()
+// Adds the time since the current phase started to the open record
+static void closePhase(unsigned long now)
+{
+  unsigned long total = current.phaseMillis[currentPhase] + (now - phaseStart);
+  current.phaseMillis[currentPhase] = (total > 65535) ? 65535 : total;
+  phaseStart = now;
+}
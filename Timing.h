@@ -0,0 +1,52 @@
+// Timing.h
+// Per-phase timing of each charge, kept in a ring buffer of compact records and dumped over USB serial on request
+// A record is opened by TimingStart() when a charge starts, TimingPhase() is called at each phase boundary and TimingEnd() closes the record
+
+#ifndef TIMING_H
+#define TIMING_H
+
+// External libraries
+#include <Arduino.h> // Standard Arduino libraries
+
+// Charge phases
+#define TIMING_OTHER 0 // Decisions, display and serial output between the phases below
+#define TIMING_BULK 1 // Bulk dispense motion
+#define TIMING_RETRACT 2 // Bulk retract and recovery motion
+#define TIMING_WEIGH 3 // Waiting for a stable weight
+#define TIMING_TRICKLE 4 // Trickler motion
+#define TIMING_ARRIVAL 5 // Waiting for dispensed powder to reach the scale (up to MAX_DELAY)
+#define TIMING_PHASE_COUNT 6
+
+#define TIMING_RECORD_COUNT 16 // Number of charges kept, the oldest record is overwritten
+
+// USB serial commands
+#define TIMING_DUMP_CMD 't' // Print the charge timing records
+#define TIMING_CLEAR_CMD 'c' // Clear the charge timing records
+#define SCALE_STATS_CMD 's' // Print the scale driver statistics and latency histogram
+#define SCALE_RESET_CMD 'r' // Reset the scale driver, task loop, emergency stop and state time statistics
+#define TASK_STATS_CMD 'l' // Print the task loop rate and longest tick
+#define STOP_STATS_CMD 'e' // Print the emergency stop latencies
+#define STATE_TRACE_CMD 'm' // Print the state machine trace and the time spent in each state
+#define BULK_PLANNER_CMD 'b' // Print the bulk planner statistics
+#define SETTLE_TIMING_CMD 'w' // Print the learned trickle arrival and settle times
+
+// ChargeTiming
+// Time spent in each phase of one charge
+typedef struct
+{
+  unsigned int phaseMillis[TIMING_PHASE_COUNT]; // Time in ms spent in each phase
+  byte phaseEntries[TIMING_PHASE_COUNT]; // Number of times each phase was entered
+  unsigned int totalMillis; // Time in ms from TimingStart() to TimingEnd()
+  unsigned int target; // Target weight in hundredths of a grain
+} ChargeTiming;
+
+void TimingStart(float target);
+byte TimingPhase(byte phase);
+void TimingEnd();
+
+void PrintTiming();
+void ClearTiming();
+
+void ProcessSerialCommands();
+
+#endif // TIMING_H
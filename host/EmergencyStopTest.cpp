@@ -0,0 +1,227 @@
+// EmergencyStopTest.cpp
+// Releases the enable switch at random points while the firmware throws charges, and checks every release against the emergency stop bounds
+// - No motor turns with its driver enabled from the release until the switch is turned back on
+// - The step pulses stop within STOP_PULSE_BOUND of the release, as seen by the motor model and as reported by the firmware
+// - The switch bounces each time it is turned back on, and if the trickler was at rest in the Idle state it leaves it, so the bounce did not latch a stop
+// Exits with 1 if any release breaks a bound, any bounce leaves the trickler stopped, or too few releases caught the motors turning to show anything
+
+#include "HostRuntime.h"
+#include "../Simulator.h"
+#include "../StateMachine.h"
+
+#define TEST_SECONDS 1800 // Virtual time the test runs for
+#define TEST_SEED 7
+#define RELEASE_FROM 20000 // Time in ms of the first release, calibration starts at HOST_OPERATOR_START
+#define RELEASE_PERIOD 7000 // The switch is released once at a random point in each period of this many ms
+#define RELEASE_HOLD 2000 // Time in ms the switch is held off before it is turned back on
+#define STOP_PULSE_BOUND 1000 // Most time in us from the release to the step pulses stopping
+#define MIN_MOVING_RELEASES 40 // Releases that must catch a motor turning
+#define BOUNCE_EDGES 6 // Times the contacts change over while the switch is turned on, ending closed
+#define BOUNCE_GAP 120 // Time in us between the bounce edges
+#define BOUNCE_RECOVERY 500 // Time in ms after the bounce ends that the trickler must have left the Idle state by
+
+// Release being followed
+static unsigned long long releaseTime = 0; // Virtual time in us of the release, 0 while the switch is on
+static unsigned long long nextRelease = RELEASE_FROM * 1000ULL;
+static double releaseSteps = 0; // Powered steps at the release
+static bool pulsing = false; // The step pulses have not stopped since the release
+static unsigned long randomState = TEST_SEED;
+
+// Bounce being played
+static int bounceEdges = 0; // Edges left to play
+static unsigned long long nextEdge = 0; // Virtual time in us of the next edge
+static bool bounceAtRest = false; // The trickler was in the Idle state when the bounce started
+static unsigned long long bounceCheck = 0; // Virtual time in us to check the trickler left the Idle state, 0 once checked
+static bool firmwareIdle = false; // The firmware last reported entering the Idle state
+
+// Results
+static unsigned int releases = 0;
+static unsigned int movingReleases = 0;
+static double poweredMax = 0; // Most powered steps turned after a release
+static unsigned long long pulseMax = 0; // Longest time in us from a release to the step pulses stopping
+static unsigned long reportedCount = 0;
+static unsigned long reportedMax = 0; // Longest pulse stop the firmware reported in us
+static unsigned int charges = 0;
+static unsigned int bounces = 0; // Bounces that turned the switch on with the trickler at rest
+static unsigned int stuckBounces = 0; // Bounces that left the trickler in the Idle state
+
+// nextRandom()
+// Linear congruential generator, kept apart from rand() so the releases do not change the powder
+static unsigned long nextRandom()
+{
+  randomState = (randomState * 1103515245UL) + 12345;
+  return (randomState >> 8) & 0xFFFFFF;
+}
+
+// pulsesRunning()
+// Returns true while either motor is being sent step pulses, whether or not its driver is enabled
+static bool pulsesRunning()
+{
+  return trickler.stepsToDo() || bulk.stepsToDo();
+}
+
+// followRelease()
+// Works the switch and follows what the motors do after each release, called on every tick of the virtual clock
+static void followRelease()
+{
+  unsigned long long now = HostMicros();
+
+  if(bounceEdges)
+  {
+    if(now >= nextEdge)
+    {
+      bounceEdges--;
+      HostSetEnable(!HostEnabled());
+      nextEdge = now + BOUNCE_GAP;
+      if(!bounceEdges && bounceAtRest)
+      {
+        bounces++;
+        bounceCheck = now + (BOUNCE_RECOVERY * 1000ULL);
+      }
+    }
+    return;
+  }
+
+  if(bounceCheck && (now >= bounceCheck || now >= nextRelease))
+  {
+    if(firmwareIdle)
+    {
+      stuckBounces++;
+    }
+    bounceCheck = 0;
+  }
+
+  if(!releaseTime)
+  {
+    if(now < nextRelease || !HostEnabled())
+    {
+      return;
+    }
+
+    // Release the switch, the interrupt runs on this tick after the hook returns
+    releaseTime = now;
+    releaseSteps = HostPoweredSteps();
+    pulsing = pulsesRunning();
+    releases++;
+    if(HostMotorsTurning())
+    {
+      movingReleases++;
+    }
+    HostSetEnable(false);
+    return;
+  }
+
+  double powered = HostPoweredSteps() - releaseSteps;
+  if(powered > poweredMax)
+  {
+    poweredMax = powered;
+  }
+
+  if(pulsing && !pulsesRunning())
+  {
+    pulsing = false;
+    if(now - releaseTime > pulseMax)
+    {
+      pulseMax = now - releaseTime;
+    }
+  }
+
+  if(now - releaseTime >= RELEASE_HOLD * 1000ULL)
+  {
+    // Pulses still running at the end of the hold are far past the bound
+    if(pulsing && (now - releaseTime) > pulseMax)
+    {
+      pulseMax = now - releaseTime;
+    }
+
+    // Turn the switch back on with its contacts bouncing, the interrupt sees every opening as a falling edge
+    HostSetEnable(true);
+    bounceEdges = BOUNCE_EDGES;
+    nextEdge = now + BOUNCE_GAP;
+    bounceAtRest = firmwareIdle;
+    releaseTime = 0;
+    unsigned long period = (now / 1000) / RELEASE_PERIOD;
+    nextRelease = (((period + 1) * RELEASE_PERIOD) + (nextRandom() % RELEASE_PERIOD)) * 1000ULL;
+  }
+}
+
+// readReport()
+// Picks the pulse stop latency, the charges and the Idle state out of what the firmware prints
+static void readReport(const char* line)
+{
+  const char* report = strstr(line, "step pulses stopped ");
+  if(report && strstr(line, "us later"))
+  {
+    unsigned long latency = strtoul(report + strlen("step pulses stopped "), NULL, 10);
+    reportedCount++;
+    if(latency > reportedMax)
+    {
+      reportedMax = latency;
+    }
+  }
+
+  if(strstr(line, "Entered Evaluate state after "))
+  {
+    charges++;
+  }
+
+  if(strstr(line, "Entered Idle state"))
+  {
+    firmwareIdle = true;
+  }
+  else if(strstr(line, "Entered Ready state"))
+  {
+    firmwareIdle = false;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  HostBegin(TEST_SEED);
+
+  float target = 32;
+  float version = VERSION_MAJOR + (VERSION_MINOR * 0.1);
+  int direction = 1;
+  EEPROM.put(TARGET_MEMORY_ADDR, target);
+  EEPROM.put(VERSION_MEMORY_ADDR, version);
+  EEPROM.put(DIRECTION_MEMORY_ADDR, direction);
+
+  HostSetEcho(argc > 1 && !strcmp(argv[1], "--verbose"));
+  HostSetLineHook(readReport);
+  HostSetTickHook(followRelease);
+  HostSetOperator(true);
+
+  setup();
+  HostRun(TEST_SECONDS * 1000UL);
+
+  printf("Releases = %u (%u with a motor turning), charges thrown = %u\n", releases, movingReleases, charges);
+  printf("Most powered steps after a release = %.1f (bound 0)\n", poweredMax);
+  printf("Longest time to the step pulses stopping = %lluus (bound %dus)\n", pulseMax, STOP_PULSE_BOUND);
+  printf("Firmware reported %lu stops, longest %luus (bound %dus)\n", reportedCount, reportedMax, STOP_PULSE_BOUND);
+  printf("Bounces turning the switch on at rest = %u, left the trickler in the Idle state = %u (bound 0)\n", bounces, stuckBounces);
+
+  bool passed = true;
+  if(poweredMax > 0)
+  {
+    printf("FAIL: a motor turned with its driver enabled after the switch was released\n");
+    passed = false;
+  }
+  if(pulseMax > STOP_PULSE_BOUND || reportedMax > STOP_PULSE_BOUND)
+  {
+    printf("FAIL: the step pulses ran past the bound\n");
+    passed = false;
+  }
+  if(stuckBounces > 0 || !bounces)
+  {
+    printf("FAIL: the switch bouncing as it was turned on latched an emergency stop\n");
+    passed = false;
+  }
+  if(movingReleases < MIN_MOVING_RELEASES || reportedCount < movingReleases)
+  {
+    printf("FAIL: too few releases caught a motor turning, or the firmware missed some\n");
+    passed = false;
+  }
+
+  printf(passed ? "PASS\n" : "FAIL\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,487 @@
+// HostRuntime.cpp
+// Contains implementations of functions declared in HostRuntime.h, and of the Arduino core functions the firmware calls
+
+// Include the header file
+#include "HostRuntime.h"
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+EEPROMClass EEPROM;
+
+// Virtual clock
+static unsigned long long now = 0; // Virtual time in us
+static bool inInterrupt = false;
+
+// Enable switch
+static bool enableOn = false;
+static bool enableLast = false;
+static void (*enableInterrupt)() = NULL;
+static int enableMode = 0;
+static void (*tickHook)() = NULL;
+static bool operatorOn = false;
+static unsigned long long operatorEnable = 0; // Virtual time in us the operator turns the switch on, 0 once done
+
+// Serial
+static bool echo = false;
+static bool lineStart = true;
+static void (*lineHook)(const char* line) = NULL;
+
+static void tick();
+
+// HostBegin()
+// Resets the virtual clock, seeds the random numbers and erases the EEPROM, called before the sketch's setup()
+void HostBegin(unsigned long seed)
+{
+  srand(seed);
+  memset(EEPROM.memory, 0xFF, sizeof(EEPROM.memory));
+  now = 0;
+}
+
+// HostRun()
+// Runs the sketch's loop() until the virtual clock reaches the given time or finished() returns true
+void HostRun(unsigned long untilMillis, bool (*finished)())
+{
+  while(millis() < untilMillis)
+  {
+    loop();
+
+    if(finished && finished())
+    {
+      return;
+    }
+  }
+}
+
+// HostMicros()
+// Returns the full width virtual time in us
+unsigned long long HostMicros()
+{
+  return now;
+}
+
+// HostSetEnable()
+// Moves the enable switch, running the attached interrupt on the next tick if it turned off
+void HostSetEnable(bool on)
+{
+  enableOn = on;
+}
+
+// HostEnabled()
+// Returns the position of the enable switch
+bool HostEnabled()
+{
+  return enableOn;
+}
+
+// HostSetOperator()
+// Starts or stops the automatic operator
+void HostSetOperator(bool automatic)
+{
+  operatorOn = automatic;
+  operatorEnable = automatic ? (now + (HOST_OPERATOR_START * 1000ULL)) : 0;
+}
+
+// HostSetTickHook()
+// Sets a function called on every tick of the virtual clock
+void HostSetTickHook(void (*hook)())
+{
+  tickHook = hook;
+}
+
+// HostSetEcho()
+// Echoes every line the firmware prints to stdout, prefixed with the virtual time
+void HostSetEcho(bool enabled)
+{
+  echo = enabled;
+}
+
+// HostSetLineHook()
+// Sets a function handed every complete line the firmware prints
+void HostSetLineHook(void (*hook)(const char* line))
+{
+  lineHook = hook;
+}
+
+// HostType()
+// Queues text as if it was typed into the USB serial port
+void HostType(const char* text)
+{
+  Serial.input += text;
+}
+
+// HostLoadEeprom()
+// Loads the EEPROM contents saved by an earlier run
+// Returns false if the file could not be read
+bool HostLoadEeprom(const char* path)
+{
+  FILE* file = fopen(path, "rb");
+  if(!file)
+  {
+    return false;
+  }
+
+  bool loaded = fread(EEPROM.memory, 1, sizeof(EEPROM.memory), file) == sizeof(EEPROM.memory);
+  fclose(file);
+
+  return loaded;
+}
+
+// HostSaveEeprom()
+// Saves the EEPROM contents for a later run
+// Returns false if the file could not be written
+bool HostSaveEeprom(const char* path)
+{
+  FILE* file = fopen(path, "wb");
+  if(!file)
+  {
+    return false;
+  }
+
+  bool saved = fwrite(EEPROM.memory, 1, sizeof(EEPROM.memory), file) == sizeof(EEPROM.memory);
+  fclose(file);
+
+  return saved;
+}
+
+// HostMotorsTurning()
+// Returns true while either motor is turning with its driver enabled
+bool HostMotorsTurning()
+{
+  return trickler.turning() || bulk.turning();
+}
+
+// HostPoweredSteps()
+// Returns the steps both motors have turned with their drivers enabled
+double HostPoweredSteps()
+{
+  trickler.update();
+  bulk.update();
+
+  return trickler.poweredSteps + bulk.poweredSteps;
+}
+
+// tick()
+// Advances the virtual clock by one call into the core, running the enable switch interrupt when the switch turns off
+static void tick()
+{
+  now += HOST_CALL_TIME;
+
+  // Interrupts do not nest, and the hook must not see a half finished interrupt
+  if(inInterrupt)
+  {
+    return;
+  }
+
+  inInterrupt = true;
+  if(operatorEnable && now >= operatorEnable)
+  {
+    enableOn = true;
+    operatorEnable = 0;
+  }
+  if(tickHook)
+  {
+    tickHook();
+  }
+
+  bool falling = enableLast && !enableOn;
+  bool rising = !enableLast && enableOn;
+  enableLast = enableOn;
+  if(enableInterrupt && ((falling && (enableMode == FALLING || enableMode == CHANGE)) || (rising && (enableMode == RISING || enableMode == CHANGE))))
+  {
+    enableInterrupt();
+  }
+  inInterrupt = false;
+}
+
+// Arduino core
+
+unsigned long millis()
+{
+  tick();
+  return now / 1000;
+}
+
+unsigned long micros()
+{
+  tick();
+  return (unsigned long)now;
+}
+
+void delay(unsigned long duration)
+{
+  now += duration * 1000ULL;
+  tick();
+}
+
+void delayMicroseconds(unsigned int duration)
+{
+  now += duration;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+// The buttons have pull-ups and read high while released, the enable switch reads high while on
+int digitalRead(uint8_t pin)
+{
+  tick();
+
+  if(pin == HOST_ENABLE_PIN)
+  {
+    return enableOn ? HIGH : LOW;
+  }
+
+  return HIGH;
+}
+
+// Driving a stepper's enable line high cuts its driver until the next move starts
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  if(value != HIGH)
+  {
+    return;
+  }
+
+  if(pin == trickler.enablePin)
+  {
+    trickler.cutDriver();
+  }
+  if(pin == bulk.enablePin)
+  {
+    bulk.cutDriver();
+  }
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode)
+{
+  if(interrupt == digitalPinToInterrupt(HOST_ENABLE_PIN))
+  {
+    enableInterrupt = isr;
+    enableMode = mode;
+  }
+}
+
+long random(long howBig)
+{
+  return (howBig > 0) ? rand() % howBig : 0;
+}
+
+long random(long howSmall, long howBig)
+{
+  return (howBig > howSmall) ? howSmall + (rand() % (howBig - howSmall)) : howSmall;
+}
+
+void randomSeed(unsigned long seed)
+{
+  srand(seed);
+}
+
+// Stream
+
+size_t Stream::write(uint8_t c)
+{
+  if(this != &Serial)
+  {
+    return 1;
+  }
+
+  if(echo && lineStart)
+  {
+    printf("[%10.3f] ", now / 1000000.0);
+  }
+  lineStart = (c == '\n');
+  if(echo)
+  {
+    putchar(c);
+  }
+
+  if(c == '\n')
+  {
+    // Calibration waits on the display for the switch to be toggled before going to Idle
+    if(operatorOn && strstr(line.c_str(), "Displaying calibration results"))
+    {
+      enableOn = false;
+      operatorEnable = now + (HOST_OPERATOR_IDLE * 1000ULL);
+    }
+
+    if(lineHook)
+    {
+      lineHook(line.c_str());
+    }
+    line.clear();
+  }
+  else if(c != '\r')
+  {
+    line += (char)c;
+  }
+
+  return 1;
+}
+
+int Stream::available()
+{
+  return input.size();
+}
+
+int Stream::read()
+{
+  if(input.empty())
+  {
+    return -1;
+  }
+
+  int c = (unsigned char)input[0];
+  input.erase(0, 1);
+  return c;
+}
+
+// MoToStepper
+
+uint16_t MoToStepper::setSpeed(int rpm10)
+{
+  update();
+  stepsPerSecond = rpm10 * (double)stepsPerRev / 600.0;
+  return 0;
+}
+
+void MoToStepper::move(long steps)
+{
+  update();
+  if(steps)
+  {
+    start();
+  }
+  direction = 0;
+  hasPending = false;
+  target = (long)position + steps;
+}
+
+// A reversal while moving ramps down first, carrying on for up to the ramp length
+void MoToStepper::moveTo(long newTarget)
+{
+  update();
+  if(newTarget != (long)position)
+  {
+    start();
+  }
+  direction = 0;
+  hasPending = false;
+
+  long remaining = target - (long)position;
+  if(remaining && (((newTarget - (long)position) > 0) != (remaining > 0)))
+  {
+    long rampDown = (labs(remaining) < ramp) ? labs(remaining) : ramp;
+    target = (long)position + ((remaining > 0) ? rampDown : -rampDown);
+    pending = newTarget;
+    hasPending = true;
+  }
+  else
+  {
+    target = newTarget;
+  }
+}
+
+void MoToStepper::rotate(int8_t newDirection)
+{
+  update();
+  if(newDirection)
+  {
+    start();
+  }
+  direction = newDirection;
+  hasPending = false;
+  if(!newDirection)
+  {
+    target = (long)position;
+  }
+}
+
+void MoToStepper::stop()
+{
+  update();
+  direction = 0;
+  hasPending = false;
+  target = (long)position;
+}
+
+long MoToStepper::readSteps()
+{
+  update();
+  return (long)position;
+}
+
+long MoToStepper::stepsToDo()
+{
+  update();
+  if(direction)
+  {
+    return 1;
+  }
+
+  return labs(target - (long)position) + (hasPending ? labs(pending - target) : 0);
+}
+
+// update()
+// Steps the motor on from the last update at the set speed
+void MoToStepper::update()
+{
+  double elapsed = (now - lastUpdate) / 1000000.0;
+  lastUpdate = now;
+
+  double before = position;
+  double steps = stepsPerSecond * elapsed;
+  if(direction)
+  {
+    position += direction * steps;
+  }
+  else if(position < target)
+  {
+    position = (position + steps > target) ? target : position + steps;
+  }
+  else if(position > target)
+  {
+    position = (position - steps < target) ? target : position - steps;
+  }
+
+  if(driverOff)
+  {
+    lostSteps += fabs(position - before);
+  }
+  else
+  {
+    poweredSteps += fabs(position - before);
+  }
+
+  if(!direction && hasPending && position == target)
+  {
+    target = pending;
+    hasPending = false;
+  }
+}
+
+// turning()
+// Returns true while steps are being pulsed with the driver enabled
+bool MoToStepper::turning()
+{
+  update();
+  return !driverOff && (direction || (target != (long)position) || hasPending);
+}
+
+// cutDriver()
+// The enable line was driven off, pulses no longer turn the motor
+void MoToStepper::cutDriver()
+{
+  update();
+  driverOff = true;
+}
+
+// start()
+// MobaTools turns the driver back on when a move starts from standstill
+void MoToStepper::start()
+{
+  if(!direction && !hasPending && target == (long)position)
+  {
+    driverOff = false;
+  }
+}
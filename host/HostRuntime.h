@@ -0,0 +1,51 @@
+// HostRuntime.h
+// Runs the unmodified trickler firmware on a Linux host, against the powder and scale model in Simulator.cpp
+// Every call the firmware makes into the Arduino core advances a virtual clock by HOST_CALL_TIME, so its wait loops finish without real time passing
+// The enable switch, USB serial input and the EEPROM are driven by the host program, and every line the firmware prints is handed to it
+
+#ifndef HOST_RUNTIME_H
+#define HOST_RUNTIME_H
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <MobaTools.h>
+
+#define HOST_CALL_TIME 20 // Virtual time in us that each call into the core takes, standing in for the CPU time of the main loop
+#define HOST_ENABLE_PIN 5 // ENABLE_BTN in the sketch
+#define HOST_OPERATOR_START 1000 // Time in ms the automatic operator first turns the enable switch on
+#define HOST_OPERATOR_IDLE 1000 // Time in ms the automatic operator leaves the switch off after a calibration before turning it back on
+
+// The sketch
+void setup();
+void loop();
+
+// Run control
+void HostBegin(unsigned long seed);
+void HostRun(unsigned long untilMillis, bool (*finished)() = NULL);
+unsigned long long HostMicros();
+
+// Enable switch, the interrupt the firmware attached runs when it turns off
+void HostSetEnable(bool on);
+bool HostEnabled();
+
+// The automatic operator turns the switch on at the start and toggles it after each calibration, so charges run unattended
+void HostSetOperator(bool automatic);
+
+// Called on every tick of the virtual clock, so a script can work the switch at exact times
+void HostSetTickHook(void (*hook)());
+
+// USB serial
+void HostSetEcho(bool echo);
+void HostSetLineHook(void (*hook)(const char* line));
+void HostType(const char* text);
+
+// EEPROM contents carried between runs
+bool HostLoadEeprom(const char* path);
+bool HostSaveEeprom(const char* path);
+
+// Motors
+extern MoToStepper trickler, bulk;
+bool HostMotorsTurning();
+double HostPoweredSteps();
+
+#endif // HOST_RUNTIME_H
@@ -0,0 +1,195 @@
+// ParseBench.cpp
+// Times ParseScaleFrame() against the Arduino String path it replaced, checks both decode every frame to the same weight and that frames in other units are rejected, and reports the RAM each path uses on the AVR
+// The String path is emulated the way the Arduino core's WString.cpp does it: the buffer starts empty and is realloc()ed for every character appended, then toFloat() calls atof()
+//
+// parse_bench [frames]
+//   frames             Number of frames decoded by each path (default 4000000)
+// Exits with 1 if the two paths disagree on any frame, or a frame is accepted or rejected wrongly
+
+// Standard library ahead of Arduino.h, whose min() and max() macros break it
+#include <chrono>
+
+#include "HostRuntime.h"
+#include "../Scale.h"
+
+#define BENCH_FRAMES 4000000 // Frames decoded by each path
+#define BENCH_FRAME_SET 64 // Distinct frames cycled through, so neither path sees a constant input
+#define NU_FRAME_LEN 9 // Sign and 8 characters of digits and decimal point
+
+// AVR type sizes, the AVR packs structs without padding
+#define AVR_LONG 4
+#define AVR_BYTE 1
+#define AVR_POINTER 2
+#define AVR_UNSIGNED_INT 2
+
+// BenchString
+// The parts of Arduino's String the old frame path used
+typedef struct
+{
+  char* buffer;
+  unsigned int capacity;
+  unsigned int len;
+} BenchString;
+
+static unsigned long allocations = 0;
+
+// stringConcat()
+// Appends one character, growing the buffer to fit exactly as String::concat(char) does
+static bool stringConcat(BenchString* string, char c)
+{
+  unsigned int newLen = string->len + 1;
+  if(newLen > string->capacity)
+  {
+    char* grown = (char*)realloc(string->buffer, newLen + 1);
+    allocations++;
+    if(!grown)
+    {
+      return false;
+    }
+    string->buffer = grown;
+    string->capacity = newLen;
+  }
+
+  string->buffer[string->len] = c;
+  string->buffer[newLen] = 0;
+  string->len = newLen;
+
+  return true;
+}
+
+// stringPath()
+// The old completeFrame() decode: copy the 8 digit characters into a String, check each one, then toFloat() and negate
+// Returns false if the frame holds an out of range character
+static bool stringPath(const char* frame, byte len, float* weight)
+{
+  BenchString asciiNum = {NULL, 0, 0};
+  bool isNegative = false;
+
+  if(len < NU_FRAME_LEN)
+  {
+    return false;
+  }
+
+  if(frame[0] == '-')
+  {
+    isNegative = true;
+  }
+
+  for(int j = 1; j < NU_FRAME_LEN; j++)
+  {
+    stringConcat(&asciiNum, frame[j]);
+
+    byte test = byte(frame[j]);
+    if(test < 46 || test > 57)
+    {
+      free(asciiNum.buffer);
+      return false;
+    }
+  }
+
+  *weight = atof(asciiNum.buffer);
+  if(isNegative)
+  {
+    *weight = *weight * -1;
+  }
+  free(asciiNum.buffer);
+
+  return true;
+}
+
+// makeFrames()
+// Fills the frame set with NU format weights from -1 to 300 grains in whole divisions
+static void makeFrames(char frames[][NU_FRAME_LEN + 1])
+{
+  for(int i = 0; i < BENCH_FRAME_SET; i++)
+  {
+    long divisions = random(-50, 15000);
+    long hundredths = labs(divisions) * 2;
+    snprintf(frames[i], NU_FRAME_LEN + 1, "%c%05ld.%02ld", (divisions < 0) ? '-' : '+', hundredths / 100, hundredths % 100);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  unsigned long count = (argc > 1) ? strtoul(argv[1], NULL, 10) : BENCH_FRAMES;
+  char frames[BENCH_FRAME_SET][NU_FRAME_LEN + 1];
+  ScaleReading reading;
+  float weight = 0;
+
+  HostBegin(1);
+  makeFrames(frames);
+
+  // Both paths must agree before their times mean anything
+  unsigned long mismatches = 0;
+  for(int i = 0; i < BENCH_FRAME_SET; i++)
+  {
+    if(!ParseScaleFrame(frames[i], NU_FRAME_LEN, &reading) || !stringPath(frames[i], NU_FRAME_LEN, &weight) || GrainsToWeight(weight) != GrainsToWeight(DivisionsToGrains(reading.divisions)))
+    {
+      printf("Mismatch on frame %s\n", frames[i]);
+      mismatches++;
+    }
+  }
+
+  // Standard format frames are only weights in grains, or with no unit at all
+  const char* accepted[] = {"ST,+00032.04  GN", "US,-00000.12  GN", "ST,+00032.04"};
+  const char* rejected[] = {"ST,+00002.07  g", "ST,+00032.04 ozt", "XX,+00032.04  GN", "+0003A.04"};
+  for(size_t i = 0; i < sizeof(accepted) / sizeof(accepted[0]); i++)
+  {
+    if(!ParseScaleFrame(accepted[i], strlen(accepted[i]), &reading))
+    {
+      printf("Rejected frame %s\n", accepted[i]);
+      mismatches++;
+    }
+  }
+  for(size_t i = 0; i < sizeof(rejected) / sizeof(rejected[0]); i++)
+  {
+    if(ParseScaleFrame(rejected[i], strlen(rejected[i]), &reading))
+    {
+      printf("Accepted frame %s\n", rejected[i]);
+      mismatches++;
+    }
+  }
+
+  // volatile sinks stop the compiler dropping either loop
+  volatile long divisionSink = 0;
+  volatile float weightSink = 0;
+
+  allocations = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for(unsigned long i = 0; i < count; i++)
+  {
+    stringPath(frames[i % BENCH_FRAME_SET], NU_FRAME_LEN, &weight);
+    weightSink = weight;
+  }
+  double stringTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  unsigned long stringAllocations = allocations;
+
+  start = std::chrono::steady_clock::now();
+  for(unsigned long i = 0; i < count; i++)
+  {
+    ParseScaleFrame(frames[i % BENCH_FRAME_SET], NU_FRAME_LEN, &reading);
+    divisionSink = reading.divisions;
+  }
+  double parseTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+  printf("Decode time (this host, %lu frames each)\n", count);
+  printf("  String path:     %6.1f ns/frame, %.1f heap allocations/frame\n", stringTime / count, (double)stringAllocations / count);
+  printf("  ParseScaleFrame: %6.1f ns/frame, 0 heap allocations\n", parseTime / count);
+
+  // Sizes of what each path holds on the AVR, the firmware's ScaleSample is a ScaleReading and an unsigned long time
+  int readingSize = AVR_LONG + AVR_BYTE + AVR_BYTE;
+  int sampleSize = readingSize + AVR_LONG;
+  int stringSize = AVR_POINTER + AVR_UNSIGNED_INT + AVR_UNSIGNED_INT;
+  printf("RAM on the AVR\n");
+  printf("  ScaleReading: %d bytes (4 byte division count, header and unit)\n", readingSize);
+  printf("  Sample ring: %d x %d bytes = %d bytes, frame buffer: %d bytes, all static\n", SCALE_SAMPLE_COUNT, sampleSize, SCALE_SAMPLE_COUNT * sampleSize, SCALE_FRAME_LEN);
+  printf("  String path: %d byte String on the stack, %d reallocs of up to %d bytes on the heap for every frame\n", stringSize, NU_FRAME_LEN - 1, NU_FRAME_LEN);
+
+  if(mismatches)
+  {
+    printf("FAIL: %lu frames decoded wrongly\n", mismatches);
+    return 1;
+  }
+
+  return 0;
+}
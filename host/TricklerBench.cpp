@@ -0,0 +1,225 @@
+// TricklerBench.cpp
+// Runs the firmware's benchmark sweep (Benchmark.cpp) on the host and saves its results as a JSON file, or compares two results files
+//
+// trickler_bench --out FILE [--build NAME]
+//   Runs the sweep and writes its results to FILE, tagged with NAME (such as the commit being measured)
+// trickler_bench --compare BASELINE RESULTS
+//   Compares each profile and target weight in RESULTS with BASELINE, exits with 1 if any has regressed
+// --verbose prints every line the firmware prints while the sweep runs
+
+// Standard library ahead of Arduino.h, whose min() and max() macros break it
+#include <string>
+#include <vector>
+
+#include "HostRuntime.h"
+#include "../Benchmark.h"
+#include "../StateMachine.h"
+
+#define BENCH_SWEEP_LIMIT 36000000UL // Virtual time in ms the sweep must finish in
+#define BENCH_TIME_REGRESSION 1.1 // Throw time percentiles more than this ratio above the baseline are flagged
+#define BENCH_CONVERGE_REGRESSION 2 // Convergence taking more than this many extra charges is flagged
+
+// BenchResult
+// One line of a results file
+typedef struct
+{
+  char profile[64];
+  float target;
+  int charges;
+  BenchSummary summary;
+} BenchResult;
+
+static std::vector<std::string> results; // JSON objects the firmware printed
+static bool sweepDone = false;
+
+// collectResult()
+// Keeps the results the firmware prints
+static void collectResult(const char* line)
+{
+  if(!strncmp(line, "BENCH {", 7))
+  {
+    results.push_back(line + 6);
+  }
+  else if(!strcmp(line, "BENCH done"))
+  {
+    sweepDone = true;
+  }
+}
+
+// isSweepDone()
+// Stops the run once the firmware reports the end of the sweep
+static bool isSweepDone()
+{
+  return sweepDone;
+}
+
+// runSweep()
+// Runs the benchmark sweep from a fresh EEPROM and writes the results file
+// Returns the exit code
+static int runSweep(const char* path, const char* build, bool verbose)
+{
+  HostBegin(BENCH_SEED);
+
+  float target = 32;
+  float version = VERSION_MAJOR + (VERSION_MINOR * 0.1);
+  int direction = 1;
+  EEPROM.put(TARGET_MEMORY_ADDR, target);
+  EEPROM.put(VERSION_MEMORY_ADDR, version);
+  EEPROM.put(DIRECTION_MEMORY_ADDR, direction);
+
+  HostSetEcho(verbose);
+  HostSetLineHook(collectResult);
+  HostSetOperator(true);
+
+  setup();
+  HostRun(BENCH_SWEEP_LIMIT, isSweepDone);
+
+  if(!sweepDone)
+  {
+    fprintf(stderr, "Sweep did not finish in %lus of virtual time, %u configurations done\n", BENCH_SWEEP_LIMIT / 1000, (unsigned int)results.size());
+    return 1;
+  }
+
+  FILE* file = fopen(path, "w");
+  if(!file)
+  {
+    fprintf(stderr, "Could not write %s\n", path);
+    return 1;
+  }
+
+  fprintf(file, "{\n  \"build\": \"%s\",\n  \"seed\": %d,\n  \"virtual_seconds\": %lu,\n  \"results\": [\n", build, BENCH_SEED, (unsigned long)(HostMicros() / 1000000));
+  for(size_t i = 0; i < results.size(); i++)
+  {
+    fprintf(file, "    %s%s\n", results[i].c_str(), (i + 1 < results.size()) ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+
+  printf("%u configurations written to %s\n", (unsigned int)results.size(), path);
+  return 0;
+}
+
+// readResults()
+// Reads the results of a file written by runSweep(), one JSON object per line
+// Returns false if the file could not be read or held no results
+static bool readResults(const char* path, std::vector<BenchResult>* read)
+{
+  FILE* file = fopen(path, "r");
+  if(!file)
+  {
+    fprintf(stderr, "Could not read %s\n", path);
+    return false;
+  }
+
+  char line[256];
+  while(fgets(line, sizeof(line), file))
+  {
+    BenchResult result;
+    unsigned int overthrows = 0;
+    unsigned int converge = 0;
+    if(sscanf(line, " {\"profile\": \"%63[^\"]\", \"target\": %f, \"charges\": %d, \"p50_ms\": %u, \"p95_ms\": %u, \"p99_ms\": %u, \"overthrows\": %u, \"converge_charges\": %u",
+              result.profile, &result.target, &result.charges, &result.summary.p50, &result.summary.p95, &result.summary.p99, &overthrows, &converge) == 8)
+    {
+      result.summary.overthrows = overthrows;
+      result.summary.converge = converge;
+      read->push_back(result);
+    }
+  }
+  fclose(file);
+
+  if(read->empty())
+  {
+    fprintf(stderr, "No results in %s\n", path);
+    return false;
+  }
+
+  return true;
+}
+
+// compareResults()
+// Prints each configuration of the results next to the baseline, flagging those that regressed
+// Returns the exit code
+static int compareResults(const char* baselinePath, const char* resultsPath)
+{
+  std::vector<BenchResult> baseline;
+  std::vector<BenchResult> current;
+  if(!readResults(baselinePath, &baseline) || !readResults(resultsPath, &current))
+  {
+    return 2;
+  }
+
+  int regressions = 0;
+  printf("%-22s %7s %13s %13s %13s %9s %9s  status\n", "profile", "target", "p50_ms", "p95_ms", "p99_ms", "over", "converge");
+  for(size_t i = 0; i < current.size(); i++)
+  {
+    const BenchResult* now = &current[i];
+    const BenchResult* base = NULL;
+    for(size_t j = 0; j < baseline.size(); j++)
+    {
+      if(!strcmp(baseline[j].profile, now->profile) && baseline[j].target == now->target)
+      {
+        base = &baseline[j];
+      }
+    }
+
+    if(!base)
+    {
+      printf("%-22s %7.2f not in the baseline\n", now->profile, now->target);
+      continue;
+    }
+
+    const char* status = "ok";
+    if(now->summary.p50 > base->summary.p50 * BENCH_TIME_REGRESSION || now->summary.p95 > base->summary.p95 * BENCH_TIME_REGRESSION || now->summary.overthrows > base->summary.overthrows || now->summary.converge > base->summary.converge + BENCH_CONVERGE_REGRESSION)
+    {
+      status = "REGRESSION";
+      regressions++;
+    }
+
+    printf("%-22s %7.2f %6u>%-6u %6u>%-6u %6u>%-6u %4u>%-4u %4u>%-4u  %s\n", now->profile, now->target,
+           base->summary.p50, now->summary.p50, base->summary.p95, now->summary.p95, base->summary.p99, now->summary.p99,
+           base->summary.overthrows, now->summary.overthrows, base->summary.converge, now->summary.converge, status);
+  }
+
+  printf("%d of %u configurations regressed\n", regressions, (unsigned int)current.size());
+  return regressions ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+  const char* out = NULL;
+  const char* build = "unnamed";
+  bool verbose = false;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--compare") && i + 2 < argc)
+    {
+      return compareResults(argv[i + 1], argv[i + 2]);
+    }
+    else if(!strcmp(argv[i], "--out") && i + 1 < argc)
+    {
+      out = argv[++i];
+    }
+    else if(!strcmp(argv[i], "--build") && i + 1 < argc)
+    {
+      build = argv[++i];
+    }
+    else if(!strcmp(argv[i], "--verbose"))
+    {
+      verbose = true;
+    }
+    else
+    {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  if(!out)
+  {
+    fprintf(stderr, "Usage: trickler_bench --out FILE [--build NAME] | --compare BASELINE RESULTS\n");
+    return 2;
+  }
+
+  return runSweep(out, build, verbose);
+}
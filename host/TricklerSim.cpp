@@ -0,0 +1,181 @@
+// TricklerSim.cpp
+// Runs the firmware against the simulated powder and scale for a length of virtual time, then summarises the charges it threw
+//
+// trickler_sim [options]
+//   --seconds N        Virtual time to run for (default 1200)
+//   --seed N           Random seed for the powder and scale (default 1)
+//   --target GR        Target weight saved before startup (default 32)
+//   --powder K,KS,B,BS Kernel weight, kernel spread, bulk grains/rev and bulk spread (default Simulator.h)
+//   --scale M,TAU,N    Scale model (SIM_SCALE_*), settle time constant in ms and noise in divisions (default Simulator.h)
+//   --eeprom FILE      Start from and save the EEPROM contents in FILE, so a run can pick up where the last one stopped
+//   --type MS:TEXT;... Type TEXT into the USB serial port at each virtual time in ms
+//   --quiet            Only print the summary, not every line the firmware prints
+
+// Standard library ahead of Arduino.h, whose min() and max() macros break it
+#include <vector>
+
+#include "HostRuntime.h"
+#include "../Simulator.h"
+#include "../StateMachine.h"
+
+// TypedText
+// Text typed into the USB serial port at a virtual time
+typedef struct
+{
+  unsigned long time;
+  std::string text;
+} TypedText;
+
+static std::vector<TypedText> typed;
+static size_t typedNext = 0;
+
+// Charge summary, from what the firmware reports
+static unsigned long charges = 0;
+static unsigned long long chargeTimeTotal = 0;
+static unsigned long overthrows = 0;
+static unsigned long unstable = 0;
+
+// typeText()
+// Types each queued text once its time is reached
+static void typeText()
+{
+  while(typedNext < typed.size() && (HostMicros() / 1000) >= typed[typedNext].time)
+  {
+    HostType(typed[typedNext].text.c_str());
+    typedNext++;
+  }
+}
+
+// countCharge()
+// Counts the charges, overthrows and unstable weights the firmware reports
+static void countCharge(const char* line)
+{
+  const char* evaluate = strstr(line, "Entered Evaluate state after ");
+  if(evaluate)
+  {
+    charges++;
+    chargeTimeTotal += strtoul(evaluate + strlen("Entered Evaluate state after "), NULL, 10);
+  }
+  if(strstr(line, "Overthrow detected in Evaluate"))
+  {
+    overthrows++;
+  }
+  if(strstr(line, "did not stabilize"))
+  {
+    unstable++;
+  }
+}
+
+// parseTyped()
+// Parses the --type list of MS:TEXT entries separated by semicolons
+static void parseTyped(const char* list)
+{
+  while(list && *list)
+  {
+    const char* colon = strchr(list, ':');
+    if(!colon)
+    {
+      return;
+    }
+    const char* end = strchr(colon + 1, ';');
+
+    TypedText entry;
+    entry.time = strtoul(list, NULL, 10);
+    entry.text = end ? std::string(colon + 1, end - colon - 1) : std::string(colon + 1);
+    typed.push_back(entry);
+
+    list = end ? end + 1 : NULL;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  unsigned long seconds = 1200;
+  unsigned long seed = 1;
+  float target = 32;
+  const char* eeprom = NULL;
+  bool quiet = false;
+  SimProfile profile = {SIM_KERNEL_WEIGHT, SIM_KERNEL_SPREAD, SIM_BULK_WEIGHT, SIM_BULK_SPREAD, SIM_BULK_DRIFT, SIM_SCALE_NOISE, SIM_SCALE_MODEL, SIM_SETTLE_TAU};
+
+  for(int i = 1; i < argc; i++)
+  {
+    const char* value = (i + 1 < argc) ? argv[i + 1] : "";
+    if(!strcmp(argv[i], "--seconds"))
+    {
+      seconds = strtoul(value, NULL, 10);
+      i++;
+    }
+    else if(!strcmp(argv[i], "--seed"))
+    {
+      seed = strtoul(value, NULL, 10);
+      i++;
+    }
+    else if(!strcmp(argv[i], "--target"))
+    {
+      target = atof(value);
+      i++;
+    }
+    else if(!strcmp(argv[i], "--powder"))
+    {
+      sscanf(value, "%f,%f,%f,%f", &profile.kernelWeight, &profile.kernelSpread, &profile.bulkWeight, &profile.bulkSpread);
+      i++;
+    }
+    else if(!strcmp(argv[i], "--scale"))
+    {
+      int model = profile.scaleModel;
+      int noise = profile.scaleNoise;
+      sscanf(value, "%d,%d,%d", &model, &profile.settleTau, &noise);
+      profile.scaleModel = model;
+      profile.scaleNoise = noise;
+      i++;
+    }
+    else if(!strcmp(argv[i], "--eeprom"))
+    {
+      eeprom = value;
+      i++;
+    }
+    else if(!strcmp(argv[i], "--type"))
+    {
+      parseTyped(value);
+      i++;
+    }
+    else if(!strcmp(argv[i], "--quiet"))
+    {
+      quiet = true;
+    }
+    else
+    {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  HostBegin(seed);
+
+  // Without saved contents, start as if an older firmware had done the first time setup
+  if(!eeprom || !HostLoadEeprom(eeprom))
+  {
+    float version = VERSION_MAJOR + (VERSION_MINOR * 0.1);
+    int direction = 1;
+    EEPROM.put(TARGET_MEMORY_ADDR, target);
+    EEPROM.put(VERSION_MEMORY_ADDR, version);
+    EEPROM.put(DIRECTION_MEMORY_ADDR, direction);
+  }
+
+  HostSetEcho(!quiet);
+  HostSetLineHook(countCharge);
+  HostSetTickHook(typeText);
+  HostSetOperator(true);
+
+  setup();
+  SimSetProfile(&profile);
+  HostRun(seconds * 1000);
+
+  if(eeprom)
+  {
+    HostSaveEeprom(eeprom);
+  }
+
+  printf("SIM charges=%lu mean_ms=%.0f overthrows=%lu unstable=%lu\n", charges, charges ? (double)chargeTimeTotal / charges : 0.0, overthrows, unstable);
+  return 0;
+}
@@ -0,0 +1,138 @@
+// Arduino.h
+// Host stand-in for the Arduino core, just enough of it for the trickler firmware
+// Time, pins and the serial ports are implemented by HostRuntime.cpp on a virtual clock
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define PROGMEM
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define sq(x) ((x) * (x))
+#define digitalPinToInterrupt(pin) (pin)
+#define noInterrupts()
+#define interrupts()
+
+// Time
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long duration);
+void delayMicroseconds(unsigned int duration);
+
+// Pins
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode);
+
+// Random numbers
+long random(long howBig);
+long random(long howSmall, long howBig);
+void randomSeed(unsigned long seed);
+
+// Print
+// Formats values the way the Arduino core does, integers in any base and floats to a number of decimal places
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    size_t write(const char* text) { size_t n = 0; while(*text) { n += write((uint8_t)*text++); } return n; }
+
+    size_t print(const char* text) { return write(text); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char value, int base = DEC) { return printNumber(value, base); }
+    size_t print(int value, int base = DEC) { return printSigned(value, base); }
+    size_t print(unsigned int value, int base = DEC) { return printNumber(value, base); }
+    size_t print(long value, int base = DEC) { return printSigned(value, base); }
+    size_t print(unsigned long value, int base = DEC) { return printNumber(value, base); }
+    size_t print(double value, int digits = 2) { char text[48]; snprintf(text, sizeof(text), "%.*f", digits, value); return write(text); }
+
+    template<typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+    template<typename T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+    size_t println() { return write("\r\n"); }
+
+  private:
+    size_t printSigned(long value, int base)
+    {
+      if(base == DEC && value < 0)
+      {
+        return write((uint8_t)'-') + printNumber(-(unsigned long)value, base);
+      }
+      return printNumber((unsigned long)value, base);
+    }
+
+    size_t printNumber(unsigned long value, int base)
+    {
+      if(base < 2)
+      {
+        return write((uint8_t)value);
+      }
+
+      char text[8 * sizeof(long) + 1];
+      char* digit = &text[sizeof(text) - 1];
+      *digit = 0;
+      do
+      {
+        unsigned long remainder = value % base;
+        value /= base;
+        *--digit = (remainder < 10) ? ('0' + remainder) : ('A' + remainder - 10);
+      } while(value);
+
+      return write(digit);
+    }
+};
+
+// Stream
+// Serial port, output is handed to the host runtime a line at a time and input comes from text it queues
+class Stream : public Print
+{
+  public:
+    using Print::write;
+    size_t write(uint8_t c) override;
+    void begin(unsigned long baud) {}
+    int available();
+    int read();
+    operator bool() { return true; }
+
+    std::string input;
+    std::string line;
+};
+
+class HardwareSerial : public Stream
+{
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+#endif // ARDUINO_H
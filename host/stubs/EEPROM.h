@@ -0,0 +1,28 @@
+// EEPROM.h
+// Host stand-in for the Arduino EEPROM library, the Nano Every's 256 bytes held in RAM
+// HostLoadEeprom() and HostSaveEeprom() carry the contents between runs
+
+#ifndef EEPROM_H
+#define EEPROM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define EEPROM_SIZE 256
+
+class EEPROMClass
+{
+  public:
+    uint8_t read(int address) { return memory[address]; }
+    void write(int address, uint8_t value) { memory[address] = value; }
+    void update(int address, uint8_t value) { memory[address] = value; }
+    uint16_t length() { return EEPROM_SIZE; }
+    template<typename T> T& get(int address, T& value) { memcpy(&value, &memory[address], sizeof(T)); return value; }
+    template<typename T> const T& put(int address, const T& value) { memcpy(&memory[address], &value, sizeof(T)); return value; }
+
+    uint8_t memory[EEPROM_SIZE];
+};
+
+extern EEPROMClass EEPROM;
+
+#endif // EEPROM_H
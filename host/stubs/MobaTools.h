@@ -0,0 +1,55 @@
+// MobaTools.h
+// Host stand-in for the MobaTools stepper library
+// Motors step continuously on the virtual clock at the set speed, reversals ramp down first, and steps pulsed while the driver enable line is off are counted as lost instead of turning the motor
+
+#ifndef MOBATOOLS_H
+#define MOBATOOLS_H
+
+#include <Arduino.h>
+
+#define STEPDIR 1
+
+class MoToStepper
+{
+  public:
+    MoToStepper(long stepsPerRev, uint8_t mode) : stepsPerRev(stepsPerRev) {}
+
+    uint8_t attach(uint8_t stepPin, uint8_t dirPin) { return 1; }
+    void attachEnable(uint8_t pin, uint16_t delay, bool active) { enablePin = pin; }
+    uint16_t setRampLen(uint16_t steps) { ramp = steps; return 0; }
+    uint16_t setSpeed(int rpm10);
+
+    void move(long steps);
+    void moveTo(long position);
+    void rotate(int8_t direction);
+    void stop();
+
+    long readSteps();
+    long stepsToDo();
+    uint8_t moving() { return stepsToDo() ? 100 : 0; }
+
+    // Host model, driven by HostRuntime.cpp
+    void update();
+    bool turning(); // Steps are being pulsed with the driver enabled
+    void cutDriver(); // The driver enable line was driven off
+
+    int enablePin = -1;
+    bool driverOff = false; // Driver disabled since the last move started
+    double poweredSteps = 0; // Steps the motor actually turned
+    double lostSteps = 0; // Steps pulsed while the driver was disabled
+
+  private:
+    void start();
+
+    long stepsPerRev;
+    long ramp = 10;
+    double position = 0;
+    long target = 0;
+    int direction = 0; // Continuous rotation direction, 0 when moving to a target
+    long pending = 0; // Target taken up once a reversal has ramped down
+    bool hasPending = false;
+    double stepsPerSecond = 0;
+    unsigned long long lastUpdate = 0;
+};
+
+#endif // MOBATOOLS_H
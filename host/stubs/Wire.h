@@ -0,0 +1,7 @@
+// Wire.h
+// Host stand-in for the Arduino I2C library, only the LCD uses it and the host LCD draws nothing
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#endif // WIRE_H
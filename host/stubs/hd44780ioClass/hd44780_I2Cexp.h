@@ -0,0 +1,13 @@
+// hd44780_I2Cexp.h
+// Host stand-in for the I2C backpack LCD class
+
+#ifndef HD44780_I2CEXP_H
+#define HD44780_I2CEXP_H
+
+#include <hd44780.h>
+
+class hd44780_I2Cexp : public hd44780
+{
+};
+
+#endif // HD44780_I2CEXP_H